@@ -0,0 +1,197 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+#include "ch55isp.h"
+
+// benchmark of flashing: many cycles of detect/getver/erase/write/verify/end
+// with JSON output of latencies of each command type and each phase;
+// with -F: cycles of hello/fill/write/CRC of custom bootloader (src/fastboot)
+
+static int help, iterations = 10, pipeline = 1, latency = 1000, bootver = 240, errrate = 0;
+static int retries = CH55_RETRIES, fastboot = 0, bytetime = 0, uartbaud = CH55_UARTMAXBAUD;
+static char *emulate = NULL, *binname = NULL, *outfile = NULL, *uart = NULL;
+
+static myoption cmdlnopts[] = {
+    {"help",    NO_ARGS,    NULL,   'h',    arg_int,    APTR(&help),        _("show this help")},
+    {"binname", NEED_ARG,   NULL,   'b',    arg_string, APTR(&binname),     _("binary file to flash (default: random data of full flash size)")},
+    {"iterations",NEED_ARG, NULL,   'n',    arg_int,    APTR(&iterations),  _("amount of flashing cycles (default: 10)")},
+    {"pipeline",NEED_ARG,   NULL,   'p',    arg_int,    APTR(&pipeline),    _("amount of write/verify packets in flight (default: 1)")},
+    {"emulate", NEED_ARG,   NULL,   'E',    arg_string, APTR(&emulate),     _("use software bootloader emulator of given chip instead of USB device")},
+    {"latency", NEED_ARG,   NULL,   0,      arg_int,    APTR(&latency),     _("emulator: latency of each transaction, us (default: 1000)")},
+    {"bootver", NEED_ARG,   NULL,   0,      arg_int,    APTR(&bootver),     _("emulator: bootloader version (default: 240)")},
+    {"errrate", NEED_ARG,   NULL,   0,      arg_int,    APTR(&errrate),     _("emulator: probability of lost answer, 1/1000 (default: 0)")},
+    {"bytetime",NEED_ARG,   NULL,   0,      arg_int,    APTR(&bytetime),    _("emulator: transfer time of each byte, ns (default: 0; ~700 for full speed USB)")},
+    {"uart",    NEED_ARG,   NULL,   'u',    arg_string, APTR(&uart),        _("use UART ISP bootloader on given serial port (or pseudo-terminal of ch55uartsim)")},
+    {"uartbaud",NEED_ARG,   NULL,   0,      arg_int,    APTR(&uartbaud),    _("max baud rate of UART ISP to negotiate (default: 1000000)")},
+    {"fastboot",NO_ARGS,    NULL,   'F',    arg_int,    APTR(&fastboot),    _("use custom bootloader (src/fastboot) instead of WCH ISP")},
+    {"retries", NEED_ARG,   NULL,   'R',    arg_int,    APTR(&retries),     _("max amount of retries of each transaction (default: 3)")},
+    {"output",  NEED_ARG,   NULL,   'o',    arg_string, APTR(&outfile),     _("output JSON file (default: stdout)")},
+    end_option
+};
+
+// phases of one cycle (names by flashphase_str() as in reports of ch55tool)
+static const flashphase phaselist[] = {PHASE_DETECT, PHASE_GETVER, PHASE_ERASE, PHASE_WRITE, PHASE_VERIFY, PHASE_END};
+#define NPHASES (sizeof(phaselist) / sizeof(phaselist[0]))
+
+static const struct{
+    uint8_t code;
+    const char *name;
+} cmdnames[] = {
+    {0xa1, "detect"},
+    {0xa7, "read_cfg"},
+    {0xa3, "send_key"},
+    {0xa4, "erase"},
+    {0xa5, "write"},
+    {0xa6, "verify"},
+    {0xa2, "end"},
+}, fbcmdnames[] = {
+    {CH55FB_HELLO, "hello"},
+    {CH55FB_FILL, "fill"},
+    {CH55FB_CRC, "crc"},
+};
+
+// make temporary file with random data
+static char *mkimage(size_t size){
+    static char name[] = "/tmp/ch55benchXXXXXX";
+    int fd = mkstemp(name);
+    if(fd < 0) ERR("mkstemp()");
+    uint8_t *buf = MALLOC(uint8_t, size);
+    srand(size);
+    for(size_t i = 0; i < size; ++i) buf[i] = rand() & 0xff;
+    if((ssize_t)size != write(fd, buf, size)) ERR("write()");
+    close(fd);
+    FREE(buf);
+    return name;
+}
+
+static void printlat(FILE *f, const char *name, ch55latency *l, int last){
+    fprintf(f, "    \"%s\": {\"count\": %zu, \"p50_us\": %.1f, \"p99_us\": %.1f}%s\n", name, l->n,
+            ch55_percentile(l, 50.) * 1e6, ch55_percentile(l, 99.) * 1e6, last ? "" : ",");
+}
+
+int main(int argc, char **argv){
+    initial_setup();
+    parseargs(&argc, &argv, cmdlnopts);
+    if(help) showhelp(-1, cmdlnopts);
+    if(iterations < 1) ERRX(_("Wrong amount of iterations"));
+    ch55transport *t;
+    if(emulate){
+        const ch55descr *d = ch55_getdescrbyname(emulate);
+        if(!d) ERRX(_("Unknown chip %s"), emulate);
+        ch55emulconf conf = {.chipid = d->chipid, .id = {0x12, 0x34, 0x56, 0x78},
+                             .latency = latency, .erasetime = 100 * latency, .errrate = errrate, .bytetime = bytetime,
+                             .version = {(bootver / 100) % 10, (bootver / 10) % 10, bootver % 10}};
+        t = fastboot ? ch55_fbemulator(&conf) : ch55_emulator(&conf);
+    }else if(uart){
+        if(fastboot) ERRX(_("Custom bootloader works only over USB"));
+        t = ch55_uarttransport(uart, uartbaud);
+    }else t = fastboot ? ch55_usbtransport_id(CH55FB_VID, CH55FB_PID, NULL) : ch55_usbtransport(NULL);
+    int baud = ch55_uartbaud(t);
+    t = ch55_stattransport(t);
+    if(!t) ERRX(_("Can't open device"));
+    ch55session *s = NULL;
+    ch55fbinfo info;
+    const ch55descr *descr;
+    char version[32];
+    size_t maxsize;
+    if(fastboot){
+        if(ch55_fbhello(t, &info)) ERRX(_("Chip not found"));
+        descr = info.descr;
+        maxsize = info.maxsize;
+        snprintf(version, 32, "fb%d", info.version);
+        if(pipeline < 2) pipeline = CH55FB_DEPTH;
+    }else{
+        s = ch55_open_transport(t);
+        if(!s) ERRX(_("Can't open device"));
+        ch55_setpipeline(s, pipeline);
+        ch55_setretries(s, retries);
+        descr = ch55_detect_chip(s);
+        if(!descr) ERRX(_("Chip not found"));
+        const char *ver = ch55_getver(s);
+        if(!ver) ERRX(_("Bad chip version"));
+        maxsize = descr->flash_size;
+        snprintf(version, 32, "%s", ver);
+    }
+    ch55stats *stats = ch55_getstats(t);
+    char *imagename = binname;
+    if(!imagename) imagename = mkimage(maxsize);
+    ch55image *image = ch55_loadimage(imagename);
+    if(!image) ERRX(_("Can't load %s"), imagename);
+    long imgsize = image->len;
+    ch55_resetstats(stats);
+    int retr0 = s ? ch55_getretries(s) : 0;
+    ch55latency phases[PHASE_AMOUNT] = {0}, total = {0};
+    int failed = 0;
+    for(int i = 0; i < iterations; ++i){
+        double t0 = dtime(), tp = t0, tn;
+#define PHASE(p, ok)  do{int _ok = (ok); tn = dtime(); ch55_addsample(&phases[p], tn - tp); tp = tn; \
+        if(!_ok){WARNX(_("Iteration %d: %s failed"), i, flashphase_str(p)); ++failed; goto nextiter;}}while(0)
+        if(fastboot){ // erase: clear space after image, verify: CRC of whole space
+            size_t end = (image->len + 1) & ~(size_t)1;
+            PHASE(PHASE_DETECT, ch55_fbhello(t, &info) == 0);
+            PHASE(PHASE_ERASE, end >= maxsize || ch55_fbfill(t, end, maxsize - end) == 0);
+            PHASE(PHASE_WRITE, ch55_fbwrite(t, &info, image, pipeline) == 0);
+            PHASE(PHASE_VERIFY, ch55_fbcompare(t, &info, image) == 0);
+        }else{
+            PHASE(PHASE_DETECT, ch55_detect_chip(s) != NULL);
+            PHASE(PHASE_GETVER, ch55_getver(s) != NULL);
+            PHASE(PHASE_ERASE, ch55_erasechip(s) == 0);
+            PHASE(PHASE_WRITE, ch55_writeimage(s, image) == 0);
+            PHASE(PHASE_VERIFY, ch55_verifyimage(s, image) == 0);
+            PHASE(PHASE_END, ch55_endflash(s) == 0);
+        }
+#undef PHASE
+        ch55_addsample(&total, dtime() - t0);
+nextiter:
+        fprintf(stderr, "\r%d/%d", i + 1, iterations);
+    }
+    fprintf(stderr, "\n");
+    FILE *o = stdout;
+    if(outfile && !(o = fopen(outfile, "w"))) ERR(_("Can't open %s"), outfile);
+    fprintf(o, "{\n  \"transport\": \"%s\",\n  \"chip\": \"%s\",\n  \"version\": \"%s\",\n", t->name, descr->devname, version);
+    if(emulate) fprintf(o, "  \"emulator_latency_us\": %d,\n  \"emulator_bytetime_ns\": %d,\n", latency, bytetime);
+    if(baud) fprintf(o, "  \"uart_baud\": %d,\n", baud);
+    fprintf(o, "  \"iterations\": %d,\n  \"failed\": %d,\n  \"pipeline\": %d,\n  \"image_size\": %ld,\n", iterations, failed, pipeline, imgsize);
+    fprintf(o, "  \"packets\": %zu,\n  \"bytes_out\": %zu,\n  \"bytes_in\": %zu,\n  \"errors\": %zu,\n  \"retries\": %d,\n",
+            stats->packets, stats->bytesout, stats->bytesin, stats->errors, s ? ch55_getretries(s) - retr0 : 0);
+    fprintf(o, "  \"commands\": {\n");
+    int N = fastboot ? sizeof(fbcmdnames) / sizeof(fbcmdnames[0]) : sizeof(cmdnames) / sizeof(cmdnames[0]);
+    for(int i = 0; i < N; ++i){
+        if(fastboot) printlat(o, fbcmdnames[i].name, &stats->cmd[fbcmdnames[i].code], i == N - 1);
+        else printlat(o, cmdnames[i].name, &stats->cmd[cmdnames[i].code], i == N - 1);
+    }
+    fprintf(o, "  },\n  \"phases\": {\n");
+    for(size_t i = 0; i < NPHASES; ++i) printlat(o, flashphase_str(phaselist[i]), &phases[phaselist[i]], 0);
+    printlat(o, "total", &total, 1);
+    double tw = ch55_percentile(&phases[PHASE_WRITE], 50.), tv = ch55_percentile(&phases[PHASE_VERIFY], 50.);
+    fprintf(o, "  },\n  \"write_kBps\": %.2f,\n  \"verify_kBps\": %.2f,\n  \"device_total_s\": %.4f\n}\n",
+            tw > 0. ? imgsize / 1024. / tw : 0., tv > 0. ? imgsize / 1024. / tv : 0.,
+            ch55_percentile(&total, 50.));
+    if(o != stdout) fclose(o);
+    ch55_freeimage(&image);
+    if(!binname) unlink(imagename);
+    for(int i = 0; i < PHASE_AMOUNT; ++i) FREE(phases[i].t);
+    FREE(total.t);
+    if(s) ch55_close(&s);
+    else t->close(t);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // memmem
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "bootcheck.h"
+
+// check that new firmware started after reset: it appears with given VID:PID at the same USB port
+// and/or prints banner into its UART
+
+// interval of polling of USB port, ms
+#define BOOT_POLL   (10)
+
+static unsigned int appvid, apppid;
+
+/**
+ * @brief boot_init - check options of boot verification
+ * @param G (io) - parameters
+ * @return 0 if OK
+ */
+int boot_init(glob_pars *G){
+    if(G->waitapp){
+        if(sscanf(G->waitapp, "%x:%x", &appvid, &apppid) != 2 || appvid > 0xffff || apppid > 0xffff){
+            WARNX(_("Wrong VID:PID %s"), G->waitapp);
+            return 1;
+        }
+        if(G->emulate){
+            WARNX(_("Option --waitapp is ignored with -E"));
+            G->waitapp = NULL;
+        }
+    }
+    if(G->banner && !G->tty){
+        WARNX(_("Option --banner needs --tty"));
+        return 1;
+    }
+    if(G->banner && (G->gang || G->daemon || G->server)){
+        WARNX(_("Banner could be checked only in single device mode"));
+        return 1;
+    }
+    if((G->waitapp || G->banner) && G->dontrestart) WARNX(_("MCU isn't reset: boot isn't checked"));
+    if(G->boottimeout < 1){
+        WARNX(_("Wrong boot timeout"));
+        return 1;
+    }
+    return 0;
+}
+
+static speed_t baudrate(int b){
+    switch(b){
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 921600: return B921600;
+        default: return B0;
+    }
+}
+
+/**
+ * @brief boot_opentty - open serial port of firmware for banner (before reset, so its beginning isn't lost)
+ * @param G - parameters
+ * @return descriptor, -1 if there's no banner to wait or -2 if failed
+ */
+int boot_opentty(glob_pars *G){
+    if(!G->banner || G->dontrestart) return -1;
+    struct termios t;
+    speed_t speed = baudrate(G->baudrate);
+    if(speed == B0){
+        WARNX(_("Unsupported baud rate %d"), G->baudrate);
+        return -2;
+    }
+    int fd = open(G->tty, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0){
+        WARN(_("Can't open %s"), G->tty);
+        return -2;
+    }
+    if(tcgetattr(fd, &t) == 0){ // not a terminal (e.g. FIFO) is used as is
+        cfmakeraw(&t);
+        cfsetispeed(&t, speed);
+        cfsetospeed(&t, speed);
+        t.c_cflag |= CLOCAL | CREAD;
+        if(tcsetattr(fd, TCSANOW, &t)){
+            WARN(_("Can't setup %s"), G->tty);
+            close(fd);
+            return -2;
+        }
+        tcflush(fd, TCIFLUSH); // old output of previous firmware
+    }
+    return fd;
+}
+
+// check if firmware appeared at USB
+static int appfound(const ch55devaddr *pos){
+    char node[64];
+    if(pos->nports){
+        ch55devaddr a = *pos;
+        return !ch55_posdev(&a, appvid, apppid, node, sizeof(node));
+    }
+    ch55devaddr *list; // position unknown: any device with such VID:PID
+    int N = ch55_finddevs(appvid, apppid, &list);
+    FREE(list);
+    return N > 0;
+}
+
+/**
+ * @brief boot_wait - wait for firmware after reset (G->waitapp at the same USB port, G->banner on tty)
+ * @param G - parameters
+ * @param pos - position of bootloader
+ * @param tty - serial port opened by boot_opentty (closed here) or -1
+ * @return 0 if firmware started in time
+ */
+int boot_wait(glob_pars *G, const ch55devaddr *pos, int tty){
+    char buf[512];
+    size_t blen = G->banner ? strlen(G->banner) : 0, l = 0;
+    int usbok = !G->waitapp, ttyok = (tty < 0);
+    double t0 = dtime(), tmax = G->boottimeout / 1e3;
+    if(blen >= sizeof(buf)){
+        WARNX(_("Banner is too long"));
+        blen = sizeof(buf) - 1;
+    }
+    while(!(usbok && ttyok) && dtime() - t0 < tmax){
+        if(!usbok && appfound(pos)) usbok = 1;
+        if(ttyok){
+            usleep(BOOT_POLL * 1000);
+            continue;
+        }
+        struct pollfd p = {.fd = tty, .events = POLLIN};
+        if(poll(&p, 1, BOOT_POLL) < 1) continue;
+        ssize_t n = read(tty, buf + l, sizeof(buf) - l);
+        if(n <= 0) continue;
+        l += n;
+        if(memmem(buf, l, G->banner, blen)) ttyok = 1;
+        else if(l == sizeof(buf)){ // keep tail which could be the beginning of banner
+            memmove(buf, buf + l - blen, blen);
+            l = blen;
+        }
+    }
+    if(tty >= 0) close(tty);
+    if(!usbok) WARNX(_("Firmware %s didn't appear in %dms"), G->waitapp, G->boottimeout);
+    if(!ttyok) WARNX(_("Banner \"%s\" wasn't got in %dms"), G->banner, G->boottimeout);
+    return !(usbok && ttyok);
+}
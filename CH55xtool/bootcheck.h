@@ -0,0 +1,30 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef BOOTCHECK_H__
+#define BOOTCHECK_H__
+
+#include "cmdlnopts.h"
+#include "ch55isp.h"
+
+int boot_init(glob_pars *G);
+int boot_opentty(glob_pars *G);
+int boot_wait(glob_pars *G, const ch55devaddr *pos, int tty);
+
+#endif // BOOTCHECK_H__
@@ -0,0 +1,205 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "cache.h"
+
+// cache of last flashed images: file for each chip (name and ID bytes) in
+// $XDG_CACHE_HOME/ch55tool (or ~/.cache/ch55tool) with hash of each write packet
+
+#define CACHE_SIGN  "# ch55tool cache v1"
+
+/**
+ * @brief cache_path - make name of file in cache directory (and create the directory)
+ * @param name - name of file
+ * @param buf (o) - buffer for full name
+ * @param l - its length
+ * @return `buf` or NULL if can't
+ */
+char *cache_path(const char *name, char *buf, size_t l){
+    char dir[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if(xdg && *xdg) snprintf(dir, sizeof(dir), "%s", xdg);
+    else if(home && *home) snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else return NULL;
+    if(mkdir(dir, 0755) && errno != EEXIST) return NULL;
+    size_t L = strlen(dir);
+    snprintf(dir + L, sizeof(dir) - L, "/ch55tool");
+    if(mkdir(dir, 0755) && errno != EEXIST){
+        WARN(_("Can't create %s"), dir);
+        return NULL;
+    }
+    snprintf(buf, l, "%s/%s", dir, name);
+    return buf;
+}
+
+// make name of cache file of chip
+static char *cachename(const char *devname, const uint8_t *uid, char *buf, size_t l){
+    char name[64];
+    snprintf(name, sizeof(name), "%s-%02X%02X%02X%02X", devname, uid[0], uid[1], uid[2], uid[3]);
+    return cache_path(name, buf, l);
+}
+
+/**
+ * @brief cache_hash - FNV-1a hash of data
+ * @param data - data
+ * @param len - its length
+ * @return hash
+ */
+uint64_t cache_hash(const uint8_t *data, size_t len){
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < len; ++i){
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// FNV-1a hash of packet number `n` (tail of last packet is filled with erased value)
+static uint64_t pkthash(const ch55image *img, size_t n){
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t addr = n * CH55_PACKETLEN;
+    for(size_t i = 0; i < CH55_PACKETLEN; ++i, ++addr){
+        h ^= (addr < img->len) ? img->data[addr] : CH55_ERASED;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief cache_load - read cache of given chip
+ * @param devname - chip name
+ * @param uid - chip ID bytes
+ * @return cache or NULL if absent
+ */
+chipcache *cache_load(const char *devname, const uint8_t *uid){
+    char name[PATH_MAX], dev[16];
+    if(!cachename(devname, uid, name, sizeof(name))) return NULL;
+    FILE *f = fopen(name, "r");
+    if(!f) return NULL;
+    chipcache *c = NULL;
+    size_t N;
+    char sign[32];
+    if(!fgets(sign, sizeof(sign), f) || strncmp(sign, CACHE_SIGN, sizeof(CACHE_SIGN) - 1)
+       || fscanf(f, "%15s %zu", dev, &N) != 2 || strcmp(dev, devname) || N > 65536 / CH55_PACKETLEN + 1){
+        WARNX(_("Bad cache file %s"), name);
+        goto ret;
+    }
+    c = MALLOC(chipcache, 1);
+    c->npkts = N;
+    c->hash = MALLOC(uint64_t, N + 1);
+    for(size_t i = 0; i < N; ++i){
+        unsigned long long h;
+        if(fscanf(f, "%llx", &h) != 1){
+            WARNX(_("Bad cache file %s"), name);
+            cache_free(&c);
+            break;
+        }
+        c->hash[i] = h;
+    }
+ret:
+    fclose(f);
+    return c;
+}
+
+/**
+ * @brief cache_save - store hashes of image flashed into chip
+ * @param devname - chip name
+ * @param uid - chip ID bytes
+ * @param img - image
+ * @return 0 if OK
+ */
+int cache_save(const char *devname, const uint8_t *uid, const ch55image *img){
+    char name[PATH_MAX], tmp[PATH_MAX + 8];
+    if(!img || !cachename(devname, uid, name, sizeof(name))) return 1;
+    snprintf(tmp, sizeof(tmp), "%s.%d", name, getpid());
+    FILE *f = fopen(tmp, "w");
+    if(!f){
+        WARN(_("Can't open %s"), tmp);
+        return 1;
+    }
+    size_t N = (img->len + CH55_PACKETLEN - 1) / CH55_PACKETLEN;
+    fprintf(f, CACHE_SIGN "\n%s %zu\n", devname, N);
+    for(size_t i = 0; i < N; ++i) fprintf(f, "%016llx\n", (unsigned long long)pkthash(img, i));
+    if(fclose(f) || rename(tmp, name)){ // replace old file at once
+        WARN(_("Can't write %s"), name);
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief cache_drop - remove cache of chip (its flash content becomes unknown)
+ */
+void cache_drop(const char *devname, const uint8_t *uid){
+    char name[PATH_MAX];
+    if(cachename(devname, uid, name, sizeof(name))) unlink(name);
+}
+
+void cache_free(chipcache **c){
+    if(!c || !*c) return;
+    FREE((*c)->hash);
+    FREE(*c);
+}
+
+/**
+ * @brief cache_diff - find packets of image differing from cached ones
+ * (packets out of cached image are compared with erased packet, and so are packets
+ * of cached image beyond the end of new one: their old content is still in flash)
+ * @param c - cache
+ * @param img - image
+ * @param pkts (o) - allocated array with numbers of differing packets
+ * @return amount of packets differ
+ */
+size_t cache_diff(const chipcache *c, const ch55image *img, size_t **pkts){
+    size_t N = (img->len + CH55_PACKETLEN - 1) / CH55_PACKETLEN, n = 0;
+    ch55image empty = {0};
+    uint64_t ehash = pkthash(&empty, 0);
+    if(c->npkts > N) N = c->npkts;
+    *pkts = MALLOC(size_t, N + 1);
+    for(size_t i = 0; i < N; ++i){
+        uint64_t h = (i < c->npkts) ? c->hash[i] : ehash;
+        if(h != pkthash(img, i)) (*pkts)[n++] = i;
+    }
+    return n;
+}
+
+/**
+ * @brief cache_regions - print address ranges of given packets
+ * @param f - output file
+ * @param pkts - numbers of packets (sorted)
+ * @param n - their amount
+ */
+void cache_regions(FILE *f, const size_t *pkts, size_t n){
+    for(size_t i = 0; i < n;){
+        size_t j = i;
+        while(j + 1 < n && pkts[j + 1] == pkts[j] + 1) ++j;
+        fprintf(f, "%s0x%04zX-0x%04zX", i ? ", " : "", pkts[i] * CH55_PACKETLEN, (pkts[j] + 1) * CH55_PACKETLEN - 1);
+        i = j + 1;
+    }
+}
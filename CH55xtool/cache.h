@@ -0,0 +1,42 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+#ifndef CACHE_H__
+#define CACHE_H__
+
+#include <stdio.h>
+#include "ch55isp.h"
+
+// hashes of write packets of image last flashed into chip
+typedef struct{
+    size_t npkts;           // amount of packets
+    uint64_t *hash;         // hash of each packet
+} chipcache;
+
+char *cache_path(const char *name, char *buf, size_t l);
+uint64_t cache_hash(const uint8_t *data, size_t len);
+chipcache *cache_load(const char *devname, const uint8_t *uid);
+int cache_save(const char *devname, const uint8_t *uid, const ch55image *img);
+void cache_drop(const char *devname, const uint8_t *uid);
+void cache_free(chipcache **c);
+size_t cache_diff(const chipcache *c, const ch55image *img, size_t **pkts);
+void cache_regions(FILE *f, const size_t *pkts, size_t n);
+
+#endif // CACHE_H__
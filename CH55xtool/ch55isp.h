@@ -0,0 +1,139 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef CH55ISP_H__
+#define CH55ISP_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "transport.h"
+
+#define CH55VID     (0x4348)
+#define CH55PID     (0x55E0)
+// request of running firmware to restart into bootloader (see src/include/usbboot.h):
+// vendor request to device with wValue CH55_BOOTMAGIC or CDC line coding with baud rate CH55_BOOTBAUD
+#define CH55_BOOTREQ    (0xB0)
+#define CH55_BOOTMAGIC  (0x55AA)
+#define CH55_BOOTBAUD   (1200)
+#define EPOUT       (0x02)
+#define EPIN        (0x82)
+#define USB_TIMEOUT (2000)
+// UART ISP: commands are framed as 57 AB <command> <sum of its bytes>, answers as 55 AA <answer> <sum>;
+// bootloader starts at CH55_UARTBAUD, higher rate is set by command CH55_SETBAUD with 4 bytes of baud rate
+// (answer: status, max frames in flight bootloader accepts; 0 or 1 - next frame only after answer)
+#define CH55_UARTBAUD   (57600)
+#define CH55_SETBAUD    (0xC5)
+// default max baud rate to negotiate
+#define CH55_UARTMAXBAUD (1000000)
+// value of erased flash byte
+#define CH55_ERASED (0x00)
+// max amount of write/verify packets in flight
+#define CH55_MAXPIPELINE    (64)
+// size of data in write/verify packet
+#define CH55_PACKETLEN      (56)
+// default max amount of retries of each transaction
+#define CH55_RETRIES        (3)
+
+// custom bootloader (src/fastboot, protocol in src/include/fastboot.h): streaming write with windowed
+// acknowledgements, verification by CRC computed on chip
+#define CH55FB_VID      (0x1209)
+#define CH55FB_PID      (0x0002)
+#define CH55FB_HELLO    (0x01)
+#define CH55FB_WRITE    (0x02)
+#define CH55FB_FILL     (0x03)
+#define CH55FB_CRC      (0x04)
+#define CH55FB_RESET    (0x05)
+#define CH55FB_ANSLEN   (16)
+#define CH55FB_PACKETLEN (64)
+// amount of acknowledgement windows in flight
+#define CH55FB_DEPTH    (2)
+
+typedef struct{
+    char *devname;          // device name
+    uint16_t flash_size;    // flash size
+    uint8_t chipid;         // chip ID
+    uint16_t data_size;     // size of data flash
+} ch55descr;
+
+// firmware image in memory
+typedef struct{
+    uint8_t *data;          // image data
+    size_t len;             // its length
+    void *map;              // mapped file (if data isn't allocated)
+} ch55image;
+
+ch55image *ch55_loadimage(const char *filename);
+void ch55_freeimage(ch55image **img);
+
+// ISP session with one device: all protocol state lives here;
+// each function locks session, so one session could be used from several threads
+typedef struct ch55session ch55session;
+
+const ch55descr *ch55_getdescr(uint8_t chipid);
+const ch55descr *ch55_getdescrbyname(const char *name);
+int ch55_finddevs(uint16_t vid, uint16_t pid, ch55devaddr **list);
+int ch55_findalldevs(ch55devaddr **list);
+int ch55_appboot(uint16_t vid, uint16_t pid, const ch55devaddr *a);
+ch55session *ch55_open_transport(ch55transport *t);
+ch55session *ch55_open(const ch55devaddr *a);
+void ch55_close(ch55session **s);
+
+int ch55_usbcmd(ch55session *s, const uint8_t *data, int olen, int ilen);
+const uint8_t *ch55_getbuf(ch55session *s);
+ch55transport *ch55_gettransport(ch55session *s);
+const uint8_t *ch55_getuid(ch55session *s);
+const ch55descr *ch55_detect_chip(ch55session *s);
+const char *ch55_getver(ch55session *s);
+int ch55_erasechip(ch55session *s);
+int ch55_setpipeline(ch55session *s, int depth);
+int ch55_setretries(ch55session *s, int n);
+int ch55_getretries(ch55session *s);
+int ch55_setimage(ch55session *s, const ch55image *img);
+size_t ch55_usedpackets(ch55session *s, size_t *total);
+int ch55_writeimage(ch55session *s, const ch55image *img);
+int ch55_verifyimage(ch55session *s, const ch55image *img);
+int ch55_comparepackets(ch55session *s, const ch55image *img, const size_t *pkts, size_t npkts);
+int ch55_compareimage(ch55session *s, const ch55image *img);
+int ch55_dataerase(ch55session *s);
+int ch55_datawrite(ch55session *s, size_t offset, const uint8_t *data, size_t len);
+int ch55_dataread(ch55session *s, size_t offset, uint8_t *data, size_t len);
+int ch55_writeflash(ch55session *s, const char *filename);
+int ch55_verifyflash(ch55session *s, const char *filename);
+int ch55_compareflash(ch55session *s, const char *filename);
+int ch55_endflash(ch55session *s);
+int ch55_restart(ch55session *s);
+
+// session with custom bootloader
+typedef struct{
+    const ch55descr *descr; // chip
+    uint8_t version;        // bootloader version
+    uint8_t window;         // data packets between acknowledgements
+    uint16_t maxsize;       // max size of application (start of bootloader)
+    uint8_t uid[4];         // chip unique ID
+} ch55fbinfo;
+
+uint16_t ch55_crc16(uint16_t crc, const uint8_t *data, size_t len);
+int ch55_fbhello(ch55transport *t, ch55fbinfo *info);
+int ch55_fbwrite(ch55transport *t, const ch55fbinfo *info, const ch55image *img, int depth);
+int ch55_fbfill(ch55transport *t, size_t addr, size_t len);
+int ch55_fbcrc(ch55transport *t, size_t addr, size_t len, uint16_t *crc);
+int ch55_fbcompare(ch55transport *t, const ch55fbinfo *info, const ch55image *img);
+int ch55_fbreset(ch55transport *t);
+
+#endif // CH55ISP_H__
@@ -0,0 +1,127 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "cache.h"
+#include "client.h"
+#include "sockio.h"
+
+// client of job server: send job and images (if server haven't them yet), show progress
+
+// upload image if server asked for it
+static int upload(int fd, const char *hash, const ch55image *img, const ch55image *data){
+    char h[32];
+    for(int i = 0; i < 2; ++i){
+        const ch55image *x = i ? data : img;
+        if(!x) continue;
+        snprintf(h, sizeof(h), "%016llx", (unsigned long long)cache_hash(x->data, x->len));
+        if(strcmp(h, hash)) continue;
+        if(sock_printf(fd, "SIZE %zu\n", x->len)) return 1;
+        return sock_write(fd, x->data, x->len);
+    }
+    WARNX(_("Server asks for unknown image %s"), hash);
+    return 1;
+}
+
+// save content of data flash sent by server
+static int savedata(int fd, const char *name, size_t len, int quiet){
+    uint8_t *buf = MALLOC(uint8_t, len + 1);
+    int e = sock_read(fd, buf, len);
+    if(!e){
+        FILE *f = fopen(name, "w");
+        if(!f || len != fwrite(buf, 1, len, f)){
+            WARN(_("Can't write %s"), name);
+            e = 1;
+        }
+        if(f) fclose(f);
+        if(!e && !quiet) green(_("Data flash (%zu bytes) saved to %s\n"), len, name);
+    }
+    FREE(buf);
+    return e;
+}
+
+/**
+ * @brief flash_client - send job to server G->connect and wait for its result
+ * @param G - parameters of job (device selection, flags, data flash files)
+ * @param img - image to flash (or NULL)
+ * @return status of job
+ */
+flashstatus flash_client(glob_pars *G, const ch55image *img){
+    ch55image *data = NULL;
+    char line[1024], *p = line, *e = line + sizeof(line);
+    int quiet = G->report != NULL;
+    flashstatus ret = FLASH_OPEN;
+    if(G->datawrite && !(data = ch55_loadimage(G->datawrite))) return FLASH_IMAGE;
+    int fd = sock_unix(G->connect, 0);
+    if(fd < 0) goto ret;
+    p += snprintf(p, e - p, "JOB");
+    if(img) p += snprintf(p, e - p, " image=%016llx", (unsigned long long)cache_hash(img->data, img->len));
+    if(img && G->binname){ // name for report of server
+        p += snprintf(p, e - p, " name=");
+        if(p < e && sock_escape(p, e - p, G->binname)) p = e;
+        else p += strlen(p);
+    }
+    if(data) p += snprintf(p, e - p, " data=%016llx", (unsigned long long)cache_hash(data->data, data->len));
+    if(G->chip) p += snprintf(p, e - p, " chip=%s", G->chip);
+    if(G->chipid) p += snprintf(p, e - p, " chipid=%s", G->chipid);
+    if(G->bus) p += snprintf(p, e - p, " bus=%d", G->bus);
+    if(G->port) p += snprintf(p, e - p, " port=%s", G->port);
+    if(G->skipsame) p += snprintf(p, e - p, " skipsame=1");
+    if(G->dontrestart) p += snprintf(p, e - p, " dontrestart=1");
+    if(G->verifyonly) p += snprintf(p, e - p, " verifyonly=1");
+    if(G->dataread) p += snprintf(p, e - p, " dataread=1");
+    if(p >= e - 1 || sock_printf(fd, "%s\n", line)) goto ret;
+    while(sock_gets(fd, line, sizeof(line)) >= 0){
+        char s1[64], s2[64], s3[64];
+        int id, n;
+        double t;
+        size_t len;
+        DBG("Got '%s'", line);
+        if(sscanf(line, "NEED %63s", s1) == 1){
+            if(upload(fd, s1, img, data)) goto ret;
+        }else if(sscanf(line, "QUEUED %d %d", &id, &n) == 2){
+            if(!quiet) green(_("Job %d queued (%d before it)\n"), id, n);
+        }else if(sscanf(line, "START %d %63s %63s %63s", &id, s1, s2, s3) == 4){
+            if(!quiet) green(_("Job %d started on device %s: %s, chip ID %s\n"), id, s1, s2, s3);
+        }else if(sscanf(line, "PHASE %63s %lf", s1, &t) == 2){
+            if(!quiet) printf("  %-12s %.1fms\n", s1, 1e3 * t);
+        }else if(sscanf(line, "DATA %zu", &len) == 1){
+            if(!G->dataread || savedata(fd, G->dataread, len, quiet)) goto ret;
+        }else if(sscanf(line, "RESULT %d", &n) == 1){
+            ret = (n >= 0 && n < FLASH_STATUS_AMOUNT) ? (flashstatus) n : FLASH_OPEN;
+            // the rest is JSON report
+            while((n = read(fd, line, sizeof(line))) > 0)
+                if(quiet) fwrite(line, 1, n, stdout);
+            if(!quiet && ret != FLASH_OK) red("%s\n", flashstatus_str(ret));
+            goto ret;
+        }else if(!strncmp(line, "ERROR ", 6)){
+            WARNX(_("Server: %s"), line + 6);
+            goto ret;
+        }else WARNX(_("Unknown answer of server: %s"), line);
+    }
+    WARNX(_("Server closed connection"));
+ret:
+    if(fd >= 0) close(fd);
+    ch55_freeimage(&data);
+    return ret;
+}
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <strings.h>
 #include <math.h>
+#include "ch55isp.h"
 #include "cmdlnopts.h"
 #include "usefull_macros.h"
 
@@ -30,13 +31,22 @@
 static int help;
 static glob_pars  G;
 
-// default PID filename:
-#define DEFAULT_PIDFILE "/tmp/testcmdlnopts.pid"
+// default directory for lock files:
+#define DEFAULT_LOCKDIR "/tmp"
 
 //            DEFAULTS
 // default global parameters
 static glob_pars const Gdefault = {
-    .pidfile = DEFAULT_PIDFILE,
+    .lockdir = DEFAULT_LOCKDIR,
+    .fd = -1,
+    .pipeline = 1,
+    .hubcap = 4,
+    .retries = CH55_RETRIES,
+    .latency = 1000,
+    .bootver = 240,
+    .baudrate = 115200,
+    .boottimeout = 3000,
+    .uartbaud = CH55_UARTMAXBAUD,
 };
 
 /*
@@ -46,9 +56,44 @@ static glob_pars const Gdefault = {
 static myoption cmdlnopts[] = {
 // common options
     {"help",    NO_ARGS,    NULL,   'h',    arg_int,    APTR(&help),        _("show this help")},
-    {"pidfile", NEED_ARG,   NULL,   'P',    arg_string, APTR(&G.pidfile),   _("pidfile (default: " DEFAULT_PIDFILE ")")},
+    {"lockdir", NEED_ARG,   NULL,   'L',    arg_string, APTR(&G.lockdir),   _("directory for lock files of devices (default: " DEFAULT_LOCKDIR ")")},
+    {"bus",     NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.bus),       _("select device(s) on given USB bus")},
+    {"port",    NEED_ARG,   NULL,   0,      arg_string, APTR(&G.port),      _("select device(s) by port path from root hub (e.g. 2.3, prefix selects all behind hub)")},
+    {"appid",   NEED_ARG,   NULL,   'A',    arg_string, APTR(&G.appid),     _("restart running firmware with given VID:PID (hex, e.g. 1209:0001) into bootloader first")},
+    {"chip",    NEED_ARG,   NULL,   0,      arg_string, APTR(&G.chip),      _("select device by chip name (e.g. CH552)")},
+    {"path",    NEED_ARG,   NULL,   0,      arg_string, APTR(&G.path),      _("open device by its node (e.g. /dev/bus/usb/001/005 or $DEVNAME from udev) without enumeration")},
+    {"fd",      NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.fd),        _("use already opened device node with given file descriptor")},
+    {"uart",    NEED_ARG,   NULL,   'u',    arg_string, APTR(&G.uart),      _("flash through UART ISP bootloader on given serial port (e.g. /dev/ttyUSB0)")},
+    {"uartbaud",NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.uartbaud),  _("max baud rate of UART ISP to negotiate (default: 1000000)")},
+    {"chipid",  NEED_ARG,   NULL,   'i',    arg_string, APTR(&G.chipid),    _("select device by chip ID (8 hex digits, as in report)")},
     {"binname", NEED_ARG,   NULL,   'b',    arg_string, APTR(&G.binname),   _("name of binary file to flash")},
+    {"fastboot",NO_ARGS,    NULL,   'F',    arg_int,    APTR(&G.fastboot),  _("flash through custom bootloader (src/fastboot) instead of WCH ISP")},
     {"dontrestart",NO_ARGS, NULL,   'd',    arg_int,    APTR(&G.dontrestart),_("don't reset MCU after writing")},
+    {"waitapp", NEED_ARG,   NULL,   'W',    arg_string, APTR(&G.waitapp),   _("after reset wait for firmware with given VID:PID (hex) at the same USB port")},
+    {"tty",     NEED_ARG,   NULL,   0,      arg_string, APTR(&G.tty),       _("serial port of firmware (for --banner)")},
+    {"banner",  NEED_ARG,   NULL,   0,      arg_string, APTR(&G.banner),    _("after reset wait for given text on --tty")},
+    {"baudrate",NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.baudrate),  _("baud rate of --tty (default: 115200)")},
+    {"boottimeout",NEED_ARG,NULL,   0,      arg_int,    APTR(&G.boottimeout),_("max time from reset till firmware start, ms (default: 3000)")},
+    {"gang",    NO_ARGS,    NULL,   'g',    arg_int,    APTR(&G.gang),      _("flash all connected devices simultaneously")},
+    {"hubcap",  NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.hubcap),    _("gang: max amount of simultaneous sessions behind one hub, 0 - no limit (default: 4)")},
+    {"pipeline",NEED_ARG,   NULL,   'p',    arg_int,    APTR(&G.pipeline),  _("amount of write/verify packets in flight (default: 1)")},
+    {"verifyonly",NO_ARGS,  NULL,   'V',    arg_int,    APTR(&G.verifyonly),_("only compare flash with binary file (exit code 6 if differs)")},
+    {"skipsame",NO_ARGS,    NULL,   's',    arg_int,    APTR(&G.skipsame),  _("verify first and don't erase/write if flash already contains the same data")},
+    {"patch",   MULT_PAR,   NULL,   'S',    arg_string, APTR(&G.patches),   _("patch each unit's image: WHERE:TYPE[:ARGS], WHERE is address or symbol, TYPE is serial, mac, uid, time or csv; @ADDR is address in data flash (could be repeated)")},
+    {"mapfile", NEED_ARG,   NULL,   'M',    arg_string, APTR(&G.mapfile),   _("SDCC .map file for symbols of patches (default: name of binary file with .map)")},
+    {"dataread",NEED_ARG,   NULL,   0,      arg_string, APTR(&G.dataread),  _("save data flash content into given file (before writing)")},
+    {"datawrite",NEED_ARG,  NULL,   0,      arg_string, APTR(&G.datawrite), _("erase data flash and write given file into it")},
+    {"cache",   NO_ARGS,    NULL,   'c',    arg_int,    APTR(&G.cache),     _("remember flashed image of each chip to show changed regions (and check them first with -s)")},
+    {"retries", NEED_ARG,   NULL,   'R',    arg_int,    APTR(&G.retries),   _("max amount of retries of each transaction (default: 3)")},
+    {"emulate", NEED_ARG,   NULL,   'E',    arg_string, APTR(&G.emulate),   _("use software bootloader emulator of given chip (e.g. CH552) instead of USB device")},
+    {"latency", NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.latency),   _("emulator: latency of each transaction, us (default: 1000)")},
+    {"bootver", NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.bootver),   _("emulator: bootloader version, 230, 231 or 240 (default: 240)")},
+    {"errrate", NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.errrate),   _("emulator: probability of lost answer, 1/1000 (default: 0)")},
+    {"report",  NEED_ARG,   NULL,   'r',    arg_string, APTR(&G.report),    _("print report in given format (json)")},
+    {"trace",   NEED_ARG,   NULL,   't',    arg_string, APTR(&G.trace),     _("record all transactions into given binary file (see ch55replay)")},
+    {"server",  NEED_ARG,   NULL,   0,      arg_string, APTR(&G.server),    _("run job server on given Unix socket: own all bootloaders and flash them by jobs of clients")},
+    {"connect", NEED_ARG,   NULL,   'C',    arg_string, APTR(&G.connect),   _("don't open device, send job to server on given Unix socket")},
+    {"daemon",  NO_ARGS,    NULL,   'D',    arg_int,    APTR(&G.daemon),    _("wait for bootloaders and flash each of them as soon as it appears")},
    end_option
 };
 
@@ -71,6 +116,12 @@ glob_pars *parse_args(int argc, char **argv){
     // parse arguments
     parseargs(&argc, &argv, cmdlnopts);
     if(help) showhelp(-1, cmdlnopts);
+    if(G.report && strcmp(G.report, "json")){
+        WARNX(_("Unknown report format: %s"), G.report);
+        showhelp(-1, cmdlnopts);
+    }
+    if(G.uart && (G.gang || G.daemon || G.server || G.fastboot))
+        ERRX(_("UART ISP works only in single device mode with WCH bootloader"));
     if(argc > 0){
         G.rest_pars_num = argc;
         G.rest_pars = MALLOC(char *, argc);
@@ -25,9 +25,44 @@
  * here are some typedef's for global data
  */
 typedef struct{
-    char *pidfile;          // name of PID file
+    char *lockdir;          // directory for lock files of devices
+    int bus;                // select device by bus number
+    char *port;             //   and/or port path
+    char *path;             // device node of bootloader
+    int fd;                 // file descriptor of opened device node (-1 if none)
+    char *uart;             // serial port of UART ISP bootloader
+    int uartbaud;           //   max baud rate to negotiate
+    char *chipid;           // select device by chip ID (hex)
+    char *chip;             // select device by chip name
+    char *appid;            // VID:PID of running firmware to restart into bootloader
+    int fastboot;           // flash through custom bootloader (src/fastboot)
+    int verifyonly;         // only compare flash with image
+    char *server;           // run job server on given Unix socket
+    char *connect;          // send job to server on given Unix socket
     char *binname;          // name of binary file
     int dontrestart;        // don't restart after writing
+    char *waitapp;          // VID:PID of firmware to wait for after reset
+    char *tty;              // serial port of firmware
+    char *banner;           //   and text it prints after start
+    int baudrate;           //   its baud rate
+    int boottimeout;        // max time from reset till firmware start, ms
+    int gang;               // flash all connected devices simultaneously
+    int hubcap;             // gang: max amount of simultaneous sessions per hub (0 - no limit)
+    int pipeline;           // amount of write/verify packets in flight
+    int skipsame;           // don't erase/write if flash already have the same data
+    int retries;            // max amount of retries of each transaction
+    char **patches;         // per-unit patches of image (WHERE:TYPE[:ARGS])
+    char *mapfile;          // SDCC .map file to find symbols of patches
+    char *dataread;         // file to save data flash content
+    char *datawrite;        // file to write into data flash
+    int cache;              // keep hashes of flashed images to find changed regions
+    char *emulate;          // name of chip to emulate (instead of USB device)
+    int latency;            // emulator: transaction latency, us
+    int bootver;            // emulator: bootloader version
+    int errrate;            // emulator: probability of lost answer, 1/1000
+    char *report;           // format of report ("json")
+    char *trace;            // file for binary trace of transactions
+    int daemon;             // wait for devices and flash them when appear
     int rest_pars_num;      // number of rest parameters
     char** rest_pars;       // the rest parameters: array of char*
 } glob_pars;
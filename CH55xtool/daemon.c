@@ -0,0 +1,224 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libusb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <usefull_macros.h>
+
+#include "daemon.h"
+#include "devsel.h"
+#include "report.h"
+
+// hotplug-driven flashing: one libusb context, one worker thread per arrived device
+
+typedef struct{
+    glob_pars *G;
+    const ch55image *img;
+    libusb_context *ctx;
+    libusb_device *dev;
+    ch55devaddr pos;        // its position
+    int lockfd;             //   and lock
+} dworker;
+
+static pthread_mutex_t outmutex = PTHREAD_MUTEX_INITIALIZER; // lock output and counters
+static pthread_cond_t idlecond = PTHREAD_COND_INITIALIZER;    // signaled when worker ends
+static int nflashed = 0, nfailed = 0, nworkers = 0;
+
+// polling interval of stop flag, us
+#define STOP_POLL   (100000)
+
+// positions of devices being flashed: device re-enumerated after failure is reopened by its
+// worker, so its new arrival should be ignored
+typedef struct{
+    uint8_t bus;
+    uint8_t ports[8];
+    int nports;
+} portpos;
+#define MAXBUSY     (128)
+static portpos busy[MAXBUSY];
+static int nbusy = 0;
+static pthread_mutex_t busymutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief setbusy - mark position of device as busy or free
+ * @param dev - device
+ * @param set - ==1 to mark busy, ==0 to free
+ * @return 1 if `set` and device position is already busy (or no more room)
+ */
+static int setbusy(libusb_device *dev, int set){
+    portpos p = {.bus = libusb_get_bus_number(dev)};
+    p.nports = libusb_get_port_numbers(dev, p.ports, sizeof(p.ports));
+    if(p.nports < 1) return 0; // unknown position
+    int ret = 0, i;
+    pthread_mutex_lock(&busymutex);
+    for(i = 0; i < nbusy; ++i)
+        if(busy[i].bus == p.bus && busy[i].nports == p.nports && !memcmp(busy[i].ports, p.ports, p.nports)) break;
+    if(set){
+        if(i < nbusy || nbusy == MAXBUSY) ret = 1;
+        else busy[nbusy++] = p;
+    }else if(i < nbusy) busy[i] = busy[--nbusy];
+    pthread_mutex_unlock(&busymutex);
+    return ret;
+}
+
+// worker ended: free its data and wake flash_daemon() waiting for the last one
+static void workerdone(dworker *w){
+    FREE(w);
+    pthread_mutex_lock(&outmutex);
+    --nworkers;
+    pthread_cond_signal(&idlecond);
+    pthread_mutex_unlock(&outmutex);
+}
+
+static void *worker(void *arg){
+    dworker *w = (dworker*) arg;
+    flashresult res = {0};
+    res.pos = w->pos;
+    double t0 = dtime();
+    ch55session *s = mksession(w->G, ch55_usbtransport_dev(w->ctx, w->dev));
+    res.phases[PHASE_OPEN] = dtime() - t0;
+    if(s && !sessmatch(w->G, s)){ // chip is known only after opening: leave other devices untouched
+        DBG("Skip device at %d:%d", res.pos.bus, res.pos.addr);
+        ch55_close(&s);
+        devunlock(&w->lockfd);
+        setbusy(w->dev, 0);
+        libusb_unref_device(w->dev);
+        workerdone(w);
+        return NULL;
+    }
+    if(!s){
+        res.status = FLASH_OPEN;
+        res.time = res.phases[PHASE_OPEN];
+    }else{
+        flashchip(s, w->G, w->img, 1, &res);
+        ch55_close(&s);
+    }
+    devunlock(&w->lockfd);
+    setbusy(w->dev, 0);
+    libusb_unref_device(w->dev);
+    pthread_mutex_lock(&outmutex);
+    if(res.status == FLASH_OK) ++nflashed;
+    else ++nfailed;
+    if(w->G->report) report_json(stdout, w->G, &res, 1, NULL, 0, res.time);
+    else{
+        printf("%03d:%03d  %-6s %-6s %.2fs %s: ", res.pos.bus, res.pos.addr, res.devname, res.version,
+               res.time, res.skipped ? _("same") : _("flashed"));
+        if(res.hasserial) printf(_("serial %llu, "), res.serial);
+        if(res.retries) printf(_("%zu retries, "), res.retries);
+        if(res.status == FLASH_OK) green("%s", flashstatus_str(res.status));
+        else red("%s", flashstatus_str(res.status));
+        printf(_(" (total: %d OK, %d failed)\n"), nflashed, nfailed);
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&outmutex);
+    workerdone(w);
+    return NULL;
+}
+
+static int LIBUSB_CALL hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event ev, void *data){
+    if(ev != LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) return 0;
+    ch55devaddr pos = {.bus = libusb_get_bus_number(dev), .addr = libusb_get_device_address(dev)};
+    int n = libusb_get_port_numbers(dev, pos.ports, sizeof(pos.ports));
+    pos.nports = (n > 0) ? n : 0;
+    dworker *w = (dworker*) data;
+    if(flash_stopped() || !devmatch(w->G, &pos)) return 0;
+    if(setbusy(dev, 1)){
+        DBG("Device at %d:%d is busy", pos.bus, pos.addr);
+        return 0;
+    }
+    int lockfd = devlock(w->G, &pos); // device could be flashed by another copy of tool
+    if(lockfd < 0){
+        setbusy(dev, 0);
+        return 0;
+    }
+    w = MALLOC(dworker, 1);
+    *w = *(dworker*) data;
+    w->pos = pos;
+    w->lockfd = lockfd;
+    w->ctx = ctx;
+    w->dev = libusb_ref_device(dev);
+    DBG("New device at %d:%d", libusb_get_bus_number(dev), libusb_get_device_address(dev));
+    pthread_t thread;
+    pthread_mutex_lock(&outmutex);
+    ++nworkers;
+    pthread_mutex_unlock(&outmutex);
+    if(pthread_create(&thread, NULL, worker, w)){
+        WARN("pthread_create()");
+        devunlock(&w->lockfd);
+        setbusy(w->dev, 0);
+        libusb_unref_device(w->dev);
+        workerdone(w);
+    }else pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * @brief flash_daemon - wait for bootloaders and flash them as soon as they appear
+ * (works until signal got, then waits for workers, so trace could be closed after return)
+ * @param G - parameters
+ * @param img - image to flash
+ * @return error code (if can't start or libusb failed) or FLASH_OK if stopped by signal
+ */
+flashstatus flash_daemon(glob_pars *G, const ch55image *img){
+    libusb_context *ctx = NULL;
+    libusb_hotplug_callback_handle cbh;
+    if(!img){
+        WARNX(_("Daemon mode needs binary file"));
+        return FLASH_IMAGE;
+    }
+    if(libusb_init(&ctx)){
+        WARNX("libusb_init()");
+        return FLASH_OPEN;
+    }
+    if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)){
+        WARNX(_("Hotplug isn't supported on this platform"));
+        libusb_exit(ctx);
+        return FLASH_OPEN;
+    }
+    static dworker proto; // data common for all workers
+    proto.G = G;
+    proto.img = img;
+    if(libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+            CH55VID, CH55PID, LIBUSB_HOTPLUG_MATCH_ANY, hotplug, &proto, &cbh)){
+        WARNX("libusb_hotplug_register_callback()");
+        libusb_exit(ctx);
+        return FLASH_OPEN;
+    }
+    if(!G->report) green(_("Wait for devices, press Ctrl+C to quit\n"));
+    flashstatus ret = FLASH_OK;
+    struct timeval tv = {.tv_usec = STOP_POLL};
+    while(!flash_stopped()){
+        int r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+        if(r && r != LIBUSB_ERROR_INTERRUPTED){
+            WARNX("libusb_handle_events(): %s", libusb_error_name(r));
+            ret = FLASH_OPEN;
+            break;
+        }
+    }
+    libusb_hotplug_deregister_callback(ctx, cbh);
+    pthread_mutex_lock(&outmutex);
+    if(nworkers && !G->report) printf(_("Wait for %d devices being flashed\n"), nworkers);
+    fflush(stdout);
+    while(nworkers) pthread_cond_wait(&idlecond, &outmutex);
+    pthread_mutex_unlock(&outmutex);
+    libusb_exit(ctx);
+    return ret;
+}
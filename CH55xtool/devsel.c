@@ -0,0 +1,319 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "devsel.h"
+
+// device selection (by position or chip ID) and per-device lock files, so several copies of tool
+// could flash different devices in parallel
+
+/**
+ * @brief devpath - name of device position: bus-port.port... (like in sysfs) or bus-aADDR if ports unknown
+ * @param a - position
+ * @param buf (o) - buffer for name
+ * @param len - its length
+ */
+void devpath(const ch55devaddr *a, char *buf, size_t len){
+    if(!a->nports){
+        snprintf(buf, len, "%d-a%d", a->bus, a->addr);
+        return;
+    }
+    char *e = buf + len;
+    buf += snprintf(buf, len, "%d", a->bus);
+    for(int i = 0; i < a->nports && buf < e; ++i)
+        buf += snprintf(buf, e - buf, "%c%d", i ? '.' : '-', a->ports[i]);
+}
+
+// parse port path like "2.3"; @return amount of ports or -1 if wrong
+static int parseports(const char *str, uint8_t *ports, int max){
+    int n = 0;
+    while(*str){
+        char *eptr;
+        long p = strtol(str, &eptr, 10);
+        if(eptr == str || p < 1 || p > 255 || n == max) return -1;
+        ports[n++] = (uint8_t) p;
+        if(*eptr == '.') ++eptr;
+        else if(*eptr) return -1;
+        str = eptr;
+    }
+    return n;
+}
+
+/**
+ * @brief devmatch - check device position by G->bus and G->port
+ * @param G - parameters
+ * @param a - position
+ * @return 1 if device selected; port path could be prefix: `--port 2` selects all devices behind hub at port 2
+ */
+int devmatch(glob_pars *G, const ch55devaddr *a){
+    if(G->bus && G->bus != a->bus) return 0;
+    if(!G->port) return 1;
+    uint8_t ports[7];
+    int n = parseports(G->port, ports, sizeof(ports));
+    if(n < 1){
+        WARNX(_("Wrong port path: %s"), G->port);
+        return 0;
+    }
+    return a->nports >= n && !memcmp(a->ports, ports, n);
+}
+
+/**
+ * @brief devlock - lock device position for this process
+ * Lock file G->lockdir/ch55tool-<path>.lock keeps PID of owner; lock is released by kernel when
+ * process dies, so stale files don't prevent flashing.
+ * @param G - parameters
+ * @param a - position
+ * @return file descriptor of lock or -1 if device is busy or can't create lock file
+ */
+int devlock(glob_pars *G, const ch55devaddr *a){
+    char path[32], fname[PATH_MAX];
+    devpath(a, path, sizeof(path));
+    snprintf(fname, sizeof(fname), "%s/ch55tool-%s.lock", G->lockdir, path);
+    int fd = open(fname, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if(fd < 0){
+        WARN(_("Can't open lock file %s"), fname);
+        return -1;
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB)){
+        if(errno == EWOULDBLOCK){
+            char pid[16] = {0};
+            if(read(fd, pid, sizeof(pid) - 1) < 0) *pid = 0;
+            pid[strcspn(pid, "\n")] = 0;
+            WARNX(_("Device %s is busy (pid %s)"), path, *pid ? pid : "?");
+        }else WARN("flock(%s)", fname);
+        close(fd);
+        return -1;
+    }
+    if(ftruncate(fd, 0) == 0) dprintf(fd, "%d\n", getpid());
+    DBG("Locked %s", fname);
+    return fd;
+}
+
+/**
+ * @brief devunlock - release lock got by devlock()
+ * @param fd (io) - lock file descriptor (set to -1)
+ */
+void devunlock(int *fd){
+    if(!fd || *fd < 0) return;
+    close(*fd); // lock file stays: deleting it could break lock got by another process just now
+    *fd = -1;
+}
+
+/**
+ * @brief chipmatch - compare chip name and ID with G->chip and G->chipid
+ * @param G - parameters
+ * @param d - chip (NULL if not detected)
+ * @param uid - chip ID bytes (NULL if unknown)
+ * @return 1 if matches
+ */
+int chipmatch(glob_pars *G, const ch55descr *d, const uint8_t *uid){
+    if(!G->chipid && !G->chip) return 1;
+    if(!d) return 0;
+    if(G->chip && strcasecmp(d->devname, G->chip)) return 0;
+    if(!G->chipid) return 1;
+    if(!uid) return 0;
+    char str[9];
+    snprintf(str, sizeof(str), "%02X%02X%02X%02X", uid[0], uid[1], uid[2], uid[3]);
+    DBG("Chip ID %s", str);
+    return strcasecmp(str, G->chipid) == 0;
+}
+
+/**
+ * @brief sessmatch - check chip of opened session by chipmatch() (detects chip and gets its ID if needed)
+ * @return 1 if matches
+ */
+int sessmatch(glob_pars *G, ch55session *s){
+    if(!G->chipid && !G->chip) return 1;
+    const ch55descr *d = ch55_detect_chip(s);
+    if(!d || (G->chip && strcasecmp(d->devname, G->chip))) return 0;
+    return chipmatch(G, d, (G->chipid && ch55_getver(s)) ? ch55_getuid(s) : NULL);
+}
+
+// check chip ID of just opened session, close it if not matches
+static ch55session *checkid(glob_pars *G, ch55session *s){
+    if(s && !sessmatch(G, s)){
+        WARNX(_("Chip of device isn't %s"), G->chipid ? G->chipid : G->chip);
+        ch55_close(&s);
+    }
+    return s;
+}
+
+// open device given by G->fd or G->path (without enumeration)
+static ch55session *opennode(glob_pars *G, ch55devaddr *pos, int *lockfd){
+    int r = (G->fd >= 0) ? ch55_fdpos(G->fd, pos) : ch55_nodepos(G->path, pos);
+    if(r) DBG("Position of device is unknown, don't lock it");
+    else if((*lockfd = devlock(G, pos)) < 0) return NULL;
+    ch55session *s = checkid(G, mksession(G, (G->fd >= 0) ?
+                             ch55_usbtransport_fd(G->fd) : ch55_usbtransport_node(G->path)));
+    if(!s) devunlock(lockfd);
+    return s;
+}
+
+// open device at exact position G->bus, G->port found in sysfs; @return 0 if there's no such bootloader
+static int openpos(glob_pars *G, ch55devaddr *pos, int *lockfd, ch55session **s){
+    ch55devaddr a = {.bus = G->bus};
+    char node[64];
+    int n = parseports(G->port, a.ports, sizeof(a.ports));
+    if(n < 1) return 0;
+    a.nports = n;
+    if(ch55_posnode(&a, node, sizeof(node))) return 0; // hub or sysfs absent: enumerate
+    if((*lockfd = devlock(G, &a)) >= 0){
+        *s = checkid(G, mksession(G, ch55_usbtransport_node(node)));
+        if(*s) *pos = a;
+        else devunlock(lockfd);
+    }
+    return 1;
+}
+
+// max time to wait for bootloader after restart of application, s
+#define APPBOOT_TIMEOUT (5.)
+// interval of polling, us
+#define APPBOOT_POLL    (20000)
+
+/**
+ * @brief appboot - restart running firmware with VID:PID G->appid into bootloader and wait for it
+ * (custom bootloader with G->fastboot)
+ * (only position in sysfs is polled, without enumeration); single device mode takes the first
+ * application found and selects its bootloader by G->bus and G->port, gang mode restarts all of them
+ * @param G (io) - parameters
+ * @return 0 if all bootloaders appeared
+ */
+int appboot(glob_pars *G){
+    unsigned int vid, pid;
+    char path[32], node[64];
+    if(sscanf(G->appid, "%x:%x", &vid, &pid) != 2 || vid > 0xffff || pid > 0xffff){
+        WARNX(_("Wrong VID:PID %s"), G->appid);
+        return 1;
+    }
+    ch55devaddr *apps;
+    int N = ch55_finddevs(vid, pid, &apps), n = 0, found = 0;
+    for(int i = 0; i < N && (G->gang || !n); ++i){
+        if(!apps[i].nports || !devmatch(G, &apps[i])) continue; // position needed to find bootloader
+        devpath(&apps[i], path, sizeof(path));
+        if(ch55_appboot(vid, pid, &apps[i])) WARNX(_("Can't restart application at %s"), path);
+        else apps[n++] = apps[i];
+    }
+    if(!n){
+        WARNX(_("No application %04X:%04X found"), vid, pid);
+        FREE(apps);
+        return 1;
+    }
+    double t0 = dtime();
+    while(found < n && dtime() - t0 < APPBOOT_TIMEOUT){
+        usleep(APPBOOT_POLL);
+        found = 0;
+        for(int i = 0; i < n; ++i){
+            ch55devaddr a = apps[i];
+            if(!ch55_posdev(&a, G->fastboot ? CH55FB_VID : CH55VID, G->fastboot ? CH55FB_PID : CH55PID,
+                            node, sizeof(node))) ++found;
+        }
+    }
+    if(found < n) WARNX(_("Only %d of %d bootloaders appeared"), found, n);
+    else if(!G->report) green(_("Bootloader appeared in %.0fms after request\n"), 1e3 * (dtime() - t0));
+    if(!G->gang){ // select it by position: device is opened without enumeration
+        static char port[32];
+        char *p = port, *e = port + sizeof(port);
+        for(int i = 0; i < apps[0].nports && p < e; ++i)
+            p += snprintf(p, e - p, i ? ".%d" : "%d", apps[0].ports[i]);
+        G->bus = apps[0].bus;
+        G->port = port;
+    }
+    FREE(apps);
+    return found < n;
+}
+
+/**
+ * @brief selectdev - find first free device selected by G->bus, G->port and G->chipid, lock and open it
+ * Device given by node, file descriptor, exact position or serial port (G->uart) opened directly, other are
+ * searched by enumeration.
+ * @param G - parameters
+ * @param pos (o) - position of device selected
+ * @param lockfd (o) - its lock (-1 for emulator)
+ * @return session or NULL if not found
+ */
+ch55session *selectdev(glob_pars *G, ch55devaddr *pos, int *lockfd){
+    ch55session *s = NULL;
+    *lockfd = -1;
+    memset(pos, 0, sizeof(ch55devaddr));
+    if(G->emulate) return checkid(G, opensession(G, NULL));
+    if(G->uart){
+        ch55transport *t = ch55_uarttransport(G->uart, G->uartbaud);
+        if(t && !G->report) printf(_("UART ISP at %d baud\n"), ch55_uartbaud(t));
+        return checkid(G, mksession(G, t));
+    }
+    if(G->fd >= 0 || G->path) return opennode(G, pos, lockfd);
+    if(G->bus && G->port && openpos(G, pos, lockfd, &s)) return s;
+    ch55devaddr *list;
+    int N = ch55_findalldevs(&list);
+    for(int i = 0; i < N && !s; ++i){
+        if(!devmatch(G, &list[i])) continue;
+        if((*lockfd = devlock(G, &list[i])) < 0) continue;
+        s = checkid(G, opensession(G, &list[i]));
+        if(s) *pos = list[i];
+        else devunlock(lockfd);
+    }
+    FREE(list);
+    if(!s) WARNX(_("No free device found"));
+    return s;
+}
+
+/**
+ * @brief selectfast - find first free custom bootloader (src/fastboot) selected by G->bus and G->port,
+ * lock and open it (or its emulator)
+ * @param G - parameters
+ * @param pos (o) - position of device selected
+ * @param lockfd (o) - its lock (-1 for emulator)
+ * @return transport with statistics or NULL if not found
+ */
+ch55transport *selectfast(glob_pars *G, ch55devaddr *pos, int *lockfd){
+    ch55transport *t = NULL;
+    *lockfd = -1;
+    memset(pos, 0, sizeof(ch55devaddr));
+    if(G->emulate){
+        const ch55descr *d = ch55_getdescrbyname(G->emulate);
+        if(!d){
+            WARNX(_("Unknown chip %s"), G->emulate);
+            return NULL;
+        }
+        ch55emulconf conf = {.chipid = d->chipid, .id = {0x12, 0x34, 0x56, 0x78},
+                             .latency = G->latency, .errrate = G->errrate};
+        return wraptransport(ch55_fbemulator(&conf));
+    }
+    ch55devaddr *list;
+    int N = ch55_finddevs(CH55FB_VID, CH55FB_PID, &list);
+    for(int i = 0; i < N && !t; ++i){
+        if(!devmatch(G, &list[i])) continue;
+        if((*lockfd = devlock(G, &list[i])) < 0) continue;
+        t = ch55_usbtransport_id(CH55FB_VID, CH55FB_PID, &list[i]);
+        if(t) *pos = list[i];
+        else devunlock(lockfd);
+    }
+    FREE(list);
+    if(!t) WARNX(_("No free device found"));
+    return wraptransport(t);
+}
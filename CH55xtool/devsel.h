@@ -0,0 +1,36 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+#ifndef DEVSEL_H__
+#define DEVSEL_H__
+
+#include "flash.h"
+
+void devpath(const ch55devaddr *a, char *buf, size_t len);
+int devmatch(glob_pars *G, const ch55devaddr *a);
+int chipmatch(glob_pars *G, const ch55descr *d, const uint8_t *uid);
+int sessmatch(glob_pars *G, ch55session *s);
+int devlock(glob_pars *G, const ch55devaddr *a);
+void devunlock(int *fd);
+int appboot(glob_pars *G);
+ch55session *selectdev(glob_pars *G, ch55devaddr *pos, int *lockfd);
+ch55transport *selectfast(glob_pars *G, ch55devaddr *pos, int *lockfd);
+
+#endif // DEVSEL_H__
@@ -0,0 +1,366 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+#include "ch55isp.h"
+
+// software emulator of WCH ISP bootloader (V2.30, V2.31, V2.40; data flash commands - only V2.31/V2.40)
+// and of custom bootloader src/fastboot
+
+#define ANSLEN          (6)
+#define CFGANSLEN       (30)
+// answer status of failed write/verify
+#define STATUS_BAD      (0xFE)
+// start of custom bootloader (FASTBOOT_ADDR) and its window
+#define FBADDR          (0x3000)
+#define FBWINDOW        (8)
+// bus time is slept by portions not less than this, ns
+#define BUSSLEEP        (100000)
+
+typedef struct{
+    ch55emulconf conf;
+    const ch55descr *descr;     // emulated chip
+    uint8_t *flash;             // flash content
+    uint8_t *data;              // data flash content
+    uint8_t key1;               // XOR key for bytes 0..6 of each 8 (0 for V2.30)
+    uint8_t key2;               // XOR key for byte 7 of each 8
+    int keyok;                  // ==1 after right key got
+    int running;                // ==1 after reset
+    unsigned int seed;          // random seed for lost answers
+    long busns;                 // bus time not slept yet, ns
+    int fast;                   // ==1 for custom bootloader
+    size_t wraddr, wrleft;      //   its data stream
+    unsigned int wrseq;         //   and amount of acknowledgements sent
+} emulpriv;
+
+// command was processed but its answer lost (with probability conf.errrate/1000)
+static int lost(emulpriv *e){
+    if(e->conf.errrate < 1) return 0;
+    return ((int)(rand_r(&e->seed) % 1000) < e->conf.errrate);
+}
+
+// transfer of `n` bytes over the bus
+static void bustime(emulpriv *e, int n){
+    if(e->conf.bytetime < 1 || n < 1) return;
+    e->busns += (long)n * e->conf.bytetime;
+    if(e->busns < BUSSLEEP) return;
+    usleep(e->busns / 1000);
+    e->busns %= 1000;
+}
+
+static int isold(emulpriv *e){
+    return (e->conf.version[1] == 3 && e->conf.version[2] == 0);
+}
+
+static uint8_t chksum(emulpriv *e){
+    return (e->conf.id[0] + e->conf.id[1] + e->conf.id[2] + e->conf.id[3]) & 0xff;
+}
+
+/**
+ * @brief writeverify - process write or verify command
+ * @param e - emulator data
+ * @param out - command
+ * @param olen - its length
+ * @param mem - flash or data flash
+ * @param size - its size
+ * @return status
+ */
+static uint8_t writeverify(emulpriv *e, const uint8_t *out, int olen, uint8_t *mem, size_t size){
+    if(!e->keyok || olen < 8) return STATUS_BAD;
+    size_t addr = out[3] | (out[4] << 8), n = out[7];
+    if(olen != (int)n + 8) return STATUS_BAD;
+    for(size_t i = 0; i < n; ++i){
+        uint8_t b = out[8 + i];
+        if(i % 8 == 7) b ^= e->key2;
+        else b ^= e->key1;
+        if(addr + i >= size){ // tail of last packet should be empty
+            if(b != CH55_ERASED) return STATUS_BAD;
+            continue;
+        }
+        uint8_t *f = &mem[addr + i];
+        if(out[0] == 0xa6){
+            if(*f != b) return STATUS_BAD;
+        }else if(out[0] == 0xaa) *f = b; // data flash is byte-writeable
+        else{
+            if(*f != CH55_ERASED && *f != b) return STATUS_BAD; // not erased
+            *f = b;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief fbprocess - emulate processing of command or data window by custom bootloader
+ * (unlike real bootloader each transfer of data stream is acknowledged, whatever its length is)
+ * @param e - emulator data
+ * @param out - command or data
+ * @param olen - its length
+ * @param ans (o) - answer (64 bytes)
+ * @return length of answer, 0 if no answer or -1 for unknown command
+ */
+static int fbprocess(emulpriv *e, const uint8_t *out, int olen, uint8_t *ans){
+    if(e->running) return -1;
+    memset(ans, 0, CH55FB_ANSLEN);
+    if(e->wrleft){
+        size_t n = ((size_t)olen > e->wrleft) ? e->wrleft : (size_t)olen;
+        memcpy(e->flash + e->wraddr, out, n);
+        e->wraddr += n;
+        e->wrleft -= n;
+        ++e->wrseq;
+        ans[0] = CH55FB_WRITE | 0x80;
+        ans[2] = e->wrseq & 0xff;
+        ans[3] = (e->wrseq >> 8) & 0xff;
+        return 4;
+    }
+    if(olen != 5) return -1;
+    size_t addr = out[1] | (out[2] << 8), n = out[3] | (out[4] << 8);
+    size_t max = (e->descr->flash_size < FBADDR) ? e->descr->flash_size : FBADDR;
+    ans[0] = out[0] | 0x80;
+    switch(out[0]){
+        case CH55FB_HELLO:
+            ans[2] = e->conf.chipid;
+            ans[3] = 1;
+            ans[4] = FBWINDOW;
+            ans[5] = FBADDR & 0xff;
+            ans[6] = FBADDR >> 8;
+            memcpy(&ans[7], e->conf.id, 4);
+        break;
+        case CH55FB_WRITE:
+        case CH55FB_FILL:
+            if((addr & 1) || (n & 1) || addr + n > max){
+                ans[1] = 2;
+                break;
+            }
+            if(out[0] == CH55FB_FILL) memset(e->flash + addr, CH55_ERASED, n);
+            else{
+                e->wraddr = addr;
+                e->wrleft = n;
+                e->wrseq = 0;
+            }
+        break;
+        case CH55FB_CRC:{
+            if(addr + n > e->descr->flash_size){
+                ans[1] = 2;
+                break;
+            }
+            uint16_t crc = ch55_crc16(0xffff, e->flash + addr, n);
+            ans[2] = crc & 0xff;
+            ans[3] = crc >> 8;
+        }
+        break;
+        case CH55FB_RESET:
+            e->running = 1;
+        return 0;
+        default:
+            ans[1] = 1;
+    }
+    return CH55FB_ANSLEN;
+}
+
+/**
+ * @brief process - emulate processing of one command
+ * @param e - emulator data
+ * @param out - command
+ * @param olen - its length
+ * @param ans (o) - answer (64 bytes)
+ * @return length of answer, 0 if no answer or -1 for unknown command
+ */
+static int process(emulpriv *e, const uint8_t *out, int olen, uint8_t *ans){
+    if(e->fast) return fbprocess(e, out, olen, ans);
+    if(olen < 4 || e->running) return -1;
+    memset(ans, 0, 64);
+    ans[0] = out[0];
+    ans[2] = 2;
+    switch(out[0]){
+        case 0xa1: // detect
+            if(olen < 21 || memcmp(&out[5], "MCU ISP & WCH.CN", 16)) return -1;
+            ans[4] = e->conf.chipid;
+            ans[5] = 0x11;
+        break;
+        case 0xa7: // read config
+            ans[2] = CFGANSLEN - 4;
+            memcpy(&ans[19], e->conf.version, 3);
+            memcpy(&ans[22], e->conf.id, 4);
+            e->keyok = 0;
+        return CFGANSLEN;
+        case 0xa3: // key
+            e->key2 = (chksum(e) + e->conf.chipid) & 0xff;
+            if(isold(e)){
+                if(olen != 48) ans[3] = 1;
+                else for(int i = 3; i < olen; ++i) if(out[i] != chksum(e)) ans[3] = 1;
+                e->key1 = 0;
+            }else{
+                if(olen != 56) ans[3] = 1;
+                e->key1 = chksum(e);
+            }
+            e->keyok = !ans[3];
+        break;
+        case 0xa4: // erase
+            if(!e->keyok) ans[3] = 1;
+            else{
+                memset(e->flash, CH55_ERASED, e->descr->flash_size);
+                if(e->conf.erasetime > 0) usleep(e->conf.erasetime);
+            }
+        break;
+        case 0xa5: // write
+        case 0xa6: // verify
+            ans[4] = writeverify(e, out, olen, e->flash, e->descr->flash_size);
+        break;
+        case 0xa9: // erase data flash
+            if(!e->keyok || isold(e)) ans[4] = STATUS_BAD;
+            else memset(e->data, CH55_ERASED, e->descr->data_size);
+        break;
+        case 0xaa: // write data flash
+            ans[4] = isold(e) ? STATUS_BAD : writeverify(e, out, olen, e->data, e->descr->data_size);
+        break;
+        case 0xab:{ // read data flash: address (4 bytes) and length (2 bytes)
+            if(olen != 9 || isold(e)) return -1;
+            size_t addr = out[3] | (out[4] << 8), n = out[7] | (out[8] << 8);
+            if(!e->keyok || n > 58 || addr + n > e->descr->data_size){
+                ans[4] = STATUS_BAD;
+                break;
+            }
+            ans[2] = n + 2;
+            memcpy(&ans[ANSLEN], e->data + addr, n);
+            return ANSLEN + n;
+        }
+        case 0xa2: // end or reset
+            if(out[3] == 1){
+                e->running = 1;
+                return 0;
+            }
+        break;
+        default:
+            return -1;
+    }
+    return ANSLEN;
+}
+
+static int emulxfer(ch55transport *t, const uint8_t *out, int olen, uint8_t *in, int ilen){
+    emulpriv *e = (emulpriv*) t->priv;
+    uint8_t ans[64];
+    if(e->conf.latency > 0) usleep(e->conf.latency);
+    int l = process(e, out, olen, ans);
+    bustime(e, olen + (l > 0 ? l : 0));
+    if(l < 1 || lost(e)) return -1; // no answer: timeout
+    if(l > ilen) l = ilen;
+    memcpy(in, ans, l);
+    return l;
+}
+
+static int emulsend(ch55transport *t, const uint8_t *out, int olen){
+    emulpriv *e = (emulpriv*) t->priv;
+    uint8_t ans[64];
+    bustime(e, olen);
+    return (process(e, out, olen, ans) < 0) ? 1 : 0;
+}
+
+// with `depth` packets in flight latency is paid once per `depth` packets
+static int emulpipeline(ch55transport *t, int depth, int ilen, const ch55pipecb *cb){
+    emulpriv *e = (emulpriv*) t->priv;
+    uint8_t ans[64];
+    const uint8_t *cmd;
+    int len, n = 0;
+    if(depth < 1) depth = 1;
+    while((cmd = cb->next(cb->arg, &len))){
+        if(e->conf.latency > 0 && n++ % depth == 0) usleep(e->conf.latency);
+        int l = process(e, cmd, len, ans);
+        bustime(e, len + (l > 0 ? l : 0));
+        if(l < 1 || lost(e)) return -1;
+        if(l > ilen) l = ilen;
+        if(cb->check(cb->arg, cmd, ans, l)) break;
+    }
+    return 0;
+}
+
+// re-enumeration: key is lost
+static int emulreopen(ch55transport *t){
+    emulpriv *e = (emulpriv*) t->priv;
+    if(e->conf.latency > 0) usleep(e->conf.latency);
+    e->keyok = 0;
+    return 0;
+}
+
+static void emulclose(ch55transport *t){
+    emulpriv *e = (emulpriv*) t->priv;
+    FREE(e->flash);
+    FREE(e->data);
+    FREE(e);
+    FREE(t);
+}
+
+/**
+ * @brief ch55_emulator - create in-process bootloader emulator
+ * @param conf - configuration (chip ID, version, ID bytes, timings)
+ * @return transport or NULL if chip ID is wrong
+ */
+ch55transport *ch55_emulator(const ch55emulconf *conf){
+    const ch55descr *d = ch55_getdescr(conf->chipid);
+    if(!d){
+        WARNX(_("Unknown chip ID 0x%02X"), conf->chipid);
+        return NULL;
+    }
+    emulpriv *e = MALLOC(emulpriv, 1);
+    e->conf = *conf;
+    e->descr = d;
+    e->seed = (unsigned int)(dtime() * 1e6);
+    e->flash = MALLOC(uint8_t, d->flash_size);
+    memset(e->flash, CH55_ERASED, d->flash_size);
+    e->data = MALLOC(uint8_t, d->data_size);
+    memset(e->data, CH55_ERASED, d->data_size);
+    ch55transport *t = MALLOC(ch55transport, 1);
+    t->name = "emulator";
+    t->priv = e;
+    t->xfer = emulxfer;
+    t->send = emulsend;
+    t->pipeline = emulpipeline;
+    t->reopen = emulreopen;
+    t->close = emulclose;
+    return t;
+}
+
+/**
+ * @brief ch55_fbemulator - create in-process emulator of custom bootloader (src/fastboot)
+ * @param conf - configuration (chip ID, ID bytes, timings; version isn't used)
+ * @return transport or NULL if chip ID is wrong
+ */
+ch55transport *ch55_fbemulator(const ch55emulconf *conf){
+    ch55transport *t = ch55_emulator(conf);
+    if(t){
+        ((emulpriv*) t->priv)->fast = 1;
+        t->name = "fbemulator";
+    }
+    return t;
+}
+
+/**
+ * @brief ch55_emulflash - get emulated flash content
+ * @param t - emulator transport
+ * @param size (o) - flash size
+ * @return flash data or NULL if `t` isn't emulator
+ */
+const uint8_t *ch55_emulflash(ch55transport *t, size_t *size){
+    if(!t || t->close != emulclose) return NULL;
+    emulpriv *e = (emulpriv*) t->priv;
+    if(size) *size = e->descr->flash_size;
+    return e->flash;
+}
@@ -0,0 +1,206 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <usefull_macros.h>
+#include "ch55isp.h"
+
+// host side of custom bootloader (src/fastboot): image is streamed as raw data in windows of
+// `window` packets, each window is one command of pipeline answered by acknowledgement
+
+// state of data stream
+typedef struct{
+    const uint8_t *data;    // padded image
+    size_t len;             // its length
+    size_t chunk;           // bytes per window
+    size_t next;            // offset of next window
+    int fail;               // ==1 if bad acknowledgement got
+} fbstream;
+
+/**
+ * @brief ch55_crc16 - CRC-16/CCITT (polynomial 0x1021) the same as computed by bootloader
+ * @param crc - previous value (0xFFFF for start)
+ * @param data - data
+ * @param len - its length
+ * @return new value
+ */
+uint16_t ch55_crc16(uint16_t crc, const uint8_t *data, size_t len){
+    while(len--){
+        uint8_t x = (crc >> 8) ^ *data++;
+        x ^= x >> 4;
+        crc = (crc << 8) ^ ((uint16_t)x << 12) ^ ((uint16_t)x << 5) ^ x;
+    }
+    return crc;
+}
+
+/**
+ * @brief fbcmd - send command and check its answer
+ * @param t - transport
+ * @param cmd - command code
+ * @param addr, len - its arguments
+ * @param ans (o) - answer (CH55FB_ANSLEN bytes)
+ * @return 0 if OK, -1 if transfer failed or status of error
+ */
+static int fbcmd(ch55transport *t, uint8_t cmd, size_t addr, size_t len, uint8_t *ans){
+    uint8_t out[5] = {cmd, addr & 0xff, (addr >> 8) & 0xff, len & 0xff, (len >> 8) & 0xff};
+    int n = t->xfer(t, out, sizeof(out), ans, CH55FB_ANSLEN);
+    if(n < 2 || ans[0] != (cmd | 0x80)){
+        WARNX(_("No answer to command 0x%02X"), cmd);
+        return -1;
+    }
+    if(ans[1]) WARNX(_("Command 0x%02X failed, status 0x%02X"), cmd, ans[1]);
+    return ans[1];
+}
+
+/**
+ * @brief ch55_fbhello - find out chip and parameters of bootloader
+ * @param t - transport
+ * @param info (o) - parameters
+ * @return 0 if OK
+ */
+int ch55_fbhello(ch55transport *t, ch55fbinfo *info){
+    uint8_t ans[CH55FB_ANSLEN];
+    if(fbcmd(t, CH55FB_HELLO, 0, 0, ans)) return 1;
+    info->descr = ch55_getdescr(ans[2]);
+    if(!info->descr){
+        WARNX(_("Unknown chip ID 0x%02X"), ans[2]);
+        return 1;
+    }
+    info->version = ans[3];
+    info->window = ans[4] ? ans[4] : 1;
+    info->maxsize = ans[5] | (ans[6] << 8);
+    if(info->maxsize > info->descr->flash_size) info->maxsize = info->descr->flash_size;
+    memcpy(info->uid, &ans[7], 4);
+    DBG("%s, bootloader v%d, window %d, max size %d", info->descr->devname, info->version, info->window, info->maxsize);
+    return 0;
+}
+
+static const uint8_t *fbnext(void *arg, int *len){
+    fbstream *st = (fbstream*) arg;
+    if(st->next >= st->len) return NULL;
+    size_t n = st->len - st->next;
+    if(n > st->chunk) n = st->chunk;
+    const uint8_t *cmd = st->data + st->next;
+    st->next += n;
+    *len = (int) n;
+    return cmd;
+}
+
+static int fbcheck(void *arg, const uint8_t *cmd, const uint8_t *ans, int len){
+    fbstream *st = (fbstream*) arg;
+    int seq = (int)((cmd - st->data) / st->chunk) + 1; // windows are acknowledged in order
+    if(len < 4 || ans[0] != (CH55FB_WRITE | 0x80) || ans[1] || (ans[2] | (ans[3] << 8)) != seq){
+        WARNX(_("Bad acknowledgement of window %d"), seq);
+        st->fail = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief ch55_fbwrite - write image from address 0
+ * @param t - transport
+ * @param info - parameters of bootloader
+ * @param img - image
+ * @param depth - amount of windows in flight
+ * @return 0 if OK
+ */
+int ch55_fbwrite(ch55transport *t, const ch55fbinfo *info, const ch55image *img, int depth){
+    if(img->len > info->maxsize){
+        WARNX(_("Image size (%zu) is greater than space for application (%d)"), img->len, info->maxsize);
+        return 1;
+    }
+    if(!img->len) return 0;
+    fbstream st = {.len = (img->len + 1) & ~(size_t)1, .chunk = (size_t)info->window * CH55FB_PACKETLEN};
+    uint8_t *data = MALLOC(uint8_t, st.len); // words are written: pad with erased byte
+    data[st.len - 1] = CH55_ERASED;
+    memcpy(data, img->data, img->len);
+    st.data = data;
+    uint8_t ans[CH55FB_ANSLEN];
+    int r = fbcmd(t, CH55FB_WRITE, 0, st.len, ans);
+    if(!r){
+        ch55pipecb cb = {.next = fbnext, .check = fbcheck, .arg = &st};
+        if(depth < 1) depth = 1;
+        if(t->pipeline) r = t->pipeline(t, depth, CH55FB_ANSLEN, &cb);
+        else r = ch55_pipeline_seq(t, CH55FB_ANSLEN, &cb);
+        // stream can't be resumed: bootloader waits for the rest of data until USB reset
+        if(!r && (st.fail || st.next < st.len)) r = 1;
+        if(r) WARNX(_("Writing failed after %zu bytes"), st.next);
+    }
+    FREE(data);
+    return r ? 1 : 0;
+}
+
+/**
+ * @brief ch55_fbfill - fill region of flash by erased value
+ * @param t - transport
+ * @param addr - start of region (even)
+ * @param len - its length (even)
+ * @return 0 if OK
+ */
+int ch55_fbfill(ch55transport *t, size_t addr, size_t len){
+    uint8_t ans[CH55FB_ANSLEN];
+    return fbcmd(t, CH55FB_FILL, addr, len, ans) ? 1 : 0;
+}
+
+/**
+ * @brief ch55_fbcrc - calculate CRC of flash region on chip
+ * @param t - transport
+ * @param addr - start of region
+ * @param len - its length
+ * @param crc (o) - CRC
+ * @return 0 if OK
+ */
+int ch55_fbcrc(ch55transport *t, size_t addr, size_t len, uint16_t *crc){
+    uint8_t ans[CH55FB_ANSLEN];
+    if(fbcmd(t, CH55FB_CRC, addr, len, ans)) return 1;
+    *crc = ans[2] | (ans[3] << 8);
+    return 0;
+}
+
+/**
+ * @brief ch55_fbcompare - compare CRC of whole application space with CRC of image (padded by erased bytes)
+ * @param t - transport
+ * @param info - parameters of bootloader
+ * @param img - image
+ * @return 0 if the same, 1 if differs, -1 if failed
+ */
+int ch55_fbcompare(ch55transport *t, const ch55fbinfo *info, const ch55image *img){
+    if(img->len > info->maxsize) return 1;
+    uint16_t crc, my = ch55_crc16(0xffff, img->data, img->len);
+    uint8_t empty[64];
+    memset(empty, CH55_ERASED, sizeof(empty));
+    for(size_t l = img->len; l < info->maxsize; l += sizeof(empty)){
+        size_t n = info->maxsize - l;
+        my = ch55_crc16(my, empty, n > sizeof(empty) ? sizeof(empty) : n);
+    }
+    if(ch55_fbcrc(t, 0, info->maxsize, &crc)) return -1;
+    DBG("CRC: chip 0x%04X, image 0x%04X", crc, my);
+    return (crc == my) ? 0 : 1;
+}
+
+/**
+ * @brief ch55_fbreset - start application
+ * @param t - transport
+ * @return 0 if OK
+ */
+int ch55_fbreset(ch55transport *t){
+    uint8_t out[5] = {CH55FB_RESET};
+    return t->send(t, out, sizeof(out)) ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <usefull_macros.h>
+
+#include "devsel.h"
+#include "fastflash.h"
+
+// flashing through custom bootloader (src/fastboot): single device, whole application space is
+// compared by CRC computed on chip, so written data isn't sent twice
+
+/**
+ * @brief fast_init - check options of flashing through custom bootloader
+ * @param G (io) - parameters
+ * @return 0 if OK
+ */
+int fast_init(glob_pars *G){
+    if(!G->fastboot) return 0;
+    if(G->gang || G->daemon || G->server || G->connect){
+        WARNX(_("Custom bootloader could be flashed only in single device mode"));
+        return 1;
+    }
+    if(G->patches || G->dataread || G->datawrite){
+        WARNX(_("Custom bootloader doesn't support patches and data flash"));
+        return 1;
+    }
+    if(G->path || G->fd >= 0){
+        WARNX(_("Options --path and --fd are ignored with -F"));
+        G->path = NULL;
+        G->fd = -1;
+    }
+    if(G->cache){
+        WARNX(_("Option -c is ignored with -F"));
+        G->cache = 0;
+    }
+    return 0;
+}
+
+static int fbreset(void *t){
+    return ch55_fbreset((ch55transport*) t);
+}
+
+/**
+ * @brief fast_flash - full sequence of flashing through custom bootloader
+ * @param t - opened transport (with statistics)
+ * @param G - parameters (binary file name, flags)
+ * @param img - image to flash (NULL - only check chip)
+ * @param quiet - ==1 to don't show messages
+ * @param res (io) - result of flashing; should be zeroed before call except of `pos` and `phases[PHASE_OPEN]`
+ * @return FLASH_OK if all OK or error code
+ */
+flashstatus fast_flash(ch55transport *t, glob_pars *G, const ch55image *img, int quiet, flashresult *res){
+    ch55fbinfo info;
+    ch55stats *stats = ch55_getstats(t);
+    if(stats) ch55_resetstats(stats);
+    double t0 = dtime(), tp = t0;
+    int e = ch55_fbhello(t, &info);
+    PHASE(PHASE_DETECT);
+    if(e) RET(FLASH_NOCHIP);
+    snprintf(res->devname, sizeof(res->devname), "%s", info.descr->devname);
+    snprintf(res->version, sizeof(res->version), "fb%d", info.version);
+    res->flash_size = info.maxsize;
+    memcpy(res->uid, info.uid, 4);
+    if(!chipmatch(G, info.descr, info.uid)){
+        WARNX(_("Chip of device isn't %s"), G->chipid ? G->chipid : G->chip);
+        RET(FLASH_NOCHIP);
+    }
+    if(!quiet) green(_("Found %s, custom bootloader v%d; space for application %d\n"), info.descr->devname,
+                     info.version, info.maxsize);
+    if(img){
+        if(img->len > info.maxsize){
+            WARNX(_("Image size (%zu) is greater than space for application (%d)"), img->len, info.maxsize);
+            RET(FLASH_IMAGE);
+        }
+        if(G->skipsame || G->verifyonly){
+            int c = ch55_fbcompare(t, &info, img);
+            PHASE(PHASE_COMPARE);
+            if(c < 0) RET(FLASH_VERIFY);
+            if(c == 0){
+                res->skipped = 1;
+                if(!quiet) green(_("Flash content is the same, skip erasing and writing\n"));
+            }else if(!quiet) green(_("Flash content differs\n"));
+        }
+        if(G->verifyonly && !res->skipped) RET(FLASH_VERIFY);
+        if(!res->skipped){
+            size_t end = (img->len + 1) & ~(size_t)1; // the rest of application space is cleared
+            e = ch55_fbfill(t, end, info.maxsize - end);
+            PHASE(PHASE_ERASE);
+            if(e) RET(FLASH_ERASE);
+            if(!quiet) green(_("Try to write %s (%zu bytes)\n"), G->binname, img->len);
+            e = ch55_fbwrite(t, &info, img, (G->pipeline > 1) ? G->pipeline : CH55FB_DEPTH);
+            PHASE(PHASE_WRITE);
+            if(e) RET(FLASH_WRITE);
+            if(!quiet) green(_("Verify CRC\n"));
+            e = ch55_fbcompare(t, &info, img);
+            PHASE(PHASE_VERIFY);
+            if(e) RET(FLASH_VERIFY);
+        }
+    }
+    res->status = flash_restart(G, fbreset, t, quiet, res, &tp);
+ret:
+    flash_finish(res, stats, t0);
+    return res->status;
+}
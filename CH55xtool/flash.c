@@ -0,0 +1,391 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "bootcheck.h"
+#include "cache.h"
+#include "flash.h"
+#include "patch.h"
+
+const char *flashstatus_str(flashstatus s){
+    switch(s){
+        case FLASH_OK:
+            return _("OK");
+        case FLASH_NOCHIP:
+            return _("Chip not found");
+        case FLASH_BADVER:
+            return _("Bad chip version");
+        case FLASH_ERASE:
+            return _("Can't erase chip");
+        case FLASH_WRITE:
+            return _("Can't write flash");
+        case FLASH_VERIFY:
+            return _("Verification of flash failed");
+        case FLASH_END:
+            return _("Can't fix writing");
+        case FLASH_OPEN:
+            return _("Can't open device");
+        case FLASH_RESTART:
+            return _("Can't reset MCU");
+        case FLASH_IMAGE:
+            return _("Can't load image");
+        case FLASH_GANG:
+            return _("Some of devices failed");
+        case FLASH_DATA:
+            return _("Can't read or write data flash");
+        case FLASH_BOOT:
+            return _("Firmware didn't start");
+        default:
+            return _("Unknown error");
+    }
+}
+
+static ch55trace *trace = NULL; // trace of all sessions (--trace)
+static volatile sig_atomic_t stopsig = 0; // signal stopping daemon or server
+
+/**
+ * @brief flash_tracestart - start tracing of all sessions into file G->trace (if set)
+ * @return 0 if OK
+ */
+int flash_tracestart(glob_pars *G){
+    if(!G->trace) return 0;
+    trace = ch55_traceopen(G->trace);
+    return trace ? 0 : 1;
+}
+
+/**
+ * @brief flash_tracestop - write the rest of trace and close it
+ */
+void flash_tracestop(){
+    ch55_traceclose(&trace);
+}
+
+/**
+ * @brief flash_stop - ask daemon or server to stop (async-signal-safe, called from signal handler)
+ * @param sig - signal got
+ */
+void flash_stop(int sig){
+    stopsig = sig;
+}
+
+/**
+ * @brief flash_stopped - check if daemon or server should stop
+ * @return signal got or 0
+ */
+int flash_stopped(){
+    return stopsig;
+}
+
+/**
+ * @brief wraptransport - add statistics and trace (if any) to transport
+ * @param t - transport
+ * @return wrapped transport or NULL if `t` is NULL
+ */
+ch55transport *wraptransport(ch55transport *t){
+    return ch55_stattransport(ch55_tracetransport(t, trace));
+}
+
+/**
+ * @brief mksession - open session over given transport with statistics and parameters from `G`
+ * @param G - parameters
+ * @param t - transport
+ * @return session or NULL if `t` is NULL
+ */
+ch55session *mksession(glob_pars *G, ch55transport *t){
+    ch55session *s = ch55_open_transport(wraptransport(t));
+    if(s){
+        ch55_setpipeline(s, G->pipeline);
+        ch55_setretries(s, G->retries);
+    }
+    return s;
+}
+
+/**
+ * @brief opensession - open session with USB device or emulator (if G->emulate set)
+ * @param G - parameters
+ * @param a - USB device position (NULL for first found)
+ * @return session or NULL if failed
+ */
+ch55session *opensession(glob_pars *G, const ch55devaddr *a){
+    ch55transport *t;
+    if(G->emulate){
+        const ch55descr *d = ch55_getdescrbyname(G->emulate);
+        if(!d){
+            WARNX(_("Unknown chip %s"), G->emulate);
+            return NULL;
+        }
+        ch55emulconf conf = {.chipid = d->chipid, .id = {0x12, 0x34, 0x56, 0x78},
+                             .latency = G->latency, .erasetime = 100 * G->latency,
+                             .errrate = G->errrate};
+        conf.version[0] = (G->bootver / 100) % 10;
+        conf.version[1] = (G->bootver / 10) % 10;
+        conf.version[2] = G->bootver % 10;
+        t = ch55_emulator(&conf);
+    }else t = ch55_usbtransport(a);
+    return mksession(G, t);
+}
+
+/**
+ * @brief dataflash - read and/or write data flash
+ * @param s - session (after getver)
+ * @param G - parameters
+ * @param descr - chip
+ * @param uid - chip ID bytes
+ * @param quiet - ==1 to don't show messages
+ * @param info (io) - patched values of unit
+ * @return FLASH_OK if all OK or error code
+ */
+static flashstatus dataflash(ch55session *s, glob_pars *G, const ch55descr *descr, const uint8_t *uid,
+                             int quiet, patchinfo *info){
+    size_t size = descr->data_size;
+    flashstatus ret = FLASH_DATA;
+    ch55image *file = NULL, *unit = NULL;
+    uint8_t *buf = MALLOC(uint8_t, size);
+    if(G->dataread){
+        if(ch55_dataread(s, 0, buf, size)) goto ret;
+        FILE *f = fopen(G->dataread, "w");
+        if(!f || size != fwrite(buf, 1, size, f)){
+            WARN(_("Can't write %s"), G->dataread);
+            if(f) fclose(f);
+            goto ret;
+        }
+        fclose(f);
+        if(!quiet) green(_("Data flash (%zu bytes) saved to %s\n"), size, G->dataread);
+    }
+    if(G->datawrite || patch_amount(1)){
+        if(G->datawrite && !(file = ch55_loadimage(G->datawrite))){
+            ret = FLASH_IMAGE;
+            goto ret;
+        }
+        if(file && file->len > size){
+            WARNX(_("Data size (%zu) is greater than data flash size (%zu)"), file->len, size);
+            ret = FLASH_IMAGE;
+            goto ret;
+        }
+        if(!(unit = patch_image(file, 1, uid, size, info))){
+            ret = FLASH_IMAGE;
+            goto ret;
+        }
+        // whole data flash is rewritten
+        uint8_t *data = MALLOC(uint8_t, size);
+        memset(data, CH55_ERASED, size);
+        memcpy(data, unit->data, unit->len);
+        if(!quiet) green(_("Write data flash\n"));
+        int e = ch55_dataerase(s);
+        if(!e) e = ch55_datawrite(s, 0, data, size);
+        if(!e) e = ch55_dataread(s, 0, buf, size);
+        if(!e && memcmp(buf, data, size)){
+            WARNX(_("Data flash differs after writing"));
+            e = 2;
+        }
+        FREE(data);
+        if(e) goto ret;
+    }
+    ret = FLASH_OK;
+ret:
+    ch55_freeimage(&file);
+    ch55_freeimage(&unit);
+    FREE(buf);
+    return ret;
+}
+
+/**
+ * @brief flash_phase - end of flashing phase: store its time and report progress
+ * @param res (io) - result of flashing
+ * @param p - phase
+ * @param tp (io) - end time of previous phase
+ */
+void flash_phase(flashresult *res, flashphase p, double *tp){
+    double t = dtime();
+    res->phases[p] = t - *tp;
+    *tp = t;
+    if(res->progress) res->progress(res, p, res->progarg);
+}
+
+/**
+ * @brief flash_restart - reset MCU (if not G->dontrestart) and wait for firmware (G->waitapp or G->banner)
+ * @param G - parameters
+ * @param reset - function sending reset command to bootloader (returns 0 if OK)
+ * @param arg - its argument
+ * @param quiet - ==1 to don't show messages
+ * @param res (io) - result of flashing (phases PHASE_RESTART, PHASE_BOOT)
+ * @param tp (io) - end time of previous phase
+ * @return FLASH_OK if all OK or error code
+ */
+flashstatus flash_restart(glob_pars *G, int (*reset)(void *arg), void *arg, int quiet, flashresult *res, double *tp){
+    if(G->dontrestart) return FLASH_OK;
+    int tty = boot_opentty(G); // serial port of firmware
+    if(tty == -2) return FLASH_BOOT;
+    if(!quiet) green(_("Reset MCU\n"));
+    int e = reset(arg);
+    flash_phase(res, PHASE_RESTART, tp);
+    if(e){
+        if(tty >= 0) close(tty);
+        return FLASH_RESTART;
+    }
+    if(!G->waitapp && tty < 0) return FLASH_OK;
+    e = boot_wait(G, &res->pos, tty);
+    flash_phase(res, PHASE_BOOT, tp);
+    if(e) return FLASH_BOOT;
+    if(!quiet) green(_("Firmware started in %.1fms\n"), 1e3 * res->phases[PHASE_BOOT]);
+    return FLASH_OK;
+}
+
+/**
+ * @brief flash_finish - fill full time and statistics of flashing
+ * @param res (io) - result of flashing
+ * @param stats - statistics of transport (or NULL)
+ * @param t0 - start time of flashing
+ */
+void flash_finish(flashresult *res, const ch55stats *stats, double t0){
+    res->time = dtime() - t0 + res->phases[PHASE_OPEN];
+    if(stats){
+        res->packets = stats->packets;
+        res->bytes = stats->bytesout + stats->bytesin;
+    }
+}
+
+static int sessreset(void *s){
+    return ch55_restart((ch55session*) s);
+}
+
+/**
+ * @brief flashchip - full sequence of chip flashing
+ * @param s - opened session
+ * @param G - parameters (binary file name, flags)
+ * @param img - image to flash (NULL - only check chip)
+ * @param quiet - ==1 to don't show messages
+ * @param res (io) - result of flashing (or NULL); should be zeroed before call except of
+ *                   `pos` and `phases[PHASE_OPEN]`
+ * @return FLASH_OK if all OK or error code
+ */
+flashstatus flashchip(ch55session *s, glob_pars *G, const ch55image *img, int quiet, flashresult *res){
+    flashresult local = {0};
+    size_t *diff = NULL, ndiff = 0; // packets changed since last flashing
+    ch55image *unit = NULL; // patched image of this unit
+    patchinfo info = {0};
+    int dataops = G->dataread || G->datawrite || patch_amount(1);
+    if(!res) res = &local;
+    ch55stats *stats = ch55_getstats(ch55_gettransport(s));
+    if(stats) ch55_resetstats(stats);
+    if(img && !patch_amount(0)) ch55_setimage(s, img); // prepare stream of commands after getver
+    double t0 = dtime(), tp = t0;
+    const ch55descr *descr = ch55_detect_chip(s);
+    PHASE(PHASE_DETECT);
+    if(!descr) RET(FLASH_NOCHIP);
+    snprintf(res->devname, sizeof(res->devname), "%s", descr->devname);
+    res->flash_size = descr->flash_size;
+    const char *ver = ch55_getver(s);
+    PHASE(PHASE_GETVER);
+    if(!ver) RET(FLASH_BADVER);
+    snprintf(res->version, sizeof(res->version), "%s", ver);
+    memcpy(res->uid, ch55_getuid(s), 4);
+    if(!quiet) green(_("Found %s, version %s; flash size %d\n"), descr->devname, ver, descr->flash_size);
+    if(!img){
+        if(!dataops) RET(FLASH_OK); // just check chip
+        goto data;
+    }
+    if(img->len > descr->flash_size){
+        WARNX(_("Image size (%zu) is greater than flash size (%d)"), img->len, descr->flash_size);
+        RET(FLASH_IMAGE);
+    }
+    if(patch_amount(0)){
+        if(!(unit = patch_image(img, 0, res->uid, descr->flash_size, &info))) RET(FLASH_IMAGE);
+        img = unit;
+        ch55_setimage(s, img);
+    }
+    chipcache *cache = G->cache ? cache_load(descr->devname, res->uid) : NULL;
+    if(cache){
+        res->cached = 1;
+        res->changed = ndiff = cache_diff(cache, img, &diff);
+        cache_free(&cache);
+        if(!quiet){
+            if(!ndiff) green(_("Image is the same as flashed last time\n"));
+            else{
+                green(_("Changed since last flashing (%zu packets): "), ndiff);
+                cache_regions(stdout, diff, ndiff);
+                printf("\n");
+            }
+        }
+    }
+    if(G->skipsame || G->verifyonly){
+        int c = 0;
+        // changed packets beyond the end of image are tail of longer old one
+        size_t nimg = 0, npkts = (img->len + CH55_PACKETLEN - 1) / CH55_PACKETLEN;
+        while(nimg < ndiff && diff[nimg] < npkts) ++nimg;
+        // check changed packets first: if cache is right, one packet is enough to know that flash differs
+        if(nimg) c = ch55_comparepackets(s, img, diff, nimg);
+        if(c == 0 && nimg < ndiff && !G->verifyonly) c = 2; // old tail should be erased
+        if(c == 0) c = ch55_compareimage(s, img);
+        PHASE(PHASE_COMPARE);
+        if(c == 1) RET(FLASH_VERIFY);
+        if(c == 0){
+            res->skipped = 1;
+            if(!quiet) green(_("Flash content is the same, skip erasing and writing\n"));
+        }else if(!quiet) green(_("Flash content differs\n"));
+    }
+    if(G->cache){ // flash content is known only after successful verification
+        if(res->skipped) cache_save(descr->devname, res->uid, img);
+        else cache_drop(descr->devname, res->uid);
+    }
+    if(G->verifyonly && !res->skipped) RET(FLASH_VERIFY);
+    if(!res->skipped){
+        int e = ch55_erasechip(s);
+        PHASE(PHASE_ERASE);
+        if(e) RET(FLASH_ERASE);
+        if(!quiet){
+            size_t N, n = ch55_usedpackets(s, &N);
+            green(_("Try to write %s (%zu of %zu packets, the rest are empty and only verified)\n"), G->binname, n, N);
+        }
+        e = ch55_writeimage(s, img);
+        PHASE(PHASE_WRITE);
+        if(e) RET(FLASH_WRITE);
+        if(!quiet) green(_("Verify data\n"));
+        e = ch55_verifyimage(s, img);
+        PHASE(PHASE_VERIFY);
+        if(e) RET(FLASH_VERIFY);
+        if(G->cache) cache_save(descr->devname, res->uid, img);
+    }
+data:
+    if(dataops){
+        flashstatus d = dataflash(s, G, descr, res->uid, quiet, &info);
+        PHASE(PHASE_DATA);
+        if(d) RET(d);
+    }
+    int e = ch55_endflash(s);
+    PHASE(PHASE_END);
+    if(e) RET(FLASH_END);
+    res->status = flash_restart(G, sessreset, s, quiet, res, &tp);
+ret:
+    res->hasserial = info.hasserial;
+    res->serial = info.serial;
+    if(!quiet && info.hasserial) green(_("Serial number %llu\n"), info.serial);
+    FREE(diff);
+    if(unit){
+        ch55_setimage(s, NULL);
+        ch55_freeimage(&unit);
+    }
+    res->retries = ch55_getretries(s);
+    flash_finish(res, stats, t0);
+    return res->status;
+}
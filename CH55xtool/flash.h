@@ -0,0 +1,84 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef FLASH_H__
+#define FLASH_H__
+
+#include "cmdlnopts.h"
+#include "ch55isp.h"
+
+// result of flashing sequence (also used as exit code)
+typedef enum{
+    FLASH_OK = 0,       // all OK
+    FLASH_OPEN = 1,     // can't open device
+    FLASH_NOCHIP = 2,   // chip not found
+    FLASH_BADVER = 3,   // bad bootloader version
+    FLASH_ERASE = 4,    // can't erase
+    FLASH_WRITE = 5,    // can't write
+    FLASH_VERIFY = 6,   // verification failed
+    FLASH_END = 7,      // can't fix writing
+    FLASH_RESTART = 8,  // can't send reset command
+    FLASH_IMAGE = 9,    // can't load image
+    FLASH_GANG = 10,    // gang mode: some of devices failed
+    FLASH_DATA = 11,    // can't read or write data flash
+    FLASH_BOOT = 12,    // firmware didn't start after reset
+    FLASH_STATUS_AMOUNT
+} flashstatus;
+
+typedef struct flashresult flashresult;
+struct flashresult{
+    ch55devaddr pos;        // device position (zero for single device)
+    char devname[8];        // chip name
+    char version[8];        // bootloader version
+    uint16_t flash_size;    // chip flash size
+    uint8_t uid[4];         // chip ID bytes
+    flashstatus status;     // result
+    int skipped;            // ==1 if flash had the same content (erase/write skipped)
+    int cached;             // ==1 if image previously flashed into chip was found in cache
+    size_t changed;         // amount of packets changed since that image
+    int hasserial;          // ==1 if serial number was patched into image
+    unsigned long long serial; // its value
+    double time;            // full time of flashing
+    double startup;         // time from start of process till device opened (single device mode)
+    double phases[PHASE_AMOUNT]; // wall time of each phase
+    size_t packets;         // amount of commands sent
+    size_t bytes;           // bytes transferred (both directions)
+    size_t retries;         // amount of retries
+    void (*progress)(const flashresult *res, flashphase p, void *arg); // called after each phase (or NULL)
+    void *progarg;          // its argument
+};
+
+// steps of flashing sequence (flashchip, fast_flash): `res`, `tp` (end of previous phase) and label `ret` should exist
+#define PHASE(p)    flash_phase(res, p, &tp)
+#define RET(x)      do{res->status = x; goto ret;}while(0)
+
+const char *flashstatus_str(flashstatus s);
+void flash_phase(flashresult *res, flashphase p, double *tp);
+flashstatus flash_restart(glob_pars *G, int (*reset)(void *arg), void *arg, int quiet, flashresult *res, double *tp);
+void flash_finish(flashresult *res, const ch55stats *stats, double t0);
+int flash_tracestart(glob_pars *G);
+void flash_tracestop();
+void flash_stop(int sig);
+int flash_stopped();
+ch55transport *wraptransport(ch55transport *t);
+ch55session *mksession(glob_pars *G, ch55transport *t);
+ch55session *opensession(glob_pars *G, const ch55devaddr *a);
+flashstatus flashchip(ch55session *s, glob_pars *G, const ch55image *img, int quiet, flashresult *res);
+
+#endif // FLASH_H__
@@ -0,0 +1,248 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <usefull_macros.h>
+#include "devsel.h"
+#include "gang.h"
+
+// max limit of simultaneous sessions per hub
+#define MAXHUBCAP   (16)
+
+// hub with queue of its devices
+typedef struct{
+    hubstat st;
+    uint8_t bus;            // hub position: bus
+    uint8_t nports;         //   and port numbers
+    uint8_t ports[7];
+    int *queue;             // indexes of devices behind this hub
+    int qhead;              // first device not started yet
+    int running;            // amount of sessions running now
+    int maxcap;             // upper limit of `st.cap`
+    double tstart;          // start of current busy interval
+    double agg[MAXHUBCAP+1];// mean aggregated throughput of hub for each amount of sessions, B/s
+    int nagg[MAXHUBCAP+1];  // amount of samples for each amount of sessions
+} hub;
+
+typedef struct{
+    glob_pars *G;
+    const ch55image *img;
+    flashresult res;
+    ch55session *s;         // session opened while checking chip (or NULL)
+    int lockfd;             // lock of device
+    int hub;                // index of hub
+    int level;              // amount of sessions of its hub at start
+    int done;               // ==1 when worker finished, ==2 when scheduler accounted it
+} gangjob;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+// thread serving one device of gang
+static void *gangworker(void *arg){
+    gangjob *job = (gangjob*) arg;
+    ch55session *s = job->s;
+    if(!s){
+        double t0 = dtime();
+        s = opensession(job->G, &job->res.pos);
+        job->res.phases[PHASE_OPEN] = dtime() - t0;
+    }
+    if(!s) job->res.status = FLASH_OPEN;
+    else{
+        flashchip(s, job->G, job->img, 1, &job->res);
+        ch55_close(&s);
+    }
+    devunlock(&job->lockfd);
+    pthread_mutex_lock(&mutex);
+    job->done = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+// parent hub of device: all its ports except last one
+static int samehub(const hub *h, const ch55devaddr *a){
+    int n = a->nports ? a->nports - 1 : 0;
+    return h->bus == a->bus && h->nports == n && !memcmp(h->ports, a->ports, n);
+}
+
+/**
+ * @brief mkhubs - group devices by their parent hub
+ * @param list - devices
+ * @param N - their amount
+ * @param maxcap - limit of simultaneous sessions per hub (0 - no limit)
+ * @param nhubs (o) - amount of hubs
+ * @return allocated array of hubs
+ */
+static hub *mkhubs(const ch55devaddr *list, int N, int maxcap, int *nhubs){
+    hub *hubs = MALLOC(hub, N);
+    int n = 0;
+    for(int i = 0; i < N; ++i){
+        int h = 0;
+        while(h < n && !samehub(&hubs[h], &list[i])) ++h;
+        if(h == n){ // new hub
+            hub *H = &hubs[n++];
+            H->bus = list[i].bus;
+            H->nports = list[i].nports ? list[i].nports - 1 : 0;
+            memcpy(H->ports, list[i].ports, H->nports);
+            char *p = H->st.path, *e = H->st.path + sizeof(H->st.path);
+            p += snprintf(p, e - p, "%d", H->bus);
+            for(int j = 0; j < H->nports && p < e; ++j)
+                p += snprintf(p, e - p, "%c%d", j ? '.' : '-', H->ports[j]);
+            H->queue = MALLOC(int, N);
+        }
+        hubs[h].queue[hubs[h].st.ndevs++] = i;
+    }
+    for(int h = 0; h < n; ++h){
+        hub *H = &hubs[h];
+        if(maxcap > 0){ // start with two sessions (if allowed) and grow while aggregated speed grows
+            H->maxcap = (maxcap < MAXHUBCAP) ? maxcap : MAXHUBCAP;
+            H->st.cap = (H->maxcap < 2) ? H->maxcap : 2;
+        }else H->maxcap = H->st.cap = H->st.ndevs;
+        DBG("Hub %s: %d devices", H->st.path, H->st.ndevs);
+    }
+    *nhubs = n;
+    return hubs;
+}
+
+/**
+ * @brief adapt - change limit of hub sessions by throughput of finished session
+ * Each session gives estimation of hub throughput with `level` sessions run: its own speed
+ * multiplied by `level`. Limit set to the best of levels tested; if the best is the greatest
+ * level tested, try one more session.
+ * @param H - hub
+ * @param job - finished job
+ */
+static void adapt(hub *H, const gangjob *job){
+    const flashresult *r = &job->res;
+    int level = job->level;
+    if(r->status != FLASH_OK || r->time <= 0. || !r->bytes || level > MAXHUBCAP) return;
+    double sample = r->bytes / r->time * level;
+    H->agg[level] += (sample - H->agg[level]) / ++H->nagg[level];
+    int best = 0, top = 0;
+    for(int l = 1; l <= MAXHUBCAP; ++l){
+        if(!H->nagg[l]) continue;
+        top = l;
+        if(!best || H->agg[l] > H->agg[best]) best = l;
+    }
+    H->st.cap = (best == top && best < H->maxcap) ? best + 1 : best;
+    DBG("Hub %s: level %d gives %.0f B/s, best %d -> cap %d", H->st.path, level, sample, best, H->st.cap);
+}
+
+/**
+ * @brief gang_flash - flash all connected devices (selected by G->bus/G->port and not busy) grouped by hubs
+ * Devices behind the same hub share its bandwidth (and transaction translator for full-speed
+ * devices behind high-speed hub), so amount of simultaneous sessions per hub is limited by G->hubcap
+ * and adapted by measured throughput. Each device served by its own thread with its own ISP session.
+ * @param G - global parameters
+ * @param img - image to flash
+ * @param results (o) - allocated array with results for each device
+ * @param hubs (o) - allocated array with statistics of each hub
+ * @param nhubs (o) - amount of hubs
+ * @param tall (o) - full time of flashing
+ * @return amount of devices found
+ */
+int gang_flash(glob_pars *G, const ch55image *img, flashresult **results, hubstat **hubs, int *nhubs,
+               double *tall){
+    ch55devaddr *list;
+    *results = NULL;
+    *hubs = NULL;
+    *nhubs = 0;
+    *tall = 0.;
+    int Nall = ch55_findalldevs(&list), N = 0;
+    int *locks = MALLOC(int, Nall + 1);
+    ch55session **sess = MALLOC(ch55session*, Nall + 1);
+    double *topen = MALLOC(double, Nall + 1);
+    for(int i = 0; i < Nall; ++i){ // select and lock devices
+        if(!devmatch(G, &list[i])) continue;
+        if((locks[N] = devlock(G, &list[i])) < 0) continue;
+        if(G->chip || G->chipid){ // chip is known only after opening: leave other devices untouched
+            double t0 = dtime();
+            sess[N] = opensession(G, &list[i]);
+            topen[N] = dtime() - t0;
+            if(!sess[N] || !sessmatch(G, sess[N])){
+                DBG("Skip device at %d:%d", list[i].bus, list[i].addr);
+                if(sess[N]) ch55_close(&sess[N]);
+                devunlock(&locks[N]);
+                continue;
+            }
+        }
+        list[N++] = list[i];
+    }
+    if(!N){
+        WARNX(_("No devices found"));
+        FREE(locks); FREE(sess); FREE(topen); FREE(list);
+        return 0;
+    }
+    int nh;
+    hub *H = mkhubs(list, N, G->hubcap, &nh);
+    if(!G->report) green(_("Found %d devices behind %d hubs, start flashing\n"), N, nh);
+    pthread_t *threads = MALLOC(pthread_t, N);
+    gangjob *jobs = MALLOC(gangjob, N);
+    for(int i = 0; i < N; ++i){
+        jobs[i].G = G;
+        jobs[i].img = img;
+        jobs[i].res.pos = list[i];
+        jobs[i].res.phases[PHASE_OPEN] = topen[i];
+        jobs[i].s = sess[i];
+        jobs[i].lockfd = locks[i];
+    }
+    for(int h = 0; h < nh; ++h)
+        for(int j = 0; j < H[h].st.ndevs; ++j) jobs[H[h].queue[j]].hub = h;
+    double t0 = dtime();
+    int finished = 0;
+    pthread_mutex_lock(&mutex);
+    while(finished < N){
+        for(int h = 0; h < nh; ++h){ // start sessions allowed
+            hub *cur = &H[h];
+            while(cur->running < cur->st.cap && cur->qhead < cur->st.ndevs){
+                int i = cur->queue[cur->qhead++];
+                if(!cur->running) cur->tstart = dtime();
+                jobs[i].level = ++cur->running;
+                if(cur->running > cur->st.maxrun) cur->st.maxrun = cur->running;
+                if(pthread_create(&threads[i], NULL, gangworker, &jobs[i])) ERR("pthread_create()");
+            }
+        }
+        pthread_cond_wait(&cond, &mutex);
+        for(int i = 0; i < N; ++i){ // account finished sessions
+            if(jobs[i].done != 1) continue;
+            jobs[i].done = 2;
+            ++finished;
+            hub *cur = &H[jobs[i].hub];
+            cur->st.bytes += jobs[i].res.bytes;
+            if(!--cur->running) cur->st.busy += dtime() - cur->tstart;
+            if(G->hubcap > 0) adapt(cur, &jobs[i]);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    for(int i = 0; i < N; ++i) pthread_join(threads[i], NULL);
+    *tall = dtime() - t0;
+    *results = MALLOC(flashresult, N);
+    for(int i = 0; i < N; ++i) (*results)[i] = jobs[i].res;
+    *hubs = MALLOC(hubstat, nh);
+    for(int h = 0; h < nh; ++h){
+        (*hubs)[h] = H[h].st;
+        FREE(H[h].queue);
+    }
+    *nhubs = nh;
+    FREE(H); FREE(threads); FREE(jobs); FREE(locks); FREE(sess); FREE(topen); FREE(list);
+    return N;
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+#ifndef GANG_H__
+#define GANG_H__
+
+#include "flash.h"
+
+// utilisation of one USB hub (parent of several bootloaders) in gang mode
+typedef struct{
+    char path[32];          // hub position: bus-port.port...
+    int ndevs;              // amount of devices behind it
+    int cap;                // final limit of simultaneous sessions
+    int maxrun;             // max amount of sessions really run at once
+    double busy;            // time when any of its sessions was run, s
+    size_t bytes;           // bytes transferred by all its sessions
+} hubstat;
+
+// max payload of full-speed bulk endpoints sharing one TT: 19 packets of 64 bytes per 1ms frame
+#define FS_BULK_BPS     (1216000.)
+
+int gang_flash(glob_pars *G, const ch55image *img, flashresult **results, hubstat **hubs, int *nhubs,
+               double *tall);
+
+#endif // GANG_H__
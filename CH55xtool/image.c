@@ -0,0 +1,152 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <usefull_macros.h>
+#include "ch55isp.h"
+
+// max size of image made from Intel HEX
+#define MAXIHXSIZE      (65536)
+
+// get hex byte from string; @return -1 if wrong
+static int hexbyte(const char *s){
+    int r = 0;
+    for(int i = 0; i < 2; ++i){
+        char c = s[i];
+        r <<= 4;
+        if(c >= '0' && c <= '9') r |= c - '0';
+        else if(c >= 'a' && c <= 'f') r |= c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') r |= c - 'A' + 10;
+        else return -1;
+    }
+    return r;
+}
+
+/**
+ * @brief parseihx - convert Intel HEX into binary image
+ * @param txt - file content
+ * @param len - its length
+ * @param name - file name (for messages)
+ * @return image (gaps filled by CH55_ERASED) or NULL if failed
+ */
+static ch55image *parseihx(const char *txt, size_t len, const char *name){
+    uint8_t *data = MALLOC(uint8_t, MAXIHXSIZE);
+    memset(data, CH55_ERASED, MAXIHXSIZE);
+    size_t maxaddr = 0, base = 0;
+    int line = 0, eof = 0;
+    const char *end = txt + len;
+    while(txt < end && !eof){
+        const char *nl = memchr(txt, '\n', end - txt);
+        if(!nl) nl = end;
+        ++line;
+        const char *p = txt;
+        txt = nl + 1;
+        while(p < nl && (*p == ' ' || *p == '\t')) ++p;
+        if(p == nl || *p == '\r') continue; // empty line
+        if(*p++ != ':' || nl - p < 10) goto bad;
+        int n = hexbyte(p);
+        if(n < 0 || nl - p < 10 + 2*n) goto bad;
+        uint8_t rec[260];
+        uint8_t sum = 0;
+        for(int i = 0; i < n + 5; ++i){
+            int b = hexbyte(p + 2*i);
+            if(b < 0) goto bad;
+            rec[i] = b;
+            sum += b;
+        }
+        if(sum) goto bad;
+        size_t addr = (rec[1] << 8) | rec[2];
+        switch(rec[3]){
+            case 0x00: // data
+                addr += base;
+                if(addr + n > MAXIHXSIZE){
+                    WARNX(_("%s:%d: address 0x%zX is out of range"), name, line, addr + n);
+                    FREE(data);
+                    return NULL;
+                }
+                memcpy(data + addr, &rec[4], n);
+                if(addr + n > maxaddr) maxaddr = addr + n;
+            break;
+            case 0x01: // EOF
+                eof = 1;
+            break;
+            case 0x02: // extended segment address
+                if(n != 2) goto bad;
+                base = ((rec[4] << 8) | rec[5]) << 4;
+            break;
+            case 0x04: // extended linear address
+                if(n != 2) goto bad;
+                base = ((rec[4] << 8) | rec[5]) << 16;
+            break;
+            case 0x03: // start address: useless for us
+            case 0x05:
+            break;
+            default:
+                goto bad;
+        }
+    }
+    ch55image *img = MALLOC(ch55image, 1);
+    img->data = data;
+    img->len = maxaddr;
+    return img;
+bad:
+    WARNX(_("%s:%d: bad Intel HEX record"), name, line);
+    FREE(data);
+    return NULL;
+}
+
+// check if file is Intel HEX by its extension
+static int isihx(const char *filename){
+    const char *ext = strrchr(filename, '.');
+    if(!ext) return 0;
+    ++ext;
+    return (strcasecmp(ext, "ihx") == 0 || strcasecmp(ext, "hex") == 0 || strcasecmp(ext, "ihex") == 0);
+}
+
+/**
+ * @brief ch55_loadimage - load firmware into memory: binary file is mapped,
+ *        Intel HEX (.ihx, .hex) is converted to binary
+ * @param filename - name of file
+ * @return image or NULL if failed
+ */
+ch55image *ch55_loadimage(const char *filename){
+    mmapbuf *map = My_mmap((char*)filename);
+    if(!map) return NULL;
+    if(isihx(filename)){
+        ch55image *img = parseihx(map->data, map->len, filename);
+        My_munmap(map);
+        return img;
+    }
+    ch55image *img = MALLOC(ch55image, 1);
+    img->data = (uint8_t*) map->data;
+    img->len = map->len;
+    img->map = map;
+    return img;
+}
+
+/**
+ * @brief ch55_freeimage - free image data
+ */
+void ch55_freeimage(ch55image **img){
+    if(!img || !*img) return;
+    if((*img)->map) My_munmap((mmapbuf*)(*img)->map);
+    else FREE((*img)->data);
+    FREE(*img);
+}
@@ -16,40 +16,69 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "client.h"
+#include "bootcheck.h"
 #include "cmdlnopts.h"
-#include "usb.h"
+#include "flash.h"
+#include "gang.h"
+#include "patch.h"
+#include "daemon.h"
+#include "devsel.h"
+#include "fastflash.h"
+#include "report.h"
+#include "server.h"
 
 #include <signal.h>         // signal
 #include <stdio.h>          // printf
 #include <stdlib.h>         // exit, free
-#include <string.h>         // strdup
-#include <sys/types.h>      // pid_t
-#include <unistd.h>         // sleep
+#include <unistd.h>         // _exit
 #include <usefull_macros.h>
 
-static glob_pars *GP = NULL;  // for GP->pidfile need in `signals`
+static glob_pars *GP = NULL;
+static ch55session *session = NULL;
+static ch55transport *fbtrans = NULL; // custom bootloader (-F)
+static int lockfd = -1;       // lock of device selected
+static ch55image *image = NULL;
+static volatile sig_atomic_t stoppable = 0; // daemon or server: stop it in main loop
+
+// exit code of process interrupted by signal `sig` (as in shell): not confused with flashstatus
+#define SIGEXIT(sig)    (128 + (sig))
+
+// clean everything and exit with given code
+static void quit(int code){
+    if(flash_stopped()) code = SIGEXIT(flash_stopped());
+    ch55_close(&session);
+    if(fbtrans) fbtrans->close(fbtrans);
+    ch55_freeimage(&image);
+    patch_free();
+    flash_tracestop();
+    server_stop();
+    devunlock(&lockfd);
+    restore_console();
+    exit(code);
+}
 
 /**
  * We REDEFINE the default WEAK function of signal processing
+ * Signal comes while threads (main one too) are inside of session calls holding their locks,
+ * so nothing is closed here: only async-signal-safe calls, locks of devices are released by kernel.
+ * Daemon and server are stopped by their main loops (workers should finish before closing of trace),
+ * the second signal kills them at once.
  */
 void signals(int sig){
-    if(sig){
-        signal(sig, SIG_IGN);
-        DBG("Get signal %d, quit.\n", sig);
+    if(stoppable && !flash_stopped() && (sig == SIGINT || sig == SIGTERM || sig == SIGQUIT)){
+        flash_stop(sig);
+        return;
     }
-    if(GP->pidfile) // remove unnesessary PID file
-        unlink(GP->pidfile);
+    if(sig) signal(sig, SIG_IGN);
     restore_console();
-    exit(sig);
-}
-
-void iffound_default(pid_t pid){
-    ERRX(_("Another copy of this process found, pid=%d. Exit."), pid);
+    server_stop();
+    _exit(SIGEXIT(sig));
 }
 
 int main(int argc, char *argv[]){
+    double tstart = dtime();
     initial_setup();
-    char *self = strdup(argv[0]);
     GP = parse_args(argc, argv);
     if(GP->rest_pars_num){
         printf(_("%d extra options:\n"), GP->rest_pars_num);
@@ -57,8 +86,6 @@ int main(int argc, char *argv[]){
             printf("%s\n", GP->rest_pars[i]);
         return 1;
     }
-    check4running(self, GP->pidfile);
-    free(self);
     signal(SIGTERM, signals); // kill (-15) - quit
     signal(SIGHUP, SIG_IGN);  // hup - ignore
     signal(SIGINT, signals);  // ctrl+C - quit
@@ -66,25 +93,55 @@ int main(int argc, char *argv[]){
     signal(SIGTSTP, SIG_IGN); // ignore ctrl+Z
     setup_con();
 
-    const ch55descr *descr = detect_chip();
-    if(!descr){
-        ERRX(_("Chip not found"));
+    if(GP->binname && !(image = ch55_loadimage(GP->binname))) quit(FLASH_IMAGE);
+    if(GP->verifyonly && !image){
+        WARNX(_("Nothing to verify: give binary file"));
+        quit(FLASH_IMAGE);
+    }
+    if(fast_init(GP)) quit(FLASH_OPEN);
+    if(GP->connect) quit(flash_client(GP, image));
+    if(patch_init(GP)) quit(FLASH_IMAGE);
+    if(boot_init(GP)) quit(FLASH_BOOT);
+    if(flash_tracestart(GP)) quit(FLASH_OPEN);
+    stoppable = GP->server || GP->daemon;
+    if(GP->server) quit(flash_server(GP));
+    if(GP->daemon) quit(flash_daemon(GP, image));
+    if(GP->appid){
+        if(GP->emulate || GP->path || GP->fd >= 0 || GP->uart) WARNX(_("Option -A is ignored with -E, --path, --fd or --uart"));
+        else if(appboot(GP)) quit(FLASH_OPEN);
+    }
+    if(GP->gang){
+        flashresult *res;
+        hubstat *hubs;
+        double tall;
+        int nhubs, N = gang_flash(GP, image, &res, &hubs, &nhubs, &tall), bad = 0;
+        for(int i = 0; i < N; ++i) if(res[i].status != FLASH_OK) ++bad;
+        if(GP->report) report_json(stdout, GP, res, N, hubs, nhubs, tall);
+        else if(N){
+            report_table(res, N, tall);
+            report_hubs(hubs, nhubs);
+        }
+        FREE(res); FREE(hubs);
+        quit(N ? (bad ? FLASH_GANG : FLASH_OK) : FLASH_OPEN);
+    }
+    flashresult res = {0};
+    double t0 = dtime();
+    if(GP->fastboot) fbtrans = selectfast(GP, &res.pos, &lockfd);
+    else session = selectdev(GP, &res.pos, &lockfd);
+    res.phases[PHASE_OPEN] = dtime() - t0;
+    if(!session && !fbtrans) res.status = FLASH_OPEN;
+    else{
+        res.startup = dtime() - tstart;
+        if(!GP->report) printf(_("Device opened in %.1fms (%.1fms since start)\n"), 1e3 * res.phases[PHASE_OPEN],
+                               1e3 * res.startup);
+        if(fbtrans) fast_flash(fbtrans, GP, image, GP->report != NULL, &res);
+        else flashchip(session, GP, image, GP->report != NULL, &res);
     }
-    char *ver = getver();
-    if(!ver) ERRX(_("Bad chip version"));
-    green(_("Found %s, version %s; flash size %d\n"), descr->devname, ver, descr->flash_size);
-    if(!GP->binname) signals(0); // just check chip
-    if(erasechip()) ERRX(_("Can't erase chip"));
-    green(_("Try to write %s\n"), GP->binname);
-    if(writeflash(GP->binname)) ERRX(_("Can't write flash"));
-    green(_("Verify data\n"));
-    if(verifyflash(GP->binname)) ERRX(_("Verification of flash failed"));
-    if(endflash()) ERRX(_("Can't fix writing"));
-    if(!GP->dontrestart){
-        green(_("Reset MCU\n"));
-        restart();
+    if(GP->report) report_json(stdout, GP, &res, 1, NULL, 0, res.time);
+    else{
+        if(res.retries) printf(_("Transactions retried %zu times\n"), res.retries);
+        if(res.status != FLASH_OK) red("%s\n", flashstatus_str(res.status));
     }
-    // clean everything
-    signals(0);
+    quit(res.status);
     return 0;
 }
@@ -0,0 +1,422 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <usefull_macros.h>
+
+#include "patch.h"
+
+// per-unit patches of image: `-S WHERE:TYPE[:ARGS]`, WHERE is address (0x1F00) or symbol
+// from SDCC .map file (optionally with offset: serial_no+2); `@ADDR` is address in data flash
+
+typedef enum{
+    PATCH_SERIAL,       // auto-incrementing number: serial:START[:WIDTH] or serial:COUNTERFILE[:WIDTH]
+    PATCH_MAC,          // 6 bytes: given prefix and the rest from chip ID: mac:02C0FE
+    PATCH_UID,          // 4 bytes of chip ID
+    PATCH_TIME,         // 4 bytes of UNIX time
+    PATCH_CSV,          // bytes from CSV line of unit (first column: chip ID or serial): csv:FILE
+} patchtype;
+
+// one line of CSV: key and data
+typedef struct{
+    char key[32];
+    uint8_t *data;
+    size_t len;
+} csvline;
+
+typedef struct{
+    patchtype type;
+    int data;                   // ==1 for data flash
+    size_t addr;                // address in flash
+    size_t len;                 // length of field (0 for CSV)
+    uint8_t prefix[6];          // MAC prefix
+    int plen;                   // its length
+    csvline *csv;               // CSV data
+    size_t ncsv;
+} patch;
+
+static patch *patches = NULL;
+static int npatches = 0;
+// serial numbers: next value and file to store it
+static unsigned long long nextserial = 0;
+static char *serialfile = NULL;
+static int haveserial = 0;
+static pthread_mutex_t serialmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief patch_amount - amount of patches
+ * @param data - ==1 for data flash patches, ==0 for code flash
+ */
+int patch_amount(int data){
+    int n = 0;
+    for(int i = 0; i < npatches; ++i) if(patches[i].data == data) ++n;
+    return n;
+}
+
+// make name of .map file from name of image
+static char *mapname(const char *binname){
+    if(!binname) return NULL;
+    size_t l = strlen(binname);
+    char *m = MALLOC(char, l + 5);
+    strcpy(m, binname);
+    char *dot = strrchr(m, '.'), *slash = strrchr(m, '/');
+    if(dot && (!slash || dot > slash)) *dot = 0;
+    strcat(m, ".map");
+    return m;
+}
+
+/**
+ * @brief mapsymbol - find address of symbol in code space in SDCC .map file
+ * @param map - file name
+ * @param sym - symbol (C name or with leading underscore)
+ * @param addr (o) - address
+ * @return 0 if found
+ */
+static int mapsymbol(const char *map, const char *sym, size_t *addr){
+    FILE *f = fopen(map, "r");
+    if(!f){
+        WARN(_("Can't open %s"), map);
+        return 1;
+    }
+    char line[256], usym[128];
+    snprintf(usym, sizeof(usym), "_%s", sym);
+    int found = 0;
+    while(!found && fgets(line, sizeof(line), f)){
+        // symbol lines: "     C:   00000123  _name    module" (older SDCC has no "C:")
+        char *tok[4], *save = NULL;
+        int n = 0;
+        for(char *t = strtok_r(line, " \t\r\n", &save); t && n < 4; t = strtok_r(NULL, " \t\r\n", &save)) tok[n++] = t;
+        int i = 0;
+        if(n > 0 && strlen(tok[0]) == 2 && tok[0][1] == ':'){
+            if(tok[0][0] != 'C') continue; // not in code flash
+            i = 1;
+        }
+        if(n < i + 2 || (strcmp(tok[i + 1], sym) && strcmp(tok[i + 1], usym))) continue;
+        char *eptr;
+        unsigned long a = strtoul(tok[i], &eptr, 16);
+        if(*eptr || eptr == tok[i]) continue;
+        *addr = a;
+        found = 1;
+    }
+    fclose(f);
+    return !found;
+}
+
+// parse hex string into bytes; @return amount of bytes or -1 if wrong
+static int parsehex(const char *s, uint8_t *buf, int maxlen){
+    int n = 0;
+    if(strncasecmp(s, "0x", 2) == 0) s += 2;
+    for(; *s; s += 2){
+        if(!isxdigit(s[0]) || !isxdigit(s[1]) || n == maxlen) return -1;
+        char b[3] = {s[0], s[1], 0};
+        buf[n++] = strtoul(b, NULL, 16);
+    }
+    return n;
+}
+
+// read CSV file: key,byte,byte,... (bytes are decimal or 0x-prefixed hex); @return 0 if OK
+static int readcsv(const char *name, patch *p){
+    FILE *f = fopen(name, "r");
+    if(!f){
+        WARN(_("Can't open %s"), name);
+        return 1;
+    }
+    char line[1024];
+    int ret = 0, lineno = 0;
+    while(fgets(line, sizeof(line), f)){
+        ++lineno;
+        char *save = NULL, *t = strtok_r(line, ",; \t\r\n", &save);
+        if(!t || *t == '#') continue; // empty line or comment
+        p->csv = realloc(p->csv, (p->ncsv + 1) * sizeof(csvline));
+        if(!p->csv) ERR("realloc()");
+        csvline *l = &p->csv[p->ncsv++];
+        snprintf(l->key, sizeof(l->key), "%s", t);
+        l->data = MALLOC(uint8_t, 256);
+        l->len = 0;
+        while((t = strtok_r(NULL, ",; \t\r\n", &save))){
+            char *eptr;
+            long v = strtol(t, &eptr, 0);
+            if(*eptr || v < 0 || v > 255 || l->len == 256){
+                WARNX(_("%s:%d: bad byte '%s'"), name, lineno, t);
+                ret = 1;
+                break;
+            }
+            l->data[l->len++] = v;
+        }
+    }
+    fclose(f);
+    if(!p->ncsv){
+        WARNX(_("%s is empty"), name);
+        ret = 1;
+    }
+    return ret;
+}
+
+// read serial counter file; @return 0 if OK
+static int readcounter(const char *name){
+    FILE *f = fopen(name, "r");
+    if(!f){
+        WARN(_("Can't open %s"), name);
+        return 1;
+    }
+    int r = (fscanf(f, "%llu", &nextserial) != 1);
+    fclose(f);
+    if(r) WARNX(_("No number in %s"), name);
+    return r;
+}
+
+/**
+ * @brief parsepatch - parse one patch specification
+ * @param spec - WHERE:TYPE[:ARGS]
+ * @param map - name of .map file (or NULL)
+ * @param p (o) - patch
+ * @return 0 if OK
+ */
+static int parsepatch(const char *spec, const char *map, patch *p){
+    char *s = strdup(spec), *save = NULL;
+    char *where = strtok_r(s, ":", &save), *type = strtok_r(NULL, ":", &save);
+    char *arg1 = strtok_r(NULL, ":", &save), *arg2 = strtok_r(NULL, ":", &save);
+    int ret = 1;
+    memset(p, 0, sizeof(patch));
+    if(!where || !type){
+        WARNX(_("Patch should be WHERE:TYPE[:ARGS]"));
+        goto ret;
+    }
+    // address
+    char *eptr;
+    long off = 0;
+    if(*where == '@'){
+        p->data = 1;
+        ++where;
+    }
+    char *plus = strchr(where, '+');
+    if(plus){
+        *plus++ = 0;
+        off = strtol(plus, &eptr, 0);
+        if(*eptr){
+            WARNX(_("Bad offset: %s"), plus);
+            goto ret;
+        }
+    }
+    p->addr = strtoul(where, &eptr, 0);
+    if(*eptr){ // symbol
+        if(p->data){
+            WARNX(_("Data flash patch needs address"));
+            goto ret;
+        }
+        if(!map){
+            WARNX(_("Need .map file to find %s"), where);
+            goto ret;
+        }
+        if(mapsymbol(map, where, &p->addr)){
+            WARNX(_("Symbol %s not found in %s"), where, map);
+            goto ret;
+        }
+    }
+    p->addr += off;
+    // type
+    if(strcmp(type, "serial") == 0){
+        p->type = PATCH_SERIAL;
+        p->len = 4;
+        if(!arg1){
+            WARNX(_("serial: need start value or counter file"));
+            goto ret;
+        }
+        if(haveserial++){
+            WARNX(_("Only one serial number allowed"));
+            goto ret;
+        }
+        nextserial = strtoull(arg1, &eptr, 0);
+        if(*eptr){ // not a number: file with counter
+            serialfile = strdup(arg1);
+            if(readcounter(serialfile)) goto ret;
+        }
+        if(arg2){
+            p->len = strtoul(arg2, &eptr, 0);
+            if(*eptr || p->len < 1 || p->len > 8){
+                WARNX(_("serial: width should be 1..8 bytes"));
+                goto ret;
+            }
+        }
+    }else if(strcmp(type, "mac") == 0){
+        p->type = PATCH_MAC;
+        p->len = 6;
+        int n = arg1 ? parsehex(arg1, p->prefix, 6) : -1;
+        if(n < 2){
+            WARNX(_("mac: need prefix of 2..6 hex bytes"));
+            goto ret;
+        }
+        p->plen = n;
+    }else if(strcmp(type, "uid") == 0){
+        p->type = PATCH_UID;
+        p->len = 4;
+    }else if(strcmp(type, "time") == 0){
+        p->type = PATCH_TIME;
+        p->len = 4;
+    }else if(strcmp(type, "csv") == 0){
+        p->type = PATCH_CSV;
+        if(!arg1){
+            WARNX(_("csv: need file name"));
+            goto ret;
+        }
+        if(readcsv(arg1, p)) goto ret;
+        for(size_t i = 0; i < p->ncsv; ++i) if(p->csv[i].len > p->len) p->len = p->csv[i].len;
+    }else{
+        WARNX(_("Unknown patch type %s"), type);
+        goto ret;
+    }
+    if(p->addr + p->len > 65536){
+        WARNX(_("Patch %s is out of flash"), spec);
+        goto ret;
+    }
+    DBG("patch %s: addr=0x%04zX, len=%zd", spec, p->addr, p->len);
+    ret = 0;
+ret:
+    FREE(s);
+    return ret;
+}
+
+/**
+ * @brief patch_init - parse all patches from parameters
+ * @param G - parameters
+ * @return 0 if OK
+ */
+int patch_init(glob_pars *G){
+    if(!G->patches || !G->patches[0]) return 0;
+    char *map = G->mapfile ? strdup(G->mapfile) : mapname(G->binname);
+    if(map && !G->mapfile){ // default name: use it only if exists
+        FILE *f = fopen(map, "r");
+        if(f) fclose(f);
+        else FREE(map);
+    }
+    int N = 0, ret = 0;
+    while(G->patches[N]) ++N;
+    patches = MALLOC(patch, N);
+    for(int i = 0; i < N; ++i){
+        if(parsepatch(G->patches[i], map, &patches[npatches])){
+            ret = 1;
+            break;
+        }
+        ++npatches;
+    }
+    FREE(map);
+    return ret;
+}
+
+void patch_free(){
+    for(int i = 0; i < npatches; ++i){
+        for(size_t j = 0; j < patches[i].ncsv; ++j) FREE(patches[i].csv[j].data);
+        FREE(patches[i].csv);
+    }
+    FREE(patches);
+    FREE(serialfile);
+    npatches = haveserial = 0;
+}
+
+// get next serial number (and store next one in counter file)
+static unsigned long long getserial(){
+    pthread_mutex_lock(&serialmutex);
+    unsigned long long s = nextserial++;
+    if(serialfile){
+        FILE *f = fopen(serialfile, "w");
+        if(!f || fprintf(f, "%llu\n", nextserial) < 0) WARN(_("Can't update %s"), serialfile);
+        if(f) fclose(f);
+    }
+    pthread_mutex_unlock(&serialmutex);
+    return s;
+}
+
+/**
+ * @brief patch_image - make copy of image with all fields of given unit patched
+ * @param img - original image (or NULL to patch empty one)
+ * @param data - ==1 to apply data flash patches, ==0 - code flash patches
+ * @param uid - chip ID bytes (4)
+ * @param size - size of flash
+ * @param info (io) - patched values; should be zeroed before first call for unit
+ * @return new image (should be freed by ch55_freeimage) or NULL if failed
+ */
+ch55image *patch_image(const ch55image *img, int data, const uint8_t *uid, uint16_t size, patchinfo *info){
+    size_t len = img ? img->len : 0;
+    for(int i = 0; i < npatches; ++i)
+        if(patches[i].data == data && patches[i].addr + patches[i].len > len) len = patches[i].addr + patches[i].len;
+    if(len > size){
+        WARNX(_("Patches are out of flash (%d bytes)"), size);
+        return NULL;
+    }
+    ch55image *out = MALLOC(ch55image, 1);
+    out->data = MALLOC(uint8_t, len + 1);
+    out->len = len;
+    memset(out->data, CH55_ERASED, len);
+    if(img) memcpy(out->data, img->data, img->len);
+    char uidstr[9];
+    snprintf(uidstr, sizeof(uidstr), "%02X%02X%02X%02X", uid[0], uid[1], uid[2], uid[3]);
+    // serial first (one for both flashes of unit): CSV could be keyed by it
+    if(!info->hasserial && haveserial){
+        info->hasserial = 1;
+        info->serial = getserial();
+    }
+    int hasserial = info->hasserial;
+    unsigned long long serial = info->serial;
+    for(int i = 0; i < npatches; ++i){
+        patch *p = &patches[i];
+        if(p->data != data) continue;
+        uint8_t *d = out->data + p->addr;
+        switch(p->type){
+            case PATCH_SERIAL: // little-endian as SDCC stores integers
+                for(size_t j = 0; j < p->len; ++j) d[j] = (serial >> (8 * j)) & 0xff;
+            break;
+            case PATCH_MAC:{
+                int n = p->plen;
+                memcpy(d, p->prefix, n);
+                memcpy(d + n, uid + 4 - (6 - n), 6 - n);
+            }
+            break;
+            case PATCH_UID:
+                memcpy(d, uid, 4);
+            break;
+            case PATCH_TIME:{
+                uint32_t t = (uint32_t) time(NULL);
+                for(int j = 0; j < 4; ++j) d[j] = (t >> (8 * j)) & 0xff;
+            }
+            break;
+            case PATCH_CSV:{
+                char sstr[32];
+                snprintf(sstr, sizeof(sstr), "%llu", serial);
+                csvline *l = NULL;
+                for(size_t j = 0; j < p->ncsv && !l; ++j)
+                    if(strcasecmp(p->csv[j].key, uidstr) == 0 || (hasserial && strcmp(p->csv[j].key, sstr) == 0))
+                        l = &p->csv[j];
+                if(!l){
+                    WARNX(_("No CSV line for chip %s"), uidstr);
+                    ch55_freeimage(&out);
+                    return NULL;
+                }
+                memcpy(d, l->data, l->len);
+            }
+            break;
+        }
+    }
+    return out;
+}
@@ -16,33 +16,23 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#pragma once
-#ifndef USB_H__
-#define USB_H__
 
-#include <stdint.h>
-#include <stdlib.h>
+#pragma once
+#ifndef PATCH_H__
+#define PATCH_H__
 
-#define CH55VID     (0x4348)
-#define CH55PID     (0x55E0)
-#define EPOUT       (0x02)
-#define EPIN        (0x82)
-#define USB_TIMEOUT (2000)
+#include "ch55isp.h"
+#include "cmdlnopts.h"
 
+// values written into image of one unit
 typedef struct{
-    char *devname;          // device name
-    uint16_t flash_size;    // flash size
-    uint8_t chipid;         // chip ID
-} ch55descr;
+    int hasserial;              // ==1 if serial number was patched
+    unsigned long long serial;  // its value
+} patchinfo;
 
-uint8_t *getusbbuf();
-int usbcmd (const uint8_t *data, int olen, int ilen);
-const ch55descr *detect_chip();
-char *getver();
-int erasechip();
-int writeflash(char *filename);
-int verifyflash(char *filename);
-int endflash();
-void restart();
+int patch_init(glob_pars *G);
+int patch_amount(int data);
+ch55image *patch_image(const ch55image *img, int data, const uint8_t *uid, uint16_t size, patchinfo *info);
+void patch_free();
 
-#endif // USB_H__
+#endif // PATCH_H__
@@ -0,0 +1,206 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+#include "ch55isp.h"
+
+// replay of transaction trace (recorded by `ch55tool --trace`) on bootloader emulator: commands of one
+// session are sent again, answers compared with recorded ones, latencies of both are shown
+
+static int help, chan = 0, dump = 0, realtime = 0, latency = 0;
+static char *tracename = NULL, *emulate = NULL;
+
+static myoption cmdlnopts[] = {
+    {"help",    NO_ARGS,    NULL,   'h',    arg_int,    APTR(&help),        _("show this help")},
+    {"trace",   NEED_ARG,   NULL,   't',    arg_string, APTR(&tracename),   _("trace file")},
+    {"chan",    NEED_ARG,   NULL,   'c',    arg_int,    APTR(&chan),        _("number of session (channel) to replay (default: 0)")},
+    {"dump",    NO_ARGS,    NULL,   'd',    arg_int,    APTR(&dump),        _("print all records and exit")},
+    {"realtime",NO_ARGS,    NULL,   'r',    arg_int,    APTR(&realtime),    _("keep recorded intervals between commands")},
+    {"latency", NEED_ARG,   NULL,   0,      arg_int,    APTR(&latency),     _("emulator: latency of each transaction, us (default: 0)")},
+    {"emulate", NEED_ARG,   NULL,   'E',    arg_string, APTR(&emulate),     _("chip to emulate if there's no handshake in trace")},
+    end_option
+};
+
+// max amount of differences shown
+#define MAXDIFFS    (10)
+
+static const char *typenames[] = {"?", "CMD", "ANS", "FAIL", "REOPEN", "SEND"};
+
+// read all records of trace; @return their amount
+static size_t readtrace(const char *name, ch55tracerec **recs){
+    FILE *f = fopen(name, "r");
+    if(!f) ERR(_("Can't open %s"), name);
+    char magic[sizeof(CH55_TRACE_MAGIC) - 1];
+    if(1 != fread(magic, sizeof(magic), 1, f) || memcmp(magic, CH55_TRACE_MAGIC, sizeof(magic)))
+        ERRX(_("%s isn't trace file"), name);
+    size_t n = 0, size = 0;
+    *recs = NULL;
+    for(;;){
+        if(n == size){
+            size = size ? size * 2 : 4096;
+            *recs = realloc(*recs, size * sizeof(ch55tracerec));
+            if(!*recs) ERR("realloc()");
+        }
+        size_t got = fread(*recs + n, sizeof(ch55tracerec), size - n, f);
+        n += got;
+        if(n < size) break;
+    }
+    fclose(f);
+    return n;
+}
+
+static void printhex(const uint8_t *data, int len){
+    for(int i = 0; i < len; ++i) printf(" %02x", data[i]);
+    printf("\n");
+}
+
+// make emulator configuration from answers to detect and read config commands of channel
+static int getconf(ch55tracerec *r, size_t N, ch55emulconf *conf){
+    int havechip = 0, havecfg = 0;
+    uint8_t last = 0; // code of last command (handshake isn't pipelined)
+    for(size_t i = 0; i < N && !(havechip && havecfg); ++i, ++r){
+        if(r->chan != chan) continue;
+        if(r->type == CH55_TRACE_CMD && r->len) last = r->data[0];
+        else if(r->type != CH55_TRACE_ANS) continue;
+        if(last == 0xa1 && r->len >= 6 && r->data[0] == 0xa1){
+            conf->chipid = r->data[4];
+            havechip = 1;
+        }else if(last == 0xa7 && r->len >= 26 && r->data[0] == 0xa7){
+            memcpy(conf->version, &r->data[19], 3);
+            memcpy(conf->id, &r->data[22], 4);
+            havecfg = 1;
+        }
+    }
+    if(emulate){
+        const ch55descr *d = ch55_getdescrbyname(emulate);
+        if(!d) ERRX(_("Unknown chip %s"), emulate);
+        conf->chipid = d->chipid;
+        havechip = 1;
+    }
+    if(!havecfg){ // without key answers could be compared only for unscrambled commands
+        conf->version[0] = 2; conf->version[1] = 4; conf->version[2] = 0;
+    }
+    return havechip;
+}
+
+static void printlat(uint8_t code, ch55latency *rec, ch55latency *rep){
+    printf("  0x%02X  %-7zu %-10.1f %-10.1f %-10.1f %.1f\n", code, rec->n, ch55_percentile(rec, 50.) * 1e6,
+           ch55_percentile(rec, 99.) * 1e6, ch55_percentile(rep, 50.) * 1e6, ch55_percentile(rep, 99.) * 1e6);
+}
+
+int main(int argc, char **argv){
+    initial_setup();
+    parseargs(&argc, &argv, cmdlnopts);
+    if(help || !tracename) showhelp(-1, cmdlnopts);
+    ch55tracerec *recs;
+    size_t N = readtrace(tracename, &recs);
+    if(dump){
+        for(size_t i = 0; i < N; ++i){
+            ch55tracerec *r = &recs[i];
+            printf("%12.6f ch%-3d %-6s", r->t * 1e-9, r->chan, typenames[r->type < sizeof(typenames) / sizeof(typenames[0]) ? r->type : 0]);
+            printhex(r->data, r->len);
+        }
+        FREE(recs);
+        return 0;
+    }
+    ch55emulconf conf = {.latency = latency};
+    if(!getconf(recs, N, &conf)) ERRX(_("No detect answer in channel %d, use -E"), chan);
+    ch55transport *t = ch55_emulator(&conf);
+    if(!t) ERRX(_("Can't create emulator"));
+    const ch55descr *d = ch55_getdescr(conf.chipid);
+    printf(_("Replay channel %d of %s on %s V%d.%d%d, chip ID %02X%02X%02X%02X\n"), chan, tracename,
+           d ? d->devname : "?", conf.version[0], conf.version[1], conf.version[2],
+           conf.id[0], conf.id[1], conf.id[2], conf.id[3]);
+    // commands sent but not answered yet (answers come in order of commands)
+    size_t *pending = MALLOC(size_t, N + 1), phead = 0, ptail = 0;
+    size_t ncmd = 0, ndiff = 0, nfail = 0, nreopen = 0, nsend = 0;
+    uint64_t tfirst = 0, tlast = 0;
+    static ch55latency reclat[256], replat[256];
+    double t0 = dtime();
+    for(size_t i = 0; i < N; ++i){
+        ch55tracerec *r = &recs[i];
+        if(r->chan != chan) continue;
+        if(!ncmd && phead == ptail) tfirst = r->t;
+        tlast = r->t;
+        switch(r->type){
+            case CH55_TRACE_CMD:
+                pending[phead++] = i;
+                continue;
+            case CH55_TRACE_REOPEN:
+                ++nreopen;
+                t->reopen(t);
+                continue;
+            case CH55_TRACE_SEND: // no answer to compare (reset): skip
+                ++nsend;
+                continue;
+            case CH55_TRACE_ANS:
+            case CH55_TRACE_FAIL:
+                break;
+            default:
+                continue;
+        }
+        if(ptail == phead){
+            WARNX(_("Record %zu: answer without command"), i);
+            continue;
+        }
+        ch55tracerec *c = &recs[pending[ptail++]];
+        if(!c->len) continue;
+        ++ncmd;
+        if(realtime){ // wait for moment of command relative to start of replay
+            double dt = (c->t - tfirst) * 1e-9 - (dtime() - t0);
+            if(dt > 0.) usleep(dt * 1e6);
+        }
+        uint8_t ans[64];
+        double tc = dtime();
+        int got = t->xfer(t, c->data, c->len, ans, sizeof(ans));
+        ch55_addsample(&replat[c->data[0]], dtime() - tc);
+        if(r->type == CH55_TRACE_FAIL){ // field failure: answer was lost, device state goes on
+            ++nfail;
+            continue;
+        }
+        ch55_addsample(&reclat[c->data[0]], (r->t - c->t) * 1e-9);
+        if(got == r->len && !memcmp(ans, r->data, got)) continue;
+        if(++ndiff <= MAXDIFFS){
+            printf(_("Record %zu (%.6fs): command"), pending[ptail - 1], c->t * 1e-9);
+            printhex(c->data, c->len < 8 ? c->len : 8);
+            printf(_("  recorded:"));
+            printhex(r->data, r->len);
+            printf(_("  replayed:"));
+            if(got < 0) printf(_(" no answer\n"));
+            else printhex(ans, got);
+        }
+    }
+    double treplay = dtime() - t0;
+    printf(_("%zu transactions (%zu failed, %zu reopens, %zu without answer skipped), %zu answers differ\n"),
+           ncmd, nfail, nreopen, nsend, ndiff);
+    printf(_("Recorded time %.3fs, replayed in %.3fs\n"), (tlast - tfirst) * 1e-9, treplay);
+    printf(_("  Code  Count   Rec.p50,us Rec.p99,us Rep.p50,us Rep.p99,us\n"));
+    for(int code = 0; code < 256; ++code){
+        if(reclat[code].n || replat[code].n) printlat(code, &reclat[code], &replat[code]);
+        FREE(reclat[code].t);
+        FREE(replat[code].t);
+    }
+    t->close(t);
+    FREE(pending);
+    FREE(recs);
+    return ndiff ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <usefull_macros.h>
+
+#include "report.h"
+
+/**
+ * @brief report_table - print table with results of gang flashing
+ * @param r - results
+ * @param N - amount of devices
+ * @param tall - full time
+ */
+void report_table(flashresult *r, int N, double tall){
+    int bad = 0;
+    printf("\n%-8s %-6s %-6s %-8s %-8s %-7s %s\n", _("Bus:Addr"), _("Chip"), _("Ver."), _("Time, s"), _("Flash"),
+           _("Retries"), _("Result"));
+    for(int i = 0; i < N; ++i, ++r){
+        printf("%03d:%03d  %-6s %-6s %-8.2f %-8s %-7zu ", r->pos.bus, r->pos.addr, r->devname, r->version, r->time,
+               r->skipped ? _("same") : _("flashed"), r->retries);
+        if(r->status == FLASH_OK) green("%s\n", flashstatus_str(r->status));
+        else{
+            ++bad;
+            red("%s\n", flashstatus_str(r->status));
+        }
+    }
+    printf(_("Total: %d devices, %d failed; time %.2fs\n"), N, bad, tall);
+}
+
+// utilisation of hub bandwidth, percents
+static double hubload(const hubstat *h){
+    if(h->busy <= 0.) return 0.;
+    return 100. * h->bytes / h->busy / FS_BULK_BPS;
+}
+
+/**
+ * @brief report_hubs - print table with utilisation of hubs in gang flashing
+ * @param h - hubs
+ * @param N - their amount
+ */
+void report_hubs(hubstat *h, int N){
+    printf("\n%-12s %-7s %-4s %-7s %-7s %-8s %s\n", _("Hub"), _("Devices"), _("Cap"), _("Max run"), _("Busy, s"),
+           _("kB/s"), _("Load, %"));
+    for(int i = 0; i < N; ++i, ++h){
+        double speed = (h->busy > 0.) ? h->bytes / h->busy / 1000. : 0.;
+        printf("%-12s %-7d %-4d %-7d %-7.2f %-8.1f %.1f\n", h->path, h->ndevs, h->cap, h->maxrun, h->busy,
+               speed, hubload(h));
+    }
+}
+
+// print string with JSON escaping
+static void jsonstr(FILE *f, const char *s){
+    fputc('"', f);
+    for(; s && *s; ++s){
+        if(*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+        else if((unsigned char)*s < 0x20) fprintf(f, "\\u%04x", *s);
+        else fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void json1(FILE *f, flashresult *r, const char *indent){
+    fprintf(f, "%s\"device\": \"%03d:%03d\",\n", indent, r->pos.bus, r->pos.addr);
+    fprintf(f, "%s\"chip\": \"%s\",\n%s\"version\": \"%s\",\n", indent, r->devname, indent, r->version);
+    fprintf(f, "%s\"chip_id\": \"%02X%02X%02X%02X\",\n", indent, r->uid[0], r->uid[1], r->uid[2], r->uid[3]);
+    fprintf(f, "%s\"status\": %d,\n%s\"status_str\": ", indent, r->status, indent);
+    jsonstr(f, flashstatus_str(r->status));
+    fprintf(f, ",\n%s\"path\": \"%s\",\n", indent, r->skipped ? "same" : "flashed");
+    if(r->hasserial) fprintf(f, "%s\"serial\": %llu,\n", indent, r->serial);
+    if(r->cached) fprintf(f, "%s\"changed_packets\": %zu,\n", indent, r->changed);
+    if(r->startup > 0.) fprintf(f, "%s\"startup_s\": %.4f,\n", indent, r->startup);
+    fprintf(f, "%s\"time_s\": %.4f,\n%s\"phases_s\": {", indent, r->time, indent);
+    for(int p = 0; p < PHASE_AMOUNT; ++p)
+        fprintf(f, "%s\"%s\": %.4f", p ? ", " : "", flashphase_str(p), r->phases[p]);
+    fprintf(f, "},\n%s\"packets\": %zu,\n%s\"bytes\": %zu,\n%s\"retries\": %zu\n",
+            indent, r->packets, indent, r->bytes, indent, r->retries);
+}
+
+/**
+ * @brief report_json - print results as one JSON object
+ * @param f - output file
+ * @param G - parameters
+ * @param r - results
+ * @param N - amount of devices
+ * @param h - hubs of gang (or NULL)
+ * @param nh - their amount
+ * @param tall - full time
+ */
+void report_json(FILE *f, glob_pars *G, flashresult *r, int N, hubstat *h, int nh, double tall){
+    fprintf(f, "{\n  \"image\": ");
+    if(G->binname) jsonstr(f, G->binname);
+    else fprintf(f, "null");
+    fprintf(f, ",\n");
+    if(!G->gang){
+        json1(f, r, "  ");
+        fprintf(f, "}\n");
+        return;
+    }
+    int bad = 0;
+    for(int i = 0; i < N; ++i) if(r[i].status != FLASH_OK) ++bad;
+    fprintf(f, "  \"devices_total\": %d,\n  \"devices_failed\": %d,\n  \"time_s\": %.4f,\n  \"devices\": [",
+            N, bad, tall);
+    for(int i = 0; i < N; ++i){
+        fprintf(f, "%s\n    {\n", i ? "," : "");
+        json1(f, &r[i], "      ");
+        fprintf(f, "    }");
+    }
+    fprintf(f, "\n  ],\n  \"hubs\": [");
+    for(int i = 0; i < nh; ++i, ++h){
+        fprintf(f, "%s\n    {\"hub\": ", i ? "," : "");
+        jsonstr(f, h->path);
+        fprintf(f, ", \"devices\": %d, \"cap\": %d, \"max_running\": %d, \"busy_s\": %.4f, \"bytes\": %zu, "
+                "\"load_percent\": %.1f}", h->ndevs, h->cap, h->maxrun, h->busy, h->bytes, hubload(h));
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
@@ -0,0 +1,538 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libusb.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "cache.h"
+#include "devsel.h"
+#include "report.h"
+#include "server.h"
+#include "sockio.h"
+
+/*
+ * Job server: owns libusb context and all bootloaders (pool of opened sessions), accepts jobs of
+ * clients over Unix socket, queues them and dispatches to free matching devices.
+ * Protocol (text lines; binary data follows SIZE/DATA lines):
+ *   client: JOB [image=HASH] [name=FILE] [data=HASH] [chip=NAME] [chipid=HEX] [bus=N] [port=P.P]
+ *               [skipsame=1] [dontrestart=1] [verifyonly=1] [dataread=1]
+ *   server: NEED HASH          - image isn't in cache, client answers "SIZE n" and n bytes
+ *           QUEUED id n        - job queued, n jobs before it
+ *           START id path chip uid - job started on device
+ *           PHASE name seconds - phase of flashing done
+ *           DATA n             - n bytes of data flash follow
+ *           RESULT status      - the last message, JSON report follows till closing of connection
+ *           ERROR message      - job rejected
+ */
+
+// state of device in pool
+typedef enum{
+    DEV_PROBE,              // opened, chip is detecting
+    DEV_FREE,               // ready for job
+    DEV_BUSY                // job is running
+} devstate;
+
+struct job;
+
+typedef struct{
+    libusb_device *dev;     // device (NULL for emulator)
+    ch55devaddr pos;        // its position
+    char path[32];          //   as string
+    int lockfd;             //   and lock
+    int present;            // ==0 after device left
+    devstate state;
+    ch55session *s;         // opened session
+    char chip[8];           // chip name
+    char uid[9];            // chip ID
+    struct job *job;        // current job
+} pooldev;
+
+typedef struct job{
+    struct job *next;
+    int id;
+    int fd;                 // client socket
+    glob_pars G;            // server parameters with options of job
+    const ch55image *img;   // image to flash (NULL - only check chip or data flash)
+    char chip[8], chipid[9], port[32];
+    char name[PATH_MAX];    // client's name of image (for report)
+    char datawrite[PATH_MAX], dataread[PATH_MAX];
+    int done;               // ==1 when worker sent result
+    pthread_cond_t cond;
+} job;
+
+// uploaded images (kept until server exits)
+typedef struct cimage{
+    struct cimage *next;
+    uint64_t hash;
+    char path[PATH_MAX];
+    ch55image *img;
+} cimage;
+
+#define MAXPOOL     (128)
+// max time of waiting for data from client, s
+#define CLIENT_TIMEOUT  (10)
+// polling interval of stop flag, ms
+#define STOP_POLL       (100)
+static pooldev *pool[MAXPOOL];
+static int npool = 0;
+static job *queue = NULL;
+static int jobid = 0;
+static int nrunning = 0; // amount of running workers and probers
+static pthread_mutex_t poolmutex = PTHREAD_MUTEX_INITIALIZER; // pool, queue and output
+static pthread_cond_t idlecond = PTHREAD_COND_INITIALIZER;    // signaled when worker or prober ends
+static cimage *images = NULL;
+static pthread_mutex_t imgmutex = PTHREAD_MUTEX_INITIALIZER;
+static glob_pars *SG = NULL;
+static libusb_context *ctx = NULL;
+static char *sockpath = NULL;
+
+/**
+ * @brief probe - open device (if isn't opened) and get its chip name and ID
+ * @return 0 if OK
+ */
+static int probe(pooldev *d){
+    if(!d->s) d->s = d->dev ? mksession(SG, ch55_usbtransport_dev(ctx, d->dev)) : opensession(SG, NULL);
+    if(!d->s) return 1;
+    const ch55descr *descr = ch55_detect_chip(d->s);
+    if(!descr || !ch55_getver(d->s)) return 1;
+    const uint8_t *uid = ch55_getuid(d->s);
+    snprintf(d->chip, sizeof(d->chip), "%s", descr->devname);
+    snprintf(d->uid, sizeof(d->uid), "%02X%02X%02X%02X", uid[0], uid[1], uid[2], uid[3]);
+    return 0;
+}
+
+// remove device from pool (poolmutex should be locked)
+static void dropdev(pooldev *d){
+    DBG("Drop device %s", d->path);
+    ch55_close(&d->s);
+    devunlock(&d->lockfd);
+    if(d->dev) libusb_unref_device(d->dev);
+    for(int i = 0; i < npool; ++i) if(pool[i] == d){
+        pool[i] = pool[--npool];
+        break;
+    }
+    FREE(d);
+}
+
+static int jobmatch(job *j, pooldev *d){
+    if(!devmatch(&j->G, &d->pos)) return 0;
+    if(*j->chip && strcasecmp(j->chip, d->chip)) return 0;
+    if(*j->chipid && strcasecmp(j->chipid, d->uid)) return 0;
+    return 1;
+}
+
+static void *worker(void *arg);
+
+// start queued jobs on free devices (poolmutex should be locked)
+static void dispatch(){
+    if(flash_stopped()) return;
+    job **pj = &queue;
+    while(*pj){
+        job *j = *pj;
+        pooldev *d = NULL;
+        for(int i = 0; i < npool && !d; ++i)
+            if(pool[i]->state == DEV_FREE && pool[i]->present && jobmatch(j, pool[i])) d = pool[i];
+        if(!d){
+            pj = &j->next;
+            continue;
+        }
+        *pj = j->next;
+        d->state = DEV_BUSY;
+        d->job = j;
+        ++nrunning;
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, worker, d)) ERR("pthread_create()");
+        pthread_detach(thread);
+    }
+}
+
+// detect chip of arrived device and make it ready for jobs
+static void *prober(void *arg){
+    pooldev *d = (pooldev*) arg;
+    int e = probe(d);
+    pthread_mutex_lock(&poolmutex);
+    if(e || !d->present){
+        if(e) WARNX(_("Can't detect chip of device %s"), d->path);
+        dropdev(d);
+    }else{
+        if(!SG->report) printf(_("Device %s ready: %s %s\n"), d->path, d->chip, d->uid);
+        d->state = DEV_FREE;
+        dispatch();
+    }
+    fflush(stdout);
+    --nrunning;
+    pthread_cond_signal(&idlecond);
+    pthread_mutex_unlock(&poolmutex);
+    return NULL;
+}
+
+// add device to pool and probe it (poolmutex should be locked)
+static void adddev(libusb_device *dev, const ch55devaddr *pos, int lockfd){
+    if(npool == MAXPOOL){
+        WARNX(_("Too many devices"));
+        devunlock(&lockfd);
+        return;
+    }
+    pooldev *d = MALLOC(pooldev, 1);
+    d->dev = dev ? libusb_ref_device(dev) : NULL;
+    d->pos = *pos;
+    devpath(pos, d->path, sizeof(d->path));
+    d->lockfd = lockfd;
+    d->present = 1;
+    d->state = DEV_PROBE;
+    pool[npool++] = d;
+    ++nrunning;
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, prober, d)) ERR("pthread_create()");
+    pthread_detach(thread);
+}
+
+// send progress of job to its client
+static void progress(const flashresult *res, flashphase p, void *arg){
+    job *j = (job*) arg;
+    sock_printf(j->fd, "PHASE %s %.4f\n", flashphase_str(p), res->phases[p]);
+}
+
+// send content of data flash saved by flashchip
+static void senddata(job *j){
+    mmapbuf *map = My_mmap(j->dataread);
+    if(!map) return;
+    if(!sock_printf(j->fd, "DATA %zu\n", map->len)) sock_write(j->fd, map->data, map->len);
+    My_munmap(map);
+    unlink(j->dataread);
+}
+
+static void *worker(void *arg){
+    pooldev *d = (pooldev*) arg;
+    job *j = d->job;
+    flashresult res = {0};
+    res.pos = d->pos;
+    res.progress = progress;
+    res.progarg = j;
+    sock_printf(j->fd, "START %d %s %s %s\n", j->id, d->path, d->chip, d->uid);
+    flashchip(d->s, &j->G, j->img, 1, &res);
+    if(*j->dataread) senddata(j);
+    char *json = NULL;
+    size_t l = 0;
+    FILE *f = open_memstream(&json, &l);
+    if(f){
+        report_json(f, &j->G, &res, 1, NULL, 0, res.time);
+        fclose(f);
+    }
+    if(!sock_printf(j->fd, "RESULT %d\n", res.status) && json) sock_write(j->fd, json, l);
+    FREE(json);
+    // MCU restarted: bootloader is gone; emulator is "replugged" at once
+    int gone = res.status == FLASH_OK && !j->G.dontrestart;
+    if(gone && !d->dev){
+        ch55_close(&d->s);
+        gone = probe(d);
+    }
+    pthread_mutex_lock(&poolmutex);
+    if(!SG->report) printf(_("Job %d on %s: %s (%.2fs)\n"), j->id, d->path, flashstatus_str(res.status), res.time);
+    fflush(stdout);
+    j->done = 1;
+    pthread_cond_signal(&j->cond);
+    d->job = NULL;
+    if(gone || !d->present) dropdev(d);
+    else d->state = DEV_FREE;
+    dispatch();
+    --nrunning;
+    pthread_cond_signal(&idlecond);
+    pthread_mutex_unlock(&poolmutex);
+    return NULL;
+}
+
+static int LIBUSB_CALL hotplug(libusb_context *c, libusb_device *dev, libusb_hotplug_event ev, void *data){
+    (void) c; (void) data;
+    pthread_mutex_lock(&poolmutex);
+    if(ev == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT){
+        for(int i = 0; i < npool; ++i) if(pool[i]->dev == dev && pool[i]->present){
+            pool[i]->present = 0;
+            if(pool[i]->state == DEV_FREE) dropdev(pool[i]);
+            break;
+        }
+    }else{
+        ch55devaddr pos = {.bus = libusb_get_bus_number(dev), .addr = libusb_get_device_address(dev)};
+        int n = libusb_get_port_numbers(dev, pos.ports, sizeof(pos.ports)), i;
+        pos.nports = (n > 0) ? n : 0;
+        // device re-enumerated by its worker stays at the same position
+        for(i = 0; i < npool; ++i)
+            if(pool[i]->present && pool[i]->pos.bus == pos.bus && pool[i]->pos.nports == pos.nports
+               && !memcmp(pool[i]->pos.ports, pos.ports, pos.nports)) break;
+        if(i == npool && !flash_stopped() && devmatch(SG, &pos)){
+            int lockfd = devlock(SG, &pos);
+            if(lockfd >= 0) adddev(dev, &pos, lockfd);
+        }
+    }
+    pthread_mutex_unlock(&poolmutex);
+    return 0;
+}
+
+static void *usbevents(void *arg){
+    (void) arg;
+    while(1){
+        int r = libusb_handle_events(ctx);
+        if(r && r != LIBUSB_ERROR_INTERRUPTED){
+            WARNX("libusb_handle_events(): %s", libusb_error_name(r));
+            break;
+        }
+    }
+    return NULL;
+}
+
+// find loaded image by its hash; imgmutex should be locked
+static cimage *findimage(uint64_t hash){
+    cimage *c = images;
+    while(c && c->hash != hash) c = c->next;
+    return c;
+}
+
+/**
+ * @brief upload - get image from client and store it into cache file
+ * @param fd - client socket
+ * @param hashstr - hash (hex)
+ * @param hash - its value
+ * @param path - name of cache file
+ * @return 0 if OK
+ */
+static int upload(int fd, const char *hashstr, uint64_t hash, const char *path){
+    char line[64];
+    unsigned long long l;
+    if(sock_printf(fd, "NEED %s\n", hashstr) || sock_gets(fd, line, sizeof(line)) < 0
+       || sscanf(line, "SIZE %llu", &l) != 1 || l > 1<<24) return 1;
+    uint8_t *buf = MALLOC(uint8_t, l + 1);
+    int e = sock_read(fd, buf, l);
+    if(!e && cache_hash(buf, l) != hash){
+        WARNX(_("Wrong hash of uploaded image"));
+        e = 1;
+    }
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, fd);
+    FILE *f = e ? NULL : fopen(tmp, "w");
+    if(f){ // file appears at once, so the same image could be uploaded by several clients in parallel
+        e = (fwrite(buf, 1, l, f) != l);
+        e |= fclose(f);
+        if(!e) e = rename(tmp, path);
+        if(e) unlink(tmp);
+    }else e = 1;
+    FREE(buf);
+    return e;
+}
+
+/**
+ * @brief getimage - find uploaded image by its hash or get it from client
+ * Upload is made without lock, so slow client doesn't stop the others
+ * @param fd - client socket
+ * @param hashstr - hash (hex)
+ * @return image or NULL if failed
+ */
+static cimage *getimage(int fd, const char *hashstr){
+    char *eptr, name[64], path[PATH_MAX];
+    uint64_t hash = strtoull(hashstr, &eptr, 16);
+    if(*eptr || eptr == hashstr) return NULL;
+    pthread_mutex_lock(&imgmutex);
+    cimage *c = findimage(hash);
+    pthread_mutex_unlock(&imgmutex);
+    if(c) return c;
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+    if(!cache_path(name, path, sizeof(path))) return NULL;
+    if(access(path, R_OK) && upload(fd, hashstr, hash, path)) return NULL;
+    ch55image *img = ch55_loadimage(path);
+    if(!img) return NULL;
+    pthread_mutex_lock(&imgmutex);
+    if((c = findimage(hash))) ch55_freeimage(&img); // loaded by another client meanwhile
+    else{
+        c = MALLOC(cimage, 1);
+        c->hash = hash;
+        snprintf(c->path, sizeof(c->path), "%s", path);
+        c->img = img;
+        c->next = images;
+        images = c;
+    }
+    pthread_mutex_unlock(&imgmutex);
+    return c;
+}
+
+// parse JOB line; @return error message or NULL if OK
+static const char *parsejob(job *j, char *line){
+    char *saveptr, *tok = strtok_r(line, " ", &saveptr);
+    if(!tok || strcmp(tok, "JOB")) return "bad request";
+    j->G.binname = NULL;
+    j->G.datawrite = j->G.dataread = NULL;
+    j->G.chip = j->G.chipid = j->G.port = NULL;
+    j->G.bus = j->G.skipsame = j->G.dontrestart = j->G.verifyonly = 0;
+    while((tok = strtok_r(NULL, " ", &saveptr))){
+        char *val = strchr(tok, '=');
+        if(!val) return "bad option";
+        *val++ = 0;
+        if(!strcmp(tok, "image") || !strcmp(tok, "data")){
+            cimage *c = getimage(j->fd, val);
+            if(!c) return "can't get image";
+            if(*tok == 'i'){
+                j->img = c->img;
+                if(!*j->name) j->G.binname = c->path;
+            }else{
+                snprintf(j->datawrite, sizeof(j->datawrite), "%s", c->path);
+                j->G.datawrite = j->datawrite;
+            }
+        }else if(!strcmp(tok, "name")){ // cache file is used only for loading
+            sock_unescape(val);
+            snprintf(j->name, sizeof(j->name), "%s", val);
+            j->G.binname = j->name;
+        }else if(!strcmp(tok, "chip")){
+            snprintf(j->chip, sizeof(j->chip), "%s", val);
+            j->G.chip = j->chip;
+        }else if(!strcmp(tok, "chipid")){
+            snprintf(j->chipid, sizeof(j->chipid), "%s", val);
+            j->G.chipid = j->chipid;
+        }else if(!strcmp(tok, "port")){
+            snprintf(j->port, sizeof(j->port), "%s", val);
+            j->G.port = j->port;
+        }else if(!strcmp(tok, "bus")) j->G.bus = atoi(val);
+        else if(!strcmp(tok, "skipsame")) j->G.skipsame = atoi(val);
+        else if(!strcmp(tok, "dontrestart")) j->G.dontrestart = atoi(val);
+        else if(!strcmp(tok, "verifyonly")) j->G.verifyonly = atoi(val);
+        else if(!strcmp(tok, "dataread")){
+            char name[32];
+            snprintf(name, sizeof(name), "data-%d.bin", j->id);
+            if(!cache_path(name, j->dataread, sizeof(j->dataread))) return "can't create file for data";
+            unlink(j->dataread); // could be left by previous run of server
+            j->G.dataread = j->dataread;
+        }else return "unknown option";
+    }
+    if(j->G.verifyonly && !j->img) return "nothing to verify";
+    return NULL;
+}
+
+// serve one client: get its job, queue it and wait till worker send result
+static void *client(void *arg){
+    job *j = MALLOC(job, 1);
+    char line[1024];
+    j->fd = (int)(intptr_t) arg;
+    j->G = *SG;
+    pthread_cond_init(&j->cond, NULL);
+    pthread_mutex_lock(&poolmutex);
+    j->id = ++jobid;
+    pthread_mutex_unlock(&poolmutex);
+    const char *err = "bad request";
+    if(sock_gets(j->fd, line, sizeof(line)) > 0) err = parsejob(j, line);
+    if(err){
+        sock_printf(j->fd, "ERROR %s\n", err);
+        goto ret;
+    }
+    pthread_mutex_lock(&poolmutex);
+    int n = 0;
+    job **pj = &queue;
+    for(; *pj; pj = &(*pj)->next) ++n;
+    *pj = j;
+    sock_printf(j->fd, "QUEUED %d %d\n", j->id, n);
+    if(!SG->report) printf(_("Job %d queued\n"), j->id);
+    fflush(stdout);
+    dispatch();
+    while(!j->done) pthread_cond_wait(&j->cond, &poolmutex);
+    pthread_mutex_unlock(&poolmutex);
+ret:
+    close(j->fd);
+    pthread_cond_destroy(&j->cond);
+    FREE(j);
+    return NULL;
+}
+
+/**
+ * @brief flash_server - serve jobs of clients on Unix socket G->server (works until signal got)
+ * After signal queued jobs are rejected, running ones are finished and devices are closed,
+ * so trace could be closed after return
+ * @param G - parameters (common for all jobs)
+ * @return error code (if can't start) or FLASH_OK if stopped by signal
+ */
+flashstatus flash_server(glob_pars *G){
+    libusb_hotplug_callback_handle cbh;
+    pthread_t thread;
+    SG = G;
+    int sock = sock_unix(G->server, 1);
+    if(sock < 0) return FLASH_OPEN;
+    sockpath = G->server;
+    if(G->emulate){ // the only device
+        ch55devaddr pos = {0};
+        pthread_mutex_lock(&poolmutex);
+        adddev(NULL, &pos, -1);
+        pthread_mutex_unlock(&poolmutex);
+    }else{
+        if(libusb_init(&ctx)){
+            WARNX("libusb_init()");
+            return FLASH_OPEN;
+        }
+        if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)){
+            WARNX(_("Hotplug isn't supported on this platform"));
+            return FLASH_OPEN;
+        }
+        if(libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                LIBUSB_HOTPLUG_ENUMERATE, CH55VID, CH55PID, LIBUSB_HOTPLUG_MATCH_ANY, hotplug, NULL, &cbh)){
+            WARNX("libusb_hotplug_register_callback()");
+            return FLASH_OPEN;
+        }
+        if(pthread_create(&thread, NULL, usbevents, NULL)) ERR("pthread_create()");
+    }
+    if(!G->report) green(_("Wait for jobs on %s, press Ctrl+C to quit\n"), G->server);
+    while(!flash_stopped()){
+        struct pollfd pfd = {.fd = sock, .events = POLLIN};
+        if(poll(&pfd, 1, STOP_POLL) < 1) continue;
+        int fd = accept(sock, NULL, NULL);
+        if(fd < 0){
+            WARN("accept()");
+            continue;
+        }
+        // client only sends job and image: stalled one shouldn't keep its thread forever
+        struct timeval tv = {.tv_sec = CLIENT_TIMEOUT};
+        if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) WARN("setsockopt()");
+        if(pthread_create(&thread, NULL, client, (void*)(intptr_t)fd)){
+            WARN("pthread_create()");
+            close(fd);
+        }else pthread_detach(thread);
+    }
+    close(sock);
+    pthread_mutex_lock(&poolmutex);
+    for(job *j = queue; j; j = j->next){
+        sock_printf(j->fd, "ERROR server stopped\n");
+        j->done = 1;
+        pthread_cond_signal(&j->cond);
+    }
+    queue = NULL;
+    if(nrunning && !G->report) printf(_("Wait for running jobs\n"));
+    fflush(stdout);
+    while(nrunning) pthread_cond_wait(&idlecond, &poolmutex);
+    while(npool) dropdev(pool[0]);
+    pthread_mutex_unlock(&poolmutex);
+    return FLASH_OK;
+}
+
+// remove socket file of running server
+void server_stop(){
+    if(sockpath) unlink(sockpath);
+    sockpath = NULL;
+}
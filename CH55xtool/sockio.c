@@ -0,0 +1,163 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "sockio.h"
+
+// line-oriented exchange over Unix socket between job server and its clients
+
+/**
+ * @brief sock_unix - open Unix stream socket
+ * @param path - its path
+ * @param server - ==1 to bind and listen (stale socket file is removed), ==0 to connect
+ * @return socket or -1 if failed
+ */
+int sock_unix(const char *path, int server){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        WARNX(_("Socket path %s is too long"), path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        WARN("socket()");
+        return -1;
+    }
+    if(!connect(fd, (struct sockaddr*)&addr, sizeof(addr))){
+        if(!server) return fd;
+        WARNX(_("Server on %s is already running"), path);
+        close(fd);
+        return -1;
+    }
+    if(!server){
+        WARN(_("Can't connect to %s"), path);
+        close(fd);
+        return -1;
+    }
+    unlink(path); // nobody listens: socket file left by killed server
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 16)){
+        WARN(_("Can't listen on %s"), path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// write whole buffer (broken connection don't raise SIGPIPE); @return 0 if OK
+int sock_write(int fd, const void *buf, size_t len){
+    const char *p = (const char*) buf;
+    while(len){
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return 1;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+// formatted message (not longer than 1023 bytes); @return 0 if OK
+int sock_printf(int fd, const char *fmt, ...){
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int l = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if(l < 0) return 1;
+    if(l >= (int)sizeof(buf)) l = sizeof(buf) - 1;
+    return sock_write(fd, buf, l);
+}
+
+// read exactly `len` bytes; @return 0 if OK
+int sock_read(int fd, void *buf, size_t len){
+    char *p = (char*) buf;
+    while(len){
+        ssize_t n = recv(fd, p, len, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return 1;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief sock_gets - read line (messages are short, so read byte by byte to leave binary data after it)
+ * @param fd - socket
+ * @param buf (o) - line without trailing '\n' (too long line is truncated)
+ * @param len - length of buffer
+ * @return length of line or -1 if connection closed
+ */
+int sock_gets(int fd, char *buf, size_t len){
+    size_t l = 0;
+    char c;
+    while(1){
+        ssize_t n = recv(fd, &c, 1, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        if(c == '\n') break;
+        if(l < len - 1) buf[l++] = c;
+    }
+    buf[l] = 0;
+    return (int)l;
+}
+
+/**
+ * @brief sock_escape - make word of protocol line from string: spaces, control chars and '%' become %XX
+ * @param dst (o) - word
+ * @param len - length of `dst`
+ * @param src - string
+ * @return 0 if OK, 1 if `dst` is too short
+ */
+int sock_escape(char *dst, size_t len, const char *src){
+    for(; *src; ++src){
+        unsigned char c = (unsigned char) *src;
+        int n = (c <= ' ' || c == '%' || c == 0x7f) ? snprintf(dst, len, "%%%02X", c) : snprintf(dst, len, "%c", c);
+        if((size_t)n >= len) return 1;
+        dst += n;
+        len -= n;
+    }
+    if(!len) return 1;
+    *dst = 0;
+    return 0;
+}
+
+/**
+ * @brief sock_unescape - decode word made by sock_escape() in place
+ * @param str (io) - word
+ */
+void sock_unescape(char *str){
+    char *d = str;
+    unsigned int c;
+    for(; *str; ++d){
+        if(*str == '%' && isxdigit((unsigned char)str[1]) && isxdigit((unsigned char)str[2])
+           && sscanf(str + 1, "%2x", &c) == 1){
+            *d = (char) c;
+            str += 3;
+        }else *d = *str++;
+    }
+    *d = 0;
+}
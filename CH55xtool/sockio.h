@@ -0,0 +1,33 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef SOCKIO_H__
+#define SOCKIO_H__
+
+#include <stddef.h>
+
+int sock_unix(const char *path, int server);
+int sock_write(int fd, const void *buf, size_t len);
+int sock_printf(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int sock_read(int fd, void *buf, size_t len);
+int sock_gets(int fd, char *buf, size_t len);
+int sock_escape(char *dst, size_t len, const char *src);
+void sock_unescape(char *str);
+
+#endif // SOCKIO_H__
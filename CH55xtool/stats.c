@@ -0,0 +1,197 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <usefull_macros.h>
+#include "ch55isp.h"
+
+// transport wrapper collecting statistics of transactions
+
+typedef struct{
+    ch55transport *inner;       // real transport
+    ch55stats stats;
+    const ch55pipecb *cb;       // callbacks of current pipeline
+    double *tstart;             // FIFO of start times of packets in flight
+    size_t head, tail;          // FIFO pointers
+} statpriv;
+
+#define FIFOSZ  (2*CH55_MAXPIPELINE)
+
+/**
+ * @brief ch55_addsample - add latency sample
+ * @param l - samples
+ * @param t - latency, s
+ */
+void ch55_addsample(ch55latency *l, double t){
+    if(l->n == l->size){
+        l->size = l->size ? l->size * 2 : 256;
+        l->t = realloc(l->t, l->size * sizeof(double));
+        if(!l->t) ERR("realloc()");
+    }
+    l->t[l->n++] = t;
+}
+
+static int statxfer(ch55transport *t, const uint8_t *out, int olen, uint8_t *in, int ilen){
+    statpriv *p = (statpriv*) t->priv;
+    double t0 = dtime();
+    int r = p->inner->xfer(p->inner, out, olen, in, ilen);
+    if(olen > 0) ch55_addsample(&p->stats.cmd[out[0]], dtime() - t0);
+    ++p->stats.packets;
+    p->stats.bytesout += olen;
+    if(r < 0) ++p->stats.errors;
+    else p->stats.bytesin += r;
+    return r;
+}
+
+static int statsend(ch55transport *t, const uint8_t *out, int olen){
+    statpriv *p = (statpriv*) t->priv;
+    ++p->stats.packets;
+    p->stats.bytesout += olen;
+    int r = p->inner->send(p->inner, out, olen);
+    if(r) ++p->stats.errors;
+    return r;
+}
+
+static const uint8_t *statnext(void *arg, int *len){
+    statpriv *p = (statpriv*) arg;
+    const uint8_t *cmd = p->cb->next(p->cb->arg, len);
+    if(cmd){
+        p->tstart[p->head++ % FIFOSZ] = dtime();
+        ++p->stats.packets;
+        p->stats.bytesout += *len;
+    }
+    return cmd;
+}
+
+static int statcheck(void *arg, const uint8_t *cmd, const uint8_t *ans, int len){
+    statpriv *p = (statpriv*) arg;
+    if(p->tail < p->head) ch55_addsample(&p->stats.cmd[cmd[0]], dtime() - p->tstart[p->tail++ % FIFOSZ]);
+    p->stats.bytesin += len;
+    return p->cb->check(p->cb->arg, cmd, ans, len);
+}
+
+static int statpipeline(ch55transport *t, int depth, int ilen, const ch55pipecb *cb){
+    statpriv *p = (statpriv*) t->priv;
+    ch55pipecb mycb = {.next = statnext, .check = statcheck, .arg = p};
+    p->cb = cb;
+    p->head = p->tail = 0;
+    int r;
+    if(depth > FIFOSZ) depth = FIFOSZ;
+    if(p->inner->pipeline) r = p->inner->pipeline(p->inner, depth, ilen, &mycb);
+    else r = ch55_pipeline_seq(p->inner, ilen, &mycb);
+    if(r) ++p->stats.errors;
+    return r;
+}
+
+static int statreopen(ch55transport *t){
+    statpriv *p = (statpriv*) t->priv;
+    if(!p->inner->reopen) return 1;
+    return p->inner->reopen(p->inner);
+}
+
+static void statclose(ch55transport *t){
+    statpriv *p = (statpriv*) t->priv;
+    p->inner->close(p->inner);
+    for(int i = 0; i < 256; ++i) FREE(p->stats.cmd[i].t);
+    FREE(p->tstart);
+    FREE(p);
+    FREE(t);
+}
+
+/**
+ * @brief ch55_stattransport - wrap transport to collect statistics
+ * @param t - transport to wrap (will be closed with wrapper)
+ * @return wrapper or NULL if `t` is NULL
+ */
+ch55transport *ch55_stattransport(ch55transport *t){
+    if(!t) return NULL;
+    statpriv *p = MALLOC(statpriv, 1);
+    p->inner = t;
+    p->tstart = MALLOC(double, FIFOSZ);
+    ch55transport *w = MALLOC(ch55transport, 1);
+    w->name = t->name;
+    w->priv = p;
+    w->xfer = statxfer;
+    w->send = statsend;
+    w->pipeline = statpipeline;
+    w->reopen = statreopen;
+    w->close = statclose;
+    return w;
+}
+
+/**
+ * @brief ch55_getstats - get statistics of wrapper
+ * @param t - wrapper made by ch55_stattransport()
+ * @return statistics or NULL if `t` isn't wrapper
+ */
+ch55stats *ch55_getstats(ch55transport *t){
+    if(!t || t->close != statclose) return NULL;
+    return &((statpriv*)t->priv)->stats;
+}
+
+/**
+ * @brief ch55_resetstats - clear all statistics
+ */
+void ch55_resetstats(ch55stats *s){
+    if(!s) return;
+    for(int i = 0; i < 256; ++i) s->cmd[i].n = 0;
+    s->bytesout = s->bytesin = s->packets = s->errors = 0;
+}
+
+static int cmpdbl(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief ch55_percentile - get percentile of latency samples
+ * @param l - samples (will be sorted)
+ * @param p - percentile (0..100)
+ * @return value or 0 if no samples
+ */
+double ch55_percentile(ch55latency *l, double p){
+    if(!l || !l->n) return 0.;
+    qsort(l->t, l->n, sizeof(double), cmpdbl);
+    size_t idx = (size_t)(p / 100. * (l->n - 1) + 0.5);
+    if(idx >= l->n) idx = l->n - 1;
+    return l->t[idx];
+}
+
+/**
+ * @brief flashphase_str - name of flashing phase for reports
+ * @param p - phase
+ * @return name or NULL if `p` is wrong
+ */
+const char *flashphase_str(flashphase p){
+    static const char *names[PHASE_AMOUNT] = {
+        [PHASE_OPEN] = "open",
+        [PHASE_DETECT] = "detect_chip",
+        [PHASE_GETVER] = "getver",
+        [PHASE_COMPARE] = "compare",
+        [PHASE_ERASE] = "erase",
+        [PHASE_WRITE] = "write",
+        [PHASE_VERIFY] = "verify",
+        [PHASE_DATA] = "dataflash",
+        [PHASE_END] = "endflash",
+        [PHASE_RESTART] = "restart",
+        [PHASE_BOOT] = "boot",
+    };
+    if(p >= PHASE_AMOUNT) return NULL;
+    return names[p];
+}
@@ -0,0 +1,268 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <usefull_macros.h>
+#include "ch55isp.h"
+
+// transport wrapper recording transactions with timestamps into memory; full chunks of records
+// are written into file by separate thread, so tracing costs only copying of packet
+
+// amount of records in chunk
+#define CHUNKRECS       (4096)
+// interval of writing of incomplete chunk, ms
+#define FLUSHINTERVAL   (500)
+
+typedef struct chunk{
+    struct chunk *next;
+    size_t n;                   // amount of records
+    ch55tracerec rec[CHUNKRECS];
+} chunk;
+
+struct ch55trace{
+    FILE *f;                    // output file
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // new full chunk or stop
+    pthread_t thread;           // writing thread
+    chunk *cur;                 // chunk being filled
+    chunk *full, **tail;        // queue of chunks to write
+    chunk *free;                // written chunks for reuse
+    struct timespec t0;         // start of trace
+    uint16_t nchan;             // amount of transports traced
+    int stop;                   // ==1 to finish writing thread
+};
+
+typedef struct{
+    ch55transport *inner;       // real transport
+    ch55trace *tr;              // trace
+    uint16_t chan;              // number of transport in trace
+    const ch55pipecb *cb;       // callbacks of current pipeline
+    size_t inflight;            // commands of pipeline without answers
+} tracepriv;
+
+// put full chunk into queue; trace should be locked
+static void enqueue(ch55trace *tr){
+    tr->cur->next = NULL;
+    *tr->tail = tr->cur;
+    tr->tail = &tr->cur->next;
+    tr->cur = NULL;
+    pthread_cond_signal(&tr->cond);
+}
+
+// add record to trace
+static void record(tracepriv *p, ch55tracetype type, const uint8_t *data, int len){
+    ch55trace *tr = p->tr;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if(len < 0) len = 0;
+    else if(len > (int)sizeof(((ch55tracerec*)NULL)->data)) len = sizeof(((ch55tracerec*)NULL)->data);
+    pthread_mutex_lock(&tr->mutex);
+    if(!tr->cur){
+        if(tr->free){
+            tr->cur = tr->free;
+            tr->free = tr->free->next;
+        }else tr->cur = MALLOC(chunk, 1); // writing is behind: don't wait for it
+    }
+    ch55tracerec *r = &tr->cur->rec[tr->cur->n++];
+    r->t = (uint64_t)(ts.tv_sec - tr->t0.tv_sec) * 1000000000ULL + ts.tv_nsec - tr->t0.tv_nsec;
+    r->chan = p->chan;
+    r->type = type;
+    r->len = len;
+    if(len) memcpy(r->data, data, len);
+    if(tr->cur->n == CHUNKRECS) enqueue(tr);
+    pthread_mutex_unlock(&tr->mutex);
+}
+
+// writing thread
+static void *writer(void *arg){
+    ch55trace *tr = (ch55trace*) arg;
+    pthread_mutex_lock(&tr->mutex);
+    for(;;){
+        if(!tr->full){
+            if(tr->stop) break;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += FLUSHINTERVAL * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            if(ETIMEDOUT == pthread_cond_timedwait(&tr->cond, &tr->mutex, &ts) && !tr->full && tr->cur && tr->cur->n)
+                enqueue(tr); // write incomplete chunk to keep trace of crashed or hanged process
+            continue;
+        }
+        chunk *c = tr->full;
+        tr->full = c->next;
+        if(!tr->full) tr->tail = &tr->full;
+        pthread_mutex_unlock(&tr->mutex);
+        if(fwrite(c->rec, sizeof(ch55tracerec), c->n, tr->f) != c->n) WARN("fwrite()");
+        fflush(tr->f);
+        pthread_mutex_lock(&tr->mutex);
+        c->n = 0;
+        c->next = tr->free;
+        tr->free = c;
+    }
+    pthread_mutex_unlock(&tr->mutex);
+    return NULL;
+}
+
+/**
+ * @brief ch55_traceopen - create trace file and start its writing thread
+ * @param filename - name of file
+ * @return trace or NULL if failed
+ */
+ch55trace *ch55_traceopen(const char *filename){
+    FILE *f = fopen(filename, "w");
+    if(!f){
+        WARN(_("Can't create %s"), filename);
+        return NULL;
+    }
+    if(1 != fwrite(CH55_TRACE_MAGIC, sizeof(CH55_TRACE_MAGIC) - 1, 1, f)){
+        WARN("fwrite()");
+        fclose(f);
+        return NULL;
+    }
+    ch55trace *tr = MALLOC(ch55trace, 1);
+    tr->f = f;
+    tr->tail = &tr->full;
+    clock_gettime(CLOCK_MONOTONIC, &tr->t0);
+    pthread_mutex_init(&tr->mutex, NULL);
+    pthread_cond_init(&tr->cond, NULL);
+    if(pthread_create(&tr->thread, NULL, writer, tr)){
+        WARN("pthread_create()");
+        pthread_cond_destroy(&tr->cond);
+        pthread_mutex_destroy(&tr->mutex);
+        fclose(f);
+        FREE(tr);
+        return NULL;
+    }
+    return tr;
+}
+
+/**
+ * @brief ch55_traceclose - write the rest of records and close trace (after closing of all its transports)
+ * @param tr (io) - trace (set to NULL)
+ */
+void ch55_traceclose(ch55trace **tr){
+    if(!tr || !*tr) return;
+    ch55trace *T = *tr;
+    pthread_mutex_lock(&T->mutex);
+    if(T->cur && T->cur->n) enqueue(T);
+    T->stop = 1;
+    pthread_cond_signal(&T->cond);
+    pthread_mutex_unlock(&T->mutex);
+    pthread_join(T->thread, NULL);
+    fclose(T->f);
+    FREE(T->cur);
+    while(T->free){
+        chunk *c = T->free;
+        T->free = c->next;
+        FREE(c);
+    }
+    pthread_cond_destroy(&T->cond);
+    pthread_mutex_destroy(&T->mutex);
+    FREE(*tr);
+}
+
+static int tracexfer(ch55transport *t, const uint8_t *out, int olen, uint8_t *in, int ilen){
+    tracepriv *p = (tracepriv*) t->priv;
+    record(p, CH55_TRACE_CMD, out, olen);
+    int r = p->inner->xfer(p->inner, out, olen, in, ilen);
+    if(r < 0) record(p, CH55_TRACE_FAIL, NULL, 0);
+    else record(p, CH55_TRACE_ANS, in, r);
+    return r;
+}
+
+// command has no answer, so it is never in flight and its failure isn't recorded
+static int tracesend(ch55transport *t, const uint8_t *out, int olen){
+    tracepriv *p = (tracepriv*) t->priv;
+    record(p, CH55_TRACE_SEND, out, olen);
+    return p->inner->send(p->inner, out, olen);
+}
+
+static const uint8_t *tracenext(void *arg, int *len){
+    tracepriv *p = (tracepriv*) arg;
+    const uint8_t *cmd = p->cb->next(p->cb->arg, len);
+    if(cmd){
+        record(p, CH55_TRACE_CMD, cmd, *len);
+        ++p->inflight;
+    }
+    return cmd;
+}
+
+static int tracecheck(void *arg, const uint8_t *cmd, const uint8_t *ans, int len){
+    tracepriv *p = (tracepriv*) arg;
+    record(p, CH55_TRACE_ANS, ans, len);
+    if(p->inflight) --p->inflight;
+    return p->cb->check(p->cb->arg, cmd, ans, len);
+}
+
+static int tracepipeline(ch55transport *t, int depth, int ilen, const ch55pipecb *cb){
+    tracepriv *p = (tracepriv*) t->priv;
+    ch55pipecb mycb = {.next = tracenext, .check = tracecheck, .arg = p};
+    p->cb = cb;
+    p->inflight = 0;
+    int r;
+    if(p->inner->pipeline) r = p->inner->pipeline(p->inner, depth, ilen, &mycb);
+    else r = ch55_pipeline_seq(p->inner, ilen, &mycb);
+    // commands cancelled after failure or stop have no answers
+    for(; p->inflight; --p->inflight) record(p, CH55_TRACE_FAIL, NULL, 0);
+    return r;
+}
+
+static int tracereopen(ch55transport *t){
+    tracepriv *p = (tracepriv*) t->priv;
+    record(p, CH55_TRACE_REOPEN, NULL, 0);
+    if(!p->inner->reopen) return 1;
+    return p->inner->reopen(p->inner);
+}
+
+static void traceclose(ch55transport *t){
+    tracepriv *p = (tracepriv*) t->priv;
+    p->inner->close(p->inner);
+    FREE(p);
+    FREE(t);
+}
+
+/**
+ * @brief ch55_tracetransport - wrap transport to record its transactions
+ * @param t - transport to wrap (will be closed with wrapper)
+ * @param tr - trace (could be shared by several transports, each gets its own channel number)
+ * @return wrapper, `t` itself if `tr` is NULL or NULL if `t` is NULL
+ */
+ch55transport *ch55_tracetransport(ch55transport *t, ch55trace *tr){
+    if(!t || !tr) return t;
+    tracepriv *p = MALLOC(tracepriv, 1);
+    p->inner = t;
+    p->tr = tr;
+    pthread_mutex_lock(&tr->mutex);
+    p->chan = tr->nchan++;
+    pthread_mutex_unlock(&tr->mutex);
+    ch55transport *w = MALLOC(ch55transport, 1);
+    w->name = t->name;
+    w->priv = p;
+    w->xfer = tracexfer;
+    w->send = tracesend;
+    w->pipeline = tracepipeline;
+    w->reopen = tracereopen;
+    w->close = traceclose;
+    return w;
+}
@@ -0,0 +1,157 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef TRANSPORT_H__
+#define TRANSPORT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// callbacks for pipelined transfers of write/verify packets
+typedef struct{
+    // get next command (should be valid until pipeline ends) and its length `len`;
+    // @return NULL if no more packets
+    const uint8_t *(*next)(void *arg, int *len);
+    // check answer `ans` of `len` bytes to command `cmd`; @return 0 to continue or 1 to stop
+    int (*check)(void *arg, const uint8_t *cmd, const uint8_t *ans, int len);
+    void *arg;
+} ch55pipecb;
+
+typedef struct ch55transport ch55transport;
+// transport layer of ISP protocol: bulk transfers to bootloader or its emulation
+struct ch55transport{
+    const char *name;           // transport name
+    void *priv;                 // backend private data
+    // send command and receive answer; @return amount of bytes received or -1 if failed
+    int (*xfer)(ch55transport *t, const uint8_t *out, int olen, uint8_t *in, int ilen);
+    // send command without answer; @return 0 if OK
+    int (*send)(ch55transport *t, const uint8_t *out, int olen);
+    // (optional) pipelined transfers with up to `depth` commands in flight, answers are `ilen` bytes;
+    // @return 0 if OK (or stopped by `check`), -1 if transfer failed
+    int (*pipeline)(ch55transport *t, int depth, int ilen, const ch55pipecb *cb);
+    // (optional) reopen device after it dropped off (e.g. re-enumerated); @return 0 if OK
+    int (*reopen)(ch55transport *t);
+    // close transport and free its data (including structure itself)
+    void (*close)(ch55transport *t);
+};
+
+int ch55_pipeline_seq(ch55transport *t, int ilen, const ch55pipecb *cb);
+
+// USB position of bootloader device (to select one of several)
+typedef struct{
+    uint8_t bus;            // bus number
+    uint8_t addr;           // device address on bus
+    uint8_t nports;         // amount of port numbers (0 if unknown)
+    uint8_t ports[7];       // port numbers from root hub to device
+} ch55devaddr;
+
+struct libusb_context;
+struct libusb_device;
+ch55transport *ch55_usbtransport(const ch55devaddr *a);
+ch55transport *ch55_usbtransport_id(uint16_t vid, uint16_t pid, const ch55devaddr *a);
+ch55transport *ch55_usbtransport_dev(struct libusb_context *ctx, struct libusb_device *dev);
+ch55transport *ch55_usbtransport_fd(int fd);
+ch55transport *ch55_usbtransport_node(const char *node);
+ch55transport *ch55_uarttransport(const char *dev, int maxbaud);
+int ch55_uartbaud(ch55transport *t);
+int ch55_posdev(ch55devaddr *a, uint16_t vid, uint16_t pid, char *node, size_t len);
+int ch55_posnode(ch55devaddr *a, char *node, size_t len);
+int ch55_nodepos(const char *node, ch55devaddr *a);
+int ch55_fdpos(int fd, ch55devaddr *a);
+
+// emulator of WCH ISP bootloader or custom one (src/fastboot)
+typedef struct{
+    uint8_t chipid;         // chip ID (0x51..0x59)
+    uint8_t version[3];     // bootloader version digits, e.g. {2, 4, 0}
+    uint8_t id[4];          // chip unique ID bytes (their sum is the key)
+    int latency;            // latency of each transaction, us
+    int erasetime;          // time of chip erasing, us
+    int bytetime;           // transfer time of each byte (both directions), ns
+    int errrate;            // probability of lost answer, 1/1000
+} ch55emulconf;
+
+ch55transport *ch55_emulator(const ch55emulconf *conf);
+ch55transport *ch55_fbemulator(const ch55emulconf *conf);
+const uint8_t *ch55_emulflash(ch55transport *t, size_t *size);
+
+// latency samples of one command type
+typedef struct{
+    size_t n;               // amount of samples
+    size_t size;            // size of allocated array
+    double *t;              // latencies, s
+} ch55latency;
+
+// statistics of transport
+typedef struct{
+    ch55latency cmd[256];   // latencies by command code
+    size_t packets;         // amount of commands sent
+    size_t bytesout;        // bytes sent
+    size_t bytesin;         // bytes received
+    size_t errors;          // failed transfers
+} ch55stats;
+
+ch55transport *ch55_stattransport(ch55transport *t);
+ch55stats *ch55_getstats(ch55transport *t);
+void ch55_resetstats(ch55stats *s);
+void ch55_addsample(ch55latency *l, double t);
+double ch55_percentile(ch55latency *l, double p);
+
+// phases of flashing sequence (names are the same in reports of tool and benchmark)
+typedef enum{
+    PHASE_OPEN,
+    PHASE_DETECT,
+    PHASE_GETVER,
+    PHASE_COMPARE,
+    PHASE_ERASE,
+    PHASE_WRITE,
+    PHASE_VERIFY,
+    PHASE_DATA,
+    PHASE_END,
+    PHASE_RESTART,
+    PHASE_BOOT,
+    PHASE_AMOUNT
+} flashphase;
+
+const char *flashphase_str(flashphase p);
+
+// binary trace of transactions: file is CH55_TRACE_MAGIC followed by records
+#define CH55_TRACE_MAGIC    "CH55TRC1"
+typedef enum{
+    CH55_TRACE_CMD = 1,     // command sent
+    CH55_TRACE_ANS,         // answer got
+    CH55_TRACE_FAIL,        // no answer for oldest command in flight (transfer failed)
+    CH55_TRACE_REOPEN,      // device reopened
+    CH55_TRACE_SEND,        // command sent without waiting for answer (e.g. reset)
+} ch55tracetype;
+
+typedef struct{
+    uint64_t t;             // time since start of trace, ns
+    uint16_t chan;          // number of traced transport (session)
+    uint8_t type;           // ch55tracetype
+    uint8_t len;            // length of data
+    uint8_t reserved[4];
+    uint8_t data[64];       // command or answer
+} ch55tracerec;
+
+typedef struct ch55trace ch55trace;
+ch55trace *ch55_traceopen(const char *filename);
+void ch55_traceclose(ch55trace **tr);
+ch55transport *ch55_tracetransport(ch55transport *t, ch55trace *tr);
+
+#endif // TRANSPORT_H__
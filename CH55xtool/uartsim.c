@@ -0,0 +1,237 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // posix_openpt, cfmakeraw
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+#include "ch55isp.h"
+
+// simulator of UART ISP bootloader on pseudo-terminal: `ch55tool --uart=<printed name>` or ch55bench
+// talk to it as to chip on serial port. Frames are served by bootloader emulator; time of transfer at
+// current baud rate is slept, bytes sent by port at baud rate other than simulator's one (or higher than
+// --linkbaud) are lost, like on real line.
+
+static int help, latency = 100, bootver = 240, errrate = 0, maxbaud = CH55_UARTMAXBAUD, linkbaud = 0, depth = 1;
+static char *emulate = "CH552", *linkname = NULL;
+
+static myoption cmdlnopts[] = {
+    {"help",    NO_ARGS,    NULL,   'h',    arg_int,    APTR(&help),        _("show this help")},
+    {"emulate", NEED_ARG,   NULL,   'E',    arg_string, APTR(&emulate),     _("chip to emulate (default: CH552)")},
+    {"link",    NEED_ARG,   NULL,   'l',    arg_string, APTR(&linkname),    _("make symbolic link with given name to pseudo-terminal")},
+    {"maxbaud", NEED_ARG,   NULL,   0,      arg_int,    APTR(&maxbaud),     _("max baud rate of bootloader, 0 - it can't change rate (default: 1000000)")},
+    {"linkbaud",NEED_ARG,   NULL,   0,      arg_int,    APTR(&linkbaud),    _("max baud rate the line carries, 0 - any (default: 0)")},
+    {"latency", NEED_ARG,   NULL,   0,      arg_int,    APTR(&latency),     _("processing time of each command, us (default: 100)")},
+    {"bootver", NEED_ARG,   NULL,   0,      arg_int,    APTR(&bootver),     _("bootloader version (default: 240)")},
+    {"depth",   NEED_ARG,   NULL,   0,      arg_int,    APTR(&depth),       _("max frames in flight bootloader accepts, others are lost (default: 1)")},
+    {"errrate", NEED_ARG,   NULL,   0,      arg_int,    APTR(&errrate),     _("probability of lost answer, 1/1000 (default: 0)")},
+    end_option
+};
+
+// bootloader returns to previous baud rate if there's no frame at new one during this time, s
+#define CONFIRM_TIME    (0.5)
+// and to initial rate after this idle time
+#define IDLE_TIME       (3.)
+// max length of frame
+#define FRAMELEN        (128)
+
+static const struct{
+    int baud;
+    speed_t speed;
+} speeds[] = {
+#ifdef B3000000
+    {3000000, B3000000},
+    {2000000, B2000000},
+    {1500000, B1500000},
+    {1000000, B1000000},
+    {921600, B921600},
+    {500000, B500000},
+    {460800, B460800},
+#endif
+    {230400, B230400},
+    {115200, B115200},
+    {57600, B57600},
+    {38400, B38400},
+    {19200, B19200},
+    {9600, B9600},
+    {0, 0}
+};
+
+static int master = -1, slave = -1;
+static ch55transport *emul = NULL;
+static int rate = CH55_UARTBAUD, oldrate = CH55_UARTBAUD;
+static double confirm = 0., lastframe = 0.;
+
+void signals(int sig){
+    if(emul) emul->close(emul);
+    if(linkname) unlink(linkname);
+    exit(sig);
+}
+
+static ch55transport *mkemul(){
+    const ch55descr *d = ch55_getdescrbyname(emulate);
+    if(!d) ERRX(_("Unknown chip %s"), emulate);
+    ch55emulconf conf = {.chipid = d->chipid, .id = {0x12, 0x34, 0x56, 0x78},
+                         .latency = latency, .erasetime = 100000, .errrate = errrate,
+                         .version = {(bootver / 100) % 10, (bootver / 10) % 10, bootver % 10}};
+    return ch55_emulator(&conf);
+}
+
+// baud rate set by other side of pseudo-terminal
+static int portbaud(){
+    struct termios tio;
+    if(tcgetattr(slave, &tio)) return 0;
+    speed_t s = cfgetospeed(&tio);
+    for(int i = 0; speeds[i].baud; ++i) if(speeds[i].speed == s) return speeds[i].baud;
+    return 0;
+}
+
+static int knownbaud(int baud){
+    for(int i = 0; speeds[i].baud; ++i) if(speeds[i].baud == baud) return 1;
+    return 0;
+}
+
+// sleep transfer time of `n` bytes (8N1)
+static void linetime(int n){
+    usleep((useconds_t)(n * 10. * 1e6 / rate));
+}
+
+static void answer(const uint8_t *ans, int len){
+    uint8_t buf[FRAMELEN + 3], s = 0;
+    buf[0] = 0x55;
+    buf[1] = 0xAA;
+    for(int i = 0; i < len; ++i) s += (buf[i + 2] = ans[i]);
+    buf[len + 2] = s;
+    linetime(len + 3);
+    if(len + 3 != write(master, buf, len + 3)) WARN("write()");
+}
+
+static void process(const uint8_t *cmd, int len){
+    uint8_t ans[64];
+    lastframe = dtime();
+    confirm = 0.;
+    if(cmd[0] == CH55_SETBAUD && len == 7){
+        if(!maxbaud) return; // unknown command for old bootloader
+        int b = cmd[3] | (cmd[4] << 8) | (cmd[5] << 16) | (cmd[6] << 24);
+        uint8_t a[6] = {CH55_SETBAUD, 0, 2, 0, (b <= maxbaud && knownbaud(b)) ? 0 : 1, depth};
+        answer(a, sizeof(a));
+        if(!a[4] && b != rate){
+            DBG("Baud rate %d -> %d", rate, b);
+            oldrate = rate;
+            rate = b;
+            confirm = dtime() + CONFIRM_TIME;
+        }
+        return;
+    }
+    int n = emul->xfer(emul, cmd, len, ans, sizeof(ans));
+    if(n > 0) answer(ans, n);
+    if(cmd[0] == 0xa2 && len > 3 && cmd[3] == 1){ // reset: next session finds bootloader again
+        DBG("Reset");
+        emul->close(emul);
+        emul = mkemul();
+        rate = CH55_UARTBAUD;
+    }
+}
+
+int main(int argc, char **argv){
+    initial_setup();
+    parseargs(&argc, &argv, cmdlnopts);
+    if(help) showhelp(-1, cmdlnopts);
+    if(maxbaud && !knownbaud(maxbaud)) ERRX(_("Wrong baud rate %d"), maxbaud);
+    if(depth < 1 || depth > 255) ERRX(_("Wrong depth %d"), depth);
+    emul = mkemul();
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) || unlockpt(master)) ERR("posix_openpt()");
+    const char *name = ptsname(master);
+    // keep slave opened: pseudo-terminal lives between sessions of clients
+    if(!name || (slave = open(name, O_RDWR | O_NOCTTY)) < 0) ERR(_("Can't open %s"), name);
+    struct termios tio;
+    if(tcgetattr(slave, &tio)) ERR("tcgetattr()");
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B57600);
+    cfsetospeed(&tio, B57600);
+    if(tcsetattr(slave, TCSANOW, &tio)) ERR("tcsetattr()");
+    if(linkname){
+        unlink(linkname);
+        if(symlink(name, linkname)) ERR(_("Can't make link %s"), linkname);
+    }
+    signal(SIGINT, signals);
+    signal(SIGTERM, signals);
+    printf("%s\n", name);
+    fflush(stdout);
+    uint8_t buf[4 * FRAMELEN];
+    int have = 0;
+    for(;;){
+        struct pollfd pfd = {.fd = master, .events = POLLIN};
+        int r = poll(&pfd, 1, 50);
+        double now = dtime();
+        if(confirm > 0. && now > confirm){
+            DBG("No frames at %d baud, return to %d", rate, oldrate);
+            rate = oldrate;
+            confirm = 0.;
+        }
+        if(rate != CH55_UARTBAUD && now - lastframe > IDLE_TIME) rate = CH55_UARTBAUD;
+        if(r < 0 && errno == EINTR) continue;
+        if(r < 1) continue;
+        ssize_t n = read(master, buf + have, sizeof(buf) - have);
+        if(n < 1) continue;
+        int b = portbaud();
+        if(b != rate || (linkbaud && rate > linkbaud)){ // framing errors
+            DBG("Lost %zd bytes sent at %d baud (line at %d)", n, b, rate);
+            have = 0;
+            continue;
+        }
+        have += n;
+        // frames got in one read came while previous ones were processed: all above `depth` are lost
+        int nframes = 0;
+        for(;;){ // frames: 57 AB cmd lenL lenH data... sum
+            int s = 0;
+            while(s + 1 < have && !(buf[s] == 0x57 && buf[s + 1] == 0xAB)) ++s;
+            if(s){
+                memmove(buf, buf + s, have - s);
+                have -= s;
+            }
+            if(have < 5) break;
+            int len = 3 + (buf[3] | (buf[4] << 8));
+            if(len > FRAMELEN){ // not a frame
+                memmove(buf, buf + 1, --have);
+                continue;
+            }
+            if(have < len + 3) break;
+            uint8_t sum = 0;
+            for(int i = 0; i < len; ++i) sum += buf[2 + i];
+            linetime(len + 3);
+            if(++nframes > depth){
+                DBG("Overrun: frame lost");
+            }else if(sum == buf[len + 2]) process(buf + 2, len);
+            else{
+                DBG("Bad checksum");
+            }
+            have -= len + 3;
+            memmove(buf, buf + len + 3, have);
+        }
+    }
+    return 0;
+}
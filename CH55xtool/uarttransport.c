@@ -0,0 +1,356 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+#include "ch55isp.h"
+
+// ISP over UART0 of chip: the same commands and answers as over USB in frames with checksum;
+// baud rate is raised by CH55_SETBAUD as high as bootloader and line allow
+
+typedef struct{
+    int fd;                 // serial port
+    int baud;               // current baud rate
+    int depth;              // max frames in flight bootloader accepts
+    struct termios old;     // its settings before opening
+} uartpriv;
+
+// max time of answer waiting while negotiating baud rate, ms
+#define PROBE_TIMEOUT   (100)
+// bootloader returns to previous baud rate if it gets nothing at new one during this time, ms
+#define CONFIRM_TIMEOUT (500)
+// max length of command or answer
+#define FRAMELEN        (128)
+
+static const struct{
+    int baud;
+    speed_t speed;
+} speeds[] = { // in descending order
+#ifdef B3000000
+    {3000000, B3000000},
+    {2000000, B2000000},
+    {1500000, B1500000},
+    {1000000, B1000000},
+    {921600, B921600},
+    {500000, B500000},
+    {460800, B460800},
+#endif
+    {230400, B230400},
+    {115200, B115200},
+    {57600, B57600},
+    {0, 0}
+};
+
+static speed_t getspeed(int baud){
+    for(int i = 0; speeds[i].baud; ++i) if(speeds[i].baud == baud) return speeds[i].speed;
+    return 0;
+}
+
+static int setbaud(uartpriv *p, int baud){
+    struct termios tio;
+    speed_t s = getspeed(baud);
+    if(!s || tcgetattr(p->fd, &tio)) return 1;
+    cfsetispeed(&tio, s);
+    cfsetospeed(&tio, s);
+    if(tcsetattr(p->fd, TCSADRAIN, &tio)) return 1;
+    p->baud = baud;
+    return 0;
+}
+
+static uint8_t checksum(const uint8_t *data, int len){
+    uint8_t s = 0;
+    for(int i = 0; i < len; ++i) s += data[i];
+    return s;
+}
+
+// send command in frame; @return 0 if OK
+static int sendframe(uartpriv *p, const uint8_t *out, int olen){
+    uint8_t buf[FRAMELEN + 3];
+    if(olen < 3 || olen > FRAMELEN) return 1;
+    buf[0] = 0x57;
+    buf[1] = 0xAB;
+    memcpy(buf + 2, out, olen);
+    // frame is found in stream by length field, but USB commands don't need it to be right (e.g. key)
+    buf[3] = (olen - 3) & 0xff;
+    buf[4] = (olen - 3) >> 8;
+    buf[olen + 2] = checksum(buf + 2, olen);
+    for(int n = 0, l = olen + 3; n < l;){
+        ssize_t w = write(p->fd, buf + n, l - n);
+        if(w < 0){
+            if(errno == EINTR) continue;
+            return 1;
+        }
+        n += w;
+    }
+    return 0;
+}
+
+// read exactly `len` bytes till `tend`; @return 0 if OK
+static int readall(uartpriv *p, uint8_t *buf, int len, double tend){
+    while(len > 0){
+        int ms = (int)((tend - dtime()) * 1e3);
+        if(ms < 0) return 1;
+        struct pollfd pfd = {.fd = p->fd, .events = POLLIN};
+        int r = poll(&pfd, 1, ms);
+        if(r < 0 && errno == EINTR) continue;
+        if(r < 1) return 1;
+        ssize_t n = read(p->fd, buf, len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 1) return 1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief readframe - get answer: skip garbage till header, check length and checksum
+ * @param p - transport data
+ * @param in (o) - answer without frame
+ * @param ilen - max length of answer
+ * @param timeout - max waiting time, ms
+ * @return length of answer or -1 if failed
+ */
+static int readframe(uartpriv *p, uint8_t *in, int ilen, int timeout){
+    uint8_t buf[FRAMELEN + 1], prev = 0;
+    double tend = dtime() + timeout / 1e3;
+    for(;;){ // header
+        if(readall(p, buf, 1, tend)) return -1;
+        if(prev == 0x55 && buf[0] == 0xAA) break;
+        prev = buf[0];
+    }
+    if(readall(p, buf, 4, tend)) return -1;
+    int len = 4 + (buf[2] | (buf[3] << 8));
+    if(len > FRAMELEN){
+        DBG("Too long answer: %d", len);
+        return -1;
+    }
+    if(readall(p, buf + 4, len - 4 + 1, tend)) return -1;
+    if(checksum(buf, len) != buf[len]){
+        DBG("Bad checksum of answer");
+        return -1;
+    }
+    if(len > ilen) len = ilen;
+    memcpy(in, buf, len);
+    return len;
+}
+
+static int uartxfer(ch55transport *t, const uint8_t *out, int olen, uint8_t *in, int ilen){
+    uartpriv *p = (uartpriv*) t->priv;
+    tcflush(p->fd, TCIFLUSH); // late answers of failed transfers
+    if(sendframe(p, out, olen)) return -1;
+    return readframe(p, in, ilen, USB_TIMEOUT);
+}
+
+static int uartsend(ch55transport *t, const uint8_t *out, int olen){
+    uartpriv *p = (uartpriv*) t->priv;
+    tcflush(p->fd, TCIFLUSH);
+    if(sendframe(p, out, olen)) return 1;
+    return tcdrain(p->fd) ? 1 : 0;
+}
+
+// commands are sent while less than `depth` answers are waited, answers come in the same order;
+// bootloader without receive queue loses frames sent before answer, so depth is limited by its one
+static int uartpipeline(ch55transport *t, int depth, int ilen, const ch55pipecb *cb){
+    uartpriv *p = (uartpriv*) t->priv;
+    uint8_t ans[FRAMELEN];
+    if(depth > p->depth) depth = p->depth;
+    if(depth < 1) depth = 1;
+    if(ilen > FRAMELEN) ilen = FRAMELEN;
+    const uint8_t **cmds = MALLOC(const uint8_t*, depth);
+    size_t head = 0, tail = 0;
+    int stop = 0, ret = 0, len;
+    tcflush(p->fd, TCIFLUSH);
+    for(;;){
+        while(!stop && head - tail < (size_t)depth){
+            const uint8_t *cmd = cb->next(cb->arg, &len);
+            if(!cmd){
+                stop = 1;
+                break;
+            }
+            if(sendframe(p, cmd, len)){
+                ret = -1;
+                break;
+            }
+            cmds[head++ % depth] = cmd;
+        }
+        if(ret || head == tail) break;
+        int n = readframe(p, ans, ilen, USB_TIMEOUT);
+        if(n < 0){
+            ret = -1;
+            break;
+        }
+        if(cb->check(cb->arg, cmds[tail++ % depth], ans, n)) stop = 1;
+    }
+    // answers of commands in flight
+    while(tail < head && readframe(p, ans, ilen, PROBE_TIMEOUT) >= 0) ++tail;
+    FREE(cmds);
+    return ret;
+}
+
+static void uartclose(ch55transport *t){
+    uartpriv *p = (uartpriv*) t->priv;
+    tcsetattr(p->fd, TCSANOW, &p->old);
+    close(p->fd);
+    FREE(p);
+    FREE(t);
+}
+
+/**
+ * @brief probe - send rate change request to current rate of port
+ * @param p - port
+ * @param baud - requested rate
+ * @return 0 if bootloader accepted it, 1 if refused, 2 if it doesn't know such command, -1 if no valid answer
+ */
+static int probe(uartpriv *p, int baud){
+    uint8_t cmd[7] = {CH55_SETBAUD, 4, 0, baud & 0xff, (baud >> 8) & 0xff, (baud >> 16) & 0xff, (baud >> 24) & 0xff};
+    uint8_t ans[FRAMELEN];
+    tcflush(p->fd, TCIFLUSH);
+    if(sendframe(p, cmd, sizeof(cmd))) return -1;
+    int n = readframe(p, ans, sizeof(ans), PROBE_TIMEOUT);
+    if(n < 0) return -1;
+    if(n < 5 || ans[0] != CH55_SETBAUD) return 2;
+    if(ans[4]) return 1;
+    p->depth = (n > 5 && ans[5]) ? ans[5] : 1;
+    return 0;
+}
+
+/**
+ * @brief detect - check if bootloader answers to detect command at current rate of port
+ * @return 1 if answered
+ */
+static int detect(uartpriv *p){
+    const uint8_t cmd[] = "\xA1\x12\x00\x52\x11MCU ISP & WCH.CN";
+    uint8_t ans[FRAMELEN];
+    tcflush(p->fd, TCIFLUSH);
+    if(sendframe(p, cmd, sizeof(cmd) - 1)) return 0;
+    int n = readframe(p, ans, sizeof(ans), PROBE_TIMEOUT);
+    return (n > 0 && ans[0] == 0xA1);
+}
+
+/**
+ * @brief negotiate - try to switch bootloader and port to given baud rate
+ * Bootloader answers at old rate and switches; if it doesn't get right frame at new rate,
+ * it returns to old one after CONFIRM_TIMEOUT, so does the port.
+ * @param t - transport
+ * @param baud - new baud rate
+ * @return 0 if switched, 1 if rate isn't supported, -1 if bootloader can't change rate
+ */
+static int negotiate(ch55transport *t, int baud){
+    uartpriv *p = (uartpriv*) t->priv;
+    int old = p->baud;
+    int r = probe(p, baud);
+    if(r) return r == 1 ? 1 : -1; // no answer or unknown command: old bootloader
+    if(setbaud(p, baud)) return 1;
+    if(!probe(p, baud)) return 0;
+    DBG("Line doesn't carry %d baud", baud);
+    setbaud(p, old);
+    usleep(CONFIRM_TIMEOUT * 1000 + 100000);
+    return 1;
+}
+
+/**
+ * @brief findrate - find rate of bootloader left at non-default one by previous session
+ * @return 0 if found
+ */
+static int findrate(uartpriv *p, int maxbaud){
+    for(int i = 0; speeds[i].baud > CH55_UARTBAUD; ++i){
+        if(speeds[i].baud > maxbaud || setbaud(p, speeds[i].baud)) continue;
+        if(!probe(p, speeds[i].baud)) return 0;
+    }
+    setbaud(p, CH55_UARTBAUD);
+    return 1;
+}
+
+/**
+ * @brief ch55_uarttransport - open serial port connected to UART0 of chip in ISP mode
+ * @param dev - serial device
+ * @param maxbaud - max baud rate to negotiate (CH55_UARTBAUD or less to keep it)
+ * @return transport or NULL if failed
+ */
+ch55transport *ch55_uarttransport(const char *dev, int maxbaud){
+    FNAME();
+    if(!dev) return NULL;
+    int fd = open(dev, O_RDWR | O_NOCTTY);
+    if(fd < 0){
+        WARN(_("Can't open %s"), dev);
+        return NULL;
+    }
+    if(ioctl(fd, TIOCEXCL)){
+        DBG("Can't get exclusive access to %s", dev);
+    }
+    uartpriv *p = MALLOC(uartpriv, 1);
+    p->fd = fd;
+    p->depth = 1;
+    struct termios tio;
+    if(tcgetattr(fd, &p->old)){
+        WARN("tcgetattr()");
+        close(fd);
+        FREE(p);
+        return NULL;
+    }
+    tio = p->old;
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if(tcsetattr(fd, TCSANOW, &tio) || setbaud(p, CH55_UARTBAUD)){
+        WARN("tcsetattr()");
+        close(fd);
+        FREE(p);
+        return NULL;
+    }
+    tcflush(fd, TCIOFLUSH);
+    ch55transport *t = MALLOC(ch55transport, 1);
+    t->name = "uart";
+    t->priv = p;
+    t->xfer = uartxfer;
+    t->send = uartsend;
+    t->pipeline = uartpipeline;
+    t->close = uartclose;
+    if(maxbaud > CH55_UARTBAUD){
+        int r = probe(p, CH55_UARTBAUD);
+        // stock bootloader: answers to other commands only, keep start rate
+        if(r == 2 || (r < 0 && detect(p))) maxbaud = CH55_UARTBAUD;
+        // no answer at start rate: bootloader may be left at higher one by previous session
+        else if(r < 0) findrate(p, maxbaud);
+    }
+    for(int i = 0; speeds[i].baud > p->baud; ++i){
+        if(speeds[i].baud > maxbaud) continue;
+        if(negotiate(t, speeds[i].baud) < 1) break;
+    }
+    DBG("Baud rate %d", p->baud);
+    return t;
+}
+
+/**
+ * @brief ch55_uartbaud - baud rate of UART transport
+ * @param t - transport
+ * @return baud rate or 0 if `t` isn't UART transport
+ */
+int ch55_uartbaud(ch55transport *t){
+    if(!t || t->close != uartclose) return 0;
+    return ((uartpriv*) t->priv)->baud;
+}
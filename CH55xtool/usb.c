@@ -16,180 +16,812 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <libusb.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 #include <usefull_macros.h>
-#include "usb.h"
+#include "ch55isp.h"
 
 #define DETECT_CHIP_LEN         (6)
 #define GETVER_LEN              (30)
 #define SENDKEYLEN              (6)
 #define ERASELEN                (6)
 #define WRITELEN                (6)
-#define WRITEPACKETLEN          (56)
+#define WRITEPACKETLEN          (CH55_PACKETLEN)
 #define WRITEVERIFYSZ           (64)
 #define FIXLEN                  (6)
-static uint8_t DETECT_CHIP_CMD_V2[] = "\xA1\x12\x00\x52\x11MCU ISP & WCH.CN";
-static uint8_t READ_CFG_CMD_V2[] = {0xa7, 0x02, 0x00, 0x1f, 0x00};
-static uint8_t SEND_KEY_CMD_V230[48] = {0xa3, 0x30, 0x00};
-static uint8_t SEND_KEY_CMD_V240[56] = {0xa3, 0x38, 0x00};
-static uint8_t ERASE_CHIP_CMD_V2[] = {0xa4, 0x01, 0x00, 0x08};
-static uint8_t WRITE_CMD_V2[64] = {0xa5, 0x00};
-static uint8_t VERIFY_CMD_V2[64] = {0xa6, 0x00};
-static uint8_t END_FLASH_CMD_V2[] = {0xa2, 0x01, 0x00, 0x00};
-static uint8_t RESET_RUN_CMD_V2[] = {0xa2, 0x01, 0x00, 0x01};
+static const uint8_t DETECT_CHIP_CMD_V2[] = "\xA1\x12\x00\x52\x11MCU ISP & WCH.CN";
+static const uint8_t READ_CFG_CMD_V2[] = {0xa7, 0x02, 0x00, 0x1f, 0x00};
+static const uint8_t SEND_KEY_CMD_V230[3] = {0xa3, 0x30, 0x00}; // + 45 bytes of key
+#define SEND_KEY_V230_LEN       (48)
+static const uint8_t SEND_KEY_CMD_V240[56] = {0xa3, 0x38, 0x00};
+static const uint8_t ERASE_CHIP_CMD_V2[] = {0xa4, 0x01, 0x00, 0x08};
+#define WRITE_CMD_V2            (0xa5)
+#define VERIFY_CMD_V2           (0xa6)
+#define DATA_ERASE_CMD_V2       (0xa9)
+#define DATA_WRITE_CMD_V2       (0xaa)
+#define DATA_READ_CMD_V2        (0xab)
+// header of answer to data read command
+#define DATAREADHDR             (6)
+// pause before first retry, us (doubled on each next)
+#define RETRY_BACKOFF           (10000)
+static const uint8_t END_FLASH_CMD_V2[] = {0xa2, 0x01, 0x00, 0x00};
+static const uint8_t RESET_RUN_CMD_V2[] = {0xa2, 0x01, 0x00, 0x01};
 
 static const ch55descr devlist[] = {
-    {"CH551", 10240, 0x51},
-    {"CH552", 16384, 0x52},
-    {"CH553", 10240, 0x53},
-    {"CH554", 14336, 0x54},
-    {"CH559", 61440, 0x59},
-    {NULL, 0, 0}
+    {"CH551", 10240, 0x51, 128},
+    {"CH552", 16384, 0x52, 128},
+    {"CH553", 10240, 0x53, 128},
+    {"CH554", 14336, 0x54, 128},
+    {"CH559", 61440, 0x59, 1024},
+    {NULL, 0, 0, 0}
 };
 
-static uint8_t buf[64];
-uint8_t *getusbbuf(){
-    return buf;
+struct ch55session{
+    ch55transport *tr;                  // transport
+    pthread_mutex_t mutex;              // session lock
+    uint8_t buf[64];                    // last answer
+    const ch55image *img;               // image bound by ch55_setimage()
+    uint8_t *stream;                    // scrambled write frames, then verify frames
+    size_t nframes;                     // amount of frames of each type
+    size_t ready;                       // amount of frames of each type prepared (atomic)
+    pthread_t prep;                     // thread preparing `stream`
+    int prepon;                         // ==1 if `prep` should be joined
+    size_t *used;                       // indexes of frames with non-empty data
+    size_t nused;                       // and their amount
+    const ch55image *simg;              // image of `stream`
+    const uint8_t *sdata;               // its data pointer
+    size_t slen;                        // and length (to check if image changed)
+    char version[32];                   // bootloader version
+    uint8_t chipid;                     // chip ID from detect_chip
+    int old;                            // ==1 for V2.30, ==0 for V2.31 or V2.40
+    uint8_t chk_sum;                    // key from getver
+    uint8_t uid[4];                     // chip ID bytes from getver
+    int depth;                          // amount of write/verify packets in flight
+    int maxretries;                     // max amount of retries of each transaction
+    int nretries;                       // amount of retries made
+    int inrecover;                      // ==1 while repeating handshake after reopen
+};
+
+static int recover(ch55session *s, int attempt);
+static void prepjoin(ch55session *s);
+
+/**
+ * @brief ch55_getdescr - get chip description by its ID
+ * @param chipid - chip ID
+ * @return description or NULL if not found
+ */
+const ch55descr *ch55_getdescr(uint8_t chipid){
+    for(const ch55descr *ptr = devlist; ptr->devname; ++ptr)
+        if(ptr->chipid == chipid) return ptr;
+    return NULL;
+}
+
+/**
+ * @brief ch55_getdescrbyname - get chip description by its name
+ * @param name - chip name (case insensitive, like "CH552")
+ * @return description or NULL if not found
+ */
+const ch55descr *ch55_getdescrbyname(const char *name){
+    if(!name) return NULL;
+    for(const ch55descr *ptr = devlist; ptr->devname; ++ptr)
+        if(strcasecmp(ptr->devname, name) == 0) return ptr;
+    return NULL;
+}
+
+/**
+ * @brief ch55_open_transport - open new ISP session over given transport
+ * @param t - transport (will be closed with session)
+ * @return session or NULL if `t` is NULL
+ */
+ch55session *ch55_open_transport(ch55transport *t){
+    if(!t) return NULL;
+    ch55session *s = MALLOC(ch55session, 1);
+    s->tr = t;
+    s->old = -1;
+    s->depth = 1;
+    s->maxretries = CH55_RETRIES;
+    pthread_mutex_init(&s->mutex, NULL);
+    return s;
+}
+
+/**
+ * @brief ch55_open - open new ISP session with USB device
+ * @param a - device position or NULL for first found device
+ * @return session or NULL if failed
+ */
+ch55session *ch55_open(const ch55devaddr *a){
+    return ch55_open_transport(ch55_usbtransport(a));
+}
+
+/**
+ * @brief ch55_close - close session and free its data
+ * @param s - session
+ */
+void ch55_close(ch55session **s){
+    if(!s || !*s) return;
+    ch55session *S = *s;
+    pthread_mutex_lock(&S->mutex);
+    prepjoin(S);
+    pthread_mutex_unlock(&S->mutex);
+    S->tr->close(S->tr);
+    FREE(S->stream);
+    FREE(S->used);
+    pthread_mutex_destroy(&S->mutex);
+    FREE(*s);
 }
 
-static libusb_device_handle *devh = NULL;
-int usbcmd(const uint8_t *data, int olen, int ilen){
+// send command and receive answer into s->buf; session should be locked
+static int usbcmd(ch55session *s, const uint8_t *data, int olen, int ilen){
     FNAME();
-    static libusb_context *ctx = NULL;
-    int inum, onum;
     if(!olen) return 0;
-    if(!devh){
-        if(libusb_init(&ctx)) ERR("libusb_init()");
-        devh = libusb_open_device_with_vid_pid(ctx, CH55VID, CH55PID);
-        if(!devh) ERR(_("No devices found"));
-        if(libusb_claim_interface(devh, 0)) ERR("libusb_claim_interface()");
-    }
-#ifdef EBUG
-    green("usbcmd() send:\n");
-    for(int i = 0; i < olen; ++i){
-        printf("0x%02X ", data[i]);
-    }
-    printf("\n");
-#endif
-    int oret = libusb_bulk_transfer(devh, EPOUT, (unsigned char*)data, olen, &onum, USB_TIMEOUT);
-    int iret = libusb_bulk_transfer(devh, EPIN, buf, ilen, &inum, USB_TIMEOUT);
-    if(oret || iret || onum != olen || inum != ilen){
-        WARN("libusb_bulk_transfer()");
-        libusb_release_interface(devh, 0);
-        libusb_close(devh);
-        libusb_exit(NULL);
-        exit(3);
-    }
-#ifdef EBUG
-    green("usbcmd() got:\n");
-    for(int i = 0; i < inum; ++i){
-        printf("0x%02X ", buf[i]);
-    }
-    printf("\n");
-#endif
+    int inum;
+    for(int attempt = 0; (inum = s->tr->xfer(s->tr, data, olen, s->buf, ilen)) != ilen; ++attempt){
+        if(attempt >= s->maxretries || recover(s, attempt)){
+            WARNX(_("Bad answer from bootloader"));
+            return -1;
+        }
+    }
     return inum;
 }
 
-static uint8_t chipid = 0;
-const ch55descr *detect_chip(){
-    int got = usbcmd(DETECT_CHIP_CMD_V2, sizeof(DETECT_CHIP_CMD_V2)-1, DETECT_CHIP_LEN);
-    if(DETECT_CHIP_LEN != got) return NULL;
-    const ch55descr *ptr = devlist;
-    while(ptr->devname){
-        if(buf[4] == ptr->chipid){
-            chipid = ptr->chipid;
-            return ptr;
+/**
+ * @brief ch55_usbcmd - send raw command and get answer
+ * @param s - session
+ * @param data - command
+ * @param olen - its length
+ * @param ilen - length of answer
+ * @return amount of bytes got (answer is in ch55_getbuf()) or -1 if failed
+ */
+int ch55_usbcmd(ch55session *s, const uint8_t *data, int olen, int ilen){
+    if(ilen > (int)sizeof(s->buf)) ilen = sizeof(s->buf);
+    pthread_mutex_lock(&s->mutex);
+    int r = usbcmd(s, data, olen, ilen);
+    pthread_mutex_unlock(&s->mutex);
+    return r;
+}
+
+/**
+ * @brief ch55_gettransport - transport of session
+ */
+ch55transport *ch55_gettransport(ch55session *s){
+    return s->tr;
+}
+
+/**
+ * @brief ch55_getuid - chip ID bytes (4 bytes, valid after ch55_getver())
+ */
+const uint8_t *ch55_getuid(ch55session *s){
+    return s->uid;
+}
+
+/**
+ * @brief ch55_getbuf - buffer with last answer of session
+ */
+const uint8_t *ch55_getbuf(ch55session *s){
+    return s->buf;
+}
+
+const ch55descr *ch55_detect_chip(ch55session *s){
+    const ch55descr *ptr = NULL;
+    pthread_mutex_lock(&s->mutex);
+    int got = usbcmd(s, DETECT_CHIP_CMD_V2, sizeof(DETECT_CHIP_CMD_V2)-1, DETECT_CHIP_LEN);
+    if(DETECT_CHIP_LEN == got){
+        ptr = ch55_getdescr(s->buf[4]);
+        if(ptr && ptr->chipid != s->chipid){
+            prepjoin(s);
+            s->chipid = ptr->chipid;
         }
-        ++ptr;
     }
-    return NULL;
+    pthread_mutex_unlock(&s->mutex);
+    return ptr;
 }
 
+/**
+ * @brief mkframe - make scrambled write or verify command; session should be locked (after getver)
+ * @param s - session
+ * @param frame (o) - command (8 + n bytes, zeroed)
+ * @param cmdcode - command code
+ * @param addr - address
+ * @param data - data
+ * @param n - its length (up to WRITEPACKETLEN), if less than `len` the rest of data is zeros
+ * @param len - length of payload
+ */
+static void mkframe(ch55session *s, uint8_t *frame, uint8_t cmdcode, size_t addr, const uint8_t *data, size_t n, size_t len){
+    uint8_t k7 = (s->chk_sum + s->chipid) & 0xff, k = s->old ? 0 : s->chk_sum;
+    uint8_t *payload = &frame[8];
+    memcpy(payload, data, n);
+    for(size_t j = 0; j < len; ++j){
+        if(j % 8 == 7) payload[j] ^= k7;
+        else payload[j] ^= k;
+    }
+    frame[0] = cmdcode;
+    frame[1] = (len + 5) & 0xff;
+    frame[3] = addr & 0xff;
+    frame[4] = (addr >> 8) & 0xff;
+    frame[7] = len;
+}
+
+// wait for preparation of `stream` (before changing of key or image); session should be locked
+static void prepjoin(ch55session *s){
+    if(!s->prepon) return;
+    pthread_join(s->prep, NULL);
+    s->prepon = 0;
+}
+
+// preparation stage: scramble frames of image one by one and publish them for transfer stage;
+// session fields used here aren't changed until prepjoin()
+static void *prepthread(void *arg){
+    ch55session *s = (ch55session*) arg;
+    size_t N = s->nframes;
+    for(size_t i = 0; i < N; ++i){
+        uint8_t *w = s->stream + i * WRITEVERIFYSZ, *v = w + N * WRITEVERIFYSZ;
+        size_t addr = i * WRITEPACKETLEN, n = s->slen - addr;
+        if(n > WRITEPACKETLEN) n = WRITEPACKETLEN;
+        mkframe(s, w, WRITE_CMD_V2, addr, s->sdata + addr, n, WRITEPACKETLEN);
+        memcpy(v, w, WRITEVERIFYSZ);
+        v[0] = VERIFY_CMD_V2;
+        __atomic_store_n(&s->ready, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
 
-static int old = -1; // ==1 for V2.30, ==0 for V2.31 or V2.40
-static uint8_t chk_sum = 0;
 /**
- * @brief getver - get version string
- * @return version or NULL if failed
+ * @brief mkstream - start preparation of scrambled frames of write and verify commands; session should be locked
+ * Frames are made by separate thread, so transfer starts from first frame ready and doesn't wait for the rest;
+ * list of non-empty packets is ready at return
+ * @param s - session (after getver)
+ * @param img - image
+ * @return 0 if OK
  */
-char *getver(){
-    static char v[32];
-    if(GETVER_LEN != usbcmd(READ_CFG_CMD_V2, sizeof(READ_CFG_CMD_V2), GETVER_LEN)) return NULL;
-    snprintf(v, 32, "V%d.%d%d", buf[19], buf[20], buf[21]);
-    int s = buf[22] + buf[23] + buf[24] + buf[25];
-    chk_sum = s&0xff;
-    DBG("chk_sum=0x%02X", chk_sum);
+static int mkstream(ch55session *s, const ch55image *img){
+    if(s->old < 0 || !s->chipid || !img) return 1;
+    prepjoin(s);
+    size_t N = (img->len + WRITEPACKETLEN - 1) / WRITEPACKETLEN;
+    FREE(s->stream);
+    FREE(s->used);
+    s->stream = MALLOC(uint8_t, 2 * N * WRITEVERIFYSZ + 1);
+    s->used = MALLOC(size_t, N + 1);
+    s->nused = 0;
+    for(size_t i = 0; i < N; ++i){
+        size_t addr = i * WRITEPACKETLEN, n = img->len - addr;
+        if(n > WRITEPACKETLEN) n = WRITEPACKETLEN;
+        for(size_t j = 0; j < n; ++j) if(img->data[addr + j] != CH55_ERASED){
+            s->used[s->nused++] = i;
+            break;
+        }
+    }
+    s->nframes = N;
+    s->simg = img;
+    s->sdata = img->data;
+    s->slen = img->len;
+    __atomic_store_n(&s->ready, 0, __ATOMIC_RELEASE);
+    if(pthread_create(&s->prep, NULL, prepthread, s)) prepthread(s); // prepare in place
+    else s->prepon = 1;
+    return 0;
+}
+
+// getver() without locking
+static const char *getver(ch55session *s){
+    char *v = s->version;
+    prepjoin(s); // key will be changed
+    if(GETVER_LEN != usbcmd(s, READ_CFG_CMD_V2, sizeof(READ_CFG_CMD_V2), GETVER_LEN)) return NULL;
+    snprintf(v, sizeof(s->version), "V%d.%d%d", s->buf[19], s->buf[20], s->buf[21]);
+    memcpy(s->uid, &s->buf[22], 4);
+    int sum = s->buf[22] + s->buf[23] + s->buf[24] + s->buf[25];
+    s->chk_sum = sum & 0xff;
+    DBG("chk_sum=0x%02X", s->chk_sum);
     if(strcmp(v, "V2.30") == 0){ // ver 2.30, sendkey
-        for(int i = 3; i < 48; ++i) SEND_KEY_CMD_V230[i] = chk_sum;
+        uint8_t key[SEND_KEY_V230_LEN];
+        memcpy(key, SEND_KEY_CMD_V230, sizeof(SEND_KEY_CMD_V230));
+        for(int i = sizeof(SEND_KEY_CMD_V230); i < SEND_KEY_V230_LEN; ++i) key[i] = s->chk_sum;
         DBG("Write key");
-        if(SENDKEYLEN != usbcmd(SEND_KEY_CMD_V230, sizeof(SEND_KEY_CMD_V230), SENDKEYLEN)) return NULL;
-        if(buf[3]) return NULL;
-        old = 1;
+        if(SENDKEYLEN != usbcmd(s, key, SEND_KEY_V230_LEN, SENDKEYLEN)) return NULL;
+        if(s->buf[3]) return NULL;
+        s->old = 1;
     }else if(strcmp(v, "V2.31") == 0 || strcmp(v, "V2.40") == 0){
-        if(SENDKEYLEN != usbcmd(SEND_KEY_CMD_V240, sizeof(SEND_KEY_CMD_V240), SENDKEYLEN)) return NULL;
-        if(buf[3]) return NULL;
-        old = 0;
+        if(SENDKEYLEN != usbcmd(s, SEND_KEY_CMD_V240, sizeof(SEND_KEY_CMD_V240), SENDKEYLEN)) return NULL;
+        if(s->buf[3]) return NULL;
+        s->old = 0;
     }else{
         WARNX(_("Version %s not supported\n"), v);
         return NULL;
     }
+    s->simg = NULL; // key changed
+    if(s->img) mkstream(s, s->img);
     return v;
 }
 
-int erasechip(){
-    if(ERASELEN != usbcmd(ERASE_CHIP_CMD_V2, sizeof(ERASE_CHIP_CMD_V2), ERASELEN)) return 1;
-    if(buf[3]) return 2;
+/**
+ * @brief recover - prepare to repeat failed transaction; session should be locked
+ * First retry is made just after small pause, next ones - after reopening of device
+ * and repeating of handshake (detect and key); pause is doubled each time.
+ * Commands of handshake itself are only repeated without reopening
+ * @param s - session
+ * @param attempt - number of failed attempt (from 0)
+ * @return 0 if transaction could be repeated
+ */
+static int recover(ch55session *s, int attempt){
+    ++s->nretries;
+    usleep(RETRY_BACKOFF << attempt);
+    if(!attempt || !s->tr->reopen || s->inrecover) return 0;
+    WARNX(_("Reopen device"));
+    if(s->tr->reopen(s->tr)) return 1;
+    int r = 0;
+    s->inrecover = 1;
+    if(s->chipid && DETECT_CHIP_LEN != usbcmd(s, DETECT_CHIP_CMD_V2, sizeof(DETECT_CHIP_CMD_V2)-1, DETECT_CHIP_LEN)) r = 1;
+    else if(s->old >= 0 && !getver(s)) r = 1;
+    s->inrecover = 0;
+    return r;
+}
+
+/**
+ * @brief ch55_getver - get version string and send key
+ * @return version (stored in session) or NULL if failed
+ */
+const char *ch55_getver(ch55session *s){
+    pthread_mutex_lock(&s->mutex);
+    const char *v = getver(s);
+    pthread_mutex_unlock(&s->mutex);
+    return v;
+}
+
+int ch55_erasechip(ch55session *s){
+    int r = 0;
+    pthread_mutex_lock(&s->mutex);
+    if(ERASELEN != usbcmd(s, ERASE_CHIP_CMD_V2, sizeof(ERASE_CHIP_CMD_V2), ERASELEN)) r = 1;
+    else if(s->buf[3]) r = 2;
+    pthread_mutex_unlock(&s->mutex);
+    return r;
+}
+
+/**
+ * @brief ch55_pipeline_seq - sequential variant of transport's `pipeline`
+ * @param t - transport
+ * @param ilen - length of answers
+ * @param cb - callbacks
+ * @return 0 if OK or -1 if transfer failed
+ */
+int ch55_pipeline_seq(ch55transport *t, int ilen, const ch55pipecb *cb){
+    uint8_t ans[64];
+    const uint8_t *cmd;
+    int len;
+    if(ilen > (int)sizeof(ans)) return -1;
+    while((cmd = cb->next(cb->arg, &len))){
+        int got = t->xfer(t, cmd, len, ans, ilen);
+        if(got < 0) return -1;
+        if(cb->check(cb->arg, cmd, ans, got)) break;
+    }
     return 0;
 }
 
-static int writeverify(char *filename, uint8_t *cmd){
-    uint8_t packet[WRITEPACKETLEN];
-    if(old < 0) ERRX(_("Wrong getver()?"));
-    if(!chipid) ERRX(_("Wrong detect_chip()?"));
-    FILE *f = fopen(filename, "r");
-    if(!f) ERR(_("Can't open %s"), filename);
-    size_t n = 0, curr_addr = 0;
-    do{
-        memset(packet, 0, WRITEPACKETLEN);
-        if(!(n = fread(packet, 1, WRITEPACKETLEN, f))) break;
-        n = WRITEPACKETLEN;
-        for(size_t i = 0; i < n; i++){
-            if(i % 8 == 7) packet[i] = packet[i] ^ ((chk_sum + chipid) & 0xff);
-            else if(old == 0) packet[i] ^= chk_sum;
-        }
-        cmd[1] = (n + 5) & 0xff;
-        cmd[3] = curr_addr & 0xff;
-        cmd[4] = (curr_addr >> 8) & 0xff;
-        cmd[7] = 56;//n & 0xff;
-        curr_addr += n;
-        memcpy(&cmd[8], packet, n);
-        if(WRITELEN != usbcmd(cmd, n+8, WRITELEN)){
-            fclose(f);
-            return 1;
-        }
-        if(buf[4]) WARNX("buf[4]==0x%02X", buf[4]);
-    }while(n == WRITEPACKETLEN);
-    fclose(f);
+// state of write/verify/read pass
+typedef struct{
+    ch55session *s;
+    const ch55image *img;   // image of s->stream or NULL for other frames
+    const size_t *pkts;     // numbers of packets of `img` to process (NULL - all non-empty or all)
+    size_t npkts;           // their amount
+    uint8_t *const *pbase;  // pointer to frames (s->stream could be rebuilt after recover())
+    size_t first;           // index of first frame in *pbase
+    const size_t *map;      // indexes of frames to send (NULL - all)
+    size_t next;            // number of next frame to send
+    size_t end;             // amount of frames
+    size_t acked;           // amount of answered frames
+    uint8_t cmdcode;        // command code
+    int cmp;                // ==1 to stop quietly on first bad packet
+    int fail;               // ==1 if got wrong answer
+    int ret;                // result
+    uint8_t *rbuf;          // buffer for data read
+    size_t roff;            // address of its first byte
+} wvstate;
+
+// get next prepared frame
+static const uint8_t *nextframe(void *arg, int *len){
+    wvstate *st = (wvstate*) arg;
+    if(st->next >= st->end) return NULL;
+    size_t i = st->map ? st->map[st->next] : st->next;
+    ++st->next;
+    if(st->img) // wait if preparation stage is behind (only at start of transfer)
+        while(__atomic_load_n(&st->s->ready, __ATOMIC_ACQUIRE) <= i) sched_yield();
+    const uint8_t *f = *st->pbase + (st->first + i) * WRITEVERIFYSZ;
+    *len = f[1] + 3; // header and payload
+    return f;
+}
+
+// check answer of write/verify packet
+static int chkpacket(void *arg, const uint8_t *cmd, const uint8_t *ans, int len){
+    wvstate *st = (wvstate*) arg;
+    size_t addr = cmd[3] | (cmd[4] << 8);
+    if(len != WRITELEN || ans[0] != st->cmdcode){
+        WARNX(_("Wrong answer for packet at 0x%04zX"), addr);
+        st->fail = 1;
+        return 1;
+    }
+    ++st->acked; // answers come in order of commands
+    memcpy(st->s->buf, ans, WRITELEN);
+    if(!ans[4]) return 0;
+    if(!st->cmp){
+        if(st->cmdcode == VERIFY_CMD_V2) WARNX(_("Flash differs at 0x%04zX"), addr);
+        else WARNX(_("Can't write packet at 0x%04zX: status 0x%02X"), addr, ans[4]);
+    }
+    st->ret = 2;
+    return st->cmp;
+}
+
+/**
+ * @brief codeframes - set frames of code image for `st` (s->stream could be rebuilt
+ *      for other image after recover()); session should be locked
+ * @return 0 if OK
+ */
+static int codeframes(wvstate *st){
+    ch55session *s = st->s;
+    const ch55image *img = st->img;
+    if((s->simg != img || s->sdata != img->data || s->slen != img->len) && mkstream(s, img)) return 1;
+    st->pbase = &s->stream;
+    st->first = (st->cmdcode == VERIFY_CMD_V2) ? s->nframes : 0;
+    // empty packets are not written (erased chip already contains them), but they are verified
+    // in the same pipelined pass: non-erased or stuck region shouldn't pass unnoticed
+    if(st->pkts){
+        st->map = st->pkts;
+        st->end = st->npkts;
+    }else if(st->cmdcode == WRITE_CMD_V2){
+        st->map = s->used;
+        st->end = s->nused;
+    }else{
+        st->map = NULL;
+        st->end = s->nframes;
+    }
     return 0;
 }
 
-int writeflash(char *filename){
-    return writeverify(filename, WRITE_CMD_V2);
+/**
+ * @brief sendframes - send all frames of `st` (pipelined if set) with retries; session should be locked
+ * After failure transfer is resumed from first unanswered frame
+ * @param st - state
+ * @param check - callback to check answers
+ * @param ilen - max length of answer
+ * @return 0 if all frames are answered, 1 if transfer failed
+ */
+static int sendframes(wvstate *st, int (*check)(void*, const uint8_t*, const uint8_t*, int), int ilen){
+    ch55session *s = st->s;
+    ch55pipecb cb = {.next = nextframe, .check = check, .arg = st};
+    size_t acked = st->acked;
+    for(int attempt = 0; ; ++attempt){
+        if(st->img && codeframes(st)) return 1;
+        st->next = st->acked;
+        st->fail = 0;
+        int r;
+        if(s->depth > 1 && s->tr->pipeline) r = s->tr->pipeline(s->tr, s->depth, ilen, &cb);
+        else r = ch55_pipeline_seq(s->tr, ilen, &cb);
+        if(!r && !st->fail) return 0;
+        if(st->acked > acked){ // there was a progress: count retries of next packet
+            acked = st->acked;
+            attempt = 0;
+        }
+        if(attempt >= s->maxretries || recover(s, attempt)) return 1;
+        if(st->acked < st->end)
+            WARNX(_("Resume from 0x%04zX"), (st->map ? st->map[st->acked] : st->acked) * WRITEPACKETLEN);
+    }
+}
+
+// check that key is known; session should be locked
+static int keyok(ch55session *s){
+    if(s->old < 0){
+        WARNX(_("Wrong getver()?"));
+        return 0;
+    }
+    if(!s->chipid){
+        WARNX(_("Wrong detect_chip()?"));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief writeverify - write or verify image; session should be locked
+ * @param s - session
+ * @param img - image
+ * @param cmdcode - WRITE_CMD_V2 or VERIFY_CMD_V2
+ * @param cmp - ==1 to stop quietly on first bad packet (compare flash content)
+ * @param pkts - numbers of packets to process (NULL - all non-empty or all)
+ * @param npkts - their amount
+ * @return 0 if all OK, 1 if transfer failed, 2 if bad status got (flash differs)
+ */
+static int writeverify(ch55session *s, const ch55image *img, uint8_t cmdcode, int cmp,
+                       const size_t *pkts, size_t npkts){
+    if(!keyok(s) || !img) return 1;
+    const ch55descr *d = ch55_getdescr(s->chipid);
+    if(d && img->len > d->flash_size){
+        WARNX(_("Image size (%zu) is greater than flash size (%d)"), img->len, d->flash_size);
+        return 1;
+    }
+    wvstate st = {.s = s, .img = img, .pkts = pkts, .npkts = npkts,
+                  .cmdcode = cmdcode, .cmp = cmp};
+    if(sendframes(&st, chkpacket, WRITELEN)) return 1;
+    return st.ret;
+}
+
+// lock session and run writeverify()
+static int lockedwv(ch55session *s, const ch55image *img, uint8_t cmdcode, int cmp){
+    pthread_mutex_lock(&s->mutex);
+    int r = writeverify(s, img, cmdcode, cmp, NULL, 0);
+    pthread_mutex_unlock(&s->mutex);
+    return r;
+}
+
+// load file and run writeverify()
+static int filewv(ch55session *s, const char *filename, uint8_t cmdcode, int cmp){
+    ch55image *img = ch55_loadimage(filename);
+    if(!img) return 1;
+    int r = lockedwv(s, img, cmdcode, cmp);
+    ch55_freeimage(&img);
+    return r;
+}
+
+/**
+ * @brief ch55_setimage - bind image to session: scrambled command frames for it will be
+ *        prepared once right after key exchange (or immediately if key is known)
+ *        and used by all following write/verify/compare calls with this image
+ * @param s - session
+ * @param img - image (NULL to unbind); call again if its content was changed
+ * @return 0 if OK
+ */
+int ch55_setimage(ch55session *s, const ch55image *img){
+    int r = 0;
+    pthread_mutex_lock(&s->mutex);
+    prepjoin(s); // previous image could be freed after this call
+    s->img = img;
+    s->simg = NULL;
+    if(img && s->old >= 0) r = mkstream(s, img);
+    pthread_mutex_unlock(&s->mutex);
+    return r;
+}
+
+/**
+ * @brief ch55_usedpackets - amount of write packets of bound image (after key exchange)
+ * @param s - session
+ * @param total (o) - full amount of packets in image (or NULL)
+ * @return amount of non-empty packets (which will be really written)
+ */
+size_t ch55_usedpackets(ch55session *s, size_t *total){
+    pthread_mutex_lock(&s->mutex);
+    size_t n = 0, N = 0;
+    if(s->img && s->simg == s->img){
+        n = s->nused;
+        N = s->nframes;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    if(total) *total = N;
+    return n;
 }
 
-int verifyflash(char *filename){
-    return writeverify(filename, VERIFY_CMD_V2);
+/**
+ * @brief ch55_setpipeline - set amount of packets in flight for write/verify
+ * @param s - session
+ * @param depth - amount of packets (1 - no pipelining)
+ * @return value set
+ */
+int ch55_setpipeline(ch55session *s, int depth){
+    if(depth < 1) depth = 1;
+    else if(depth > CH55_MAXPIPELINE) depth = CH55_MAXPIPELINE;
+    pthread_mutex_lock(&s->mutex);
+    s->depth = depth;
+    pthread_mutex_unlock(&s->mutex);
+    return depth;
 }
 
-int endflash(){
-    if(FIXLEN != usbcmd(END_FLASH_CMD_V2, sizeof(END_FLASH_CMD_V2), FIXLEN) || buf[4]) return 1;
+/**
+ * @brief ch55_setretries - set max amount of retries of each transaction
+ * @param s - session
+ * @param n - amount (0 - don't retry)
+ * @return value set
+ */
+int ch55_setretries(ch55session *s, int n){
+    if(n < 0) n = 0;
+    else if(n > 16) n = 16;
+    pthread_mutex_lock(&s->mutex);
+    s->maxretries = n;
+    pthread_mutex_unlock(&s->mutex);
+    return n;
+}
+
+/**
+ * @brief ch55_getretries - amount of retries made in session
+ */
+int ch55_getretries(ch55session *s){
+    pthread_mutex_lock(&s->mutex);
+    int n = s->nretries;
+    pthread_mutex_unlock(&s->mutex);
+    return n;
+}
+
+int ch55_writeimage(ch55session *s, const ch55image *img){
+    return lockedwv(s, img, WRITE_CMD_V2, 0);
+}
+
+int ch55_verifyimage(ch55session *s, const ch55image *img){
+    return lockedwv(s, img, VERIFY_CMD_V2, 0);
+}
+
+/**
+ * @brief ch55_compareimage - check if flash contains given image (stops on first difference)
+ * @param s - session
+ * @param img - image
+ * @return 0 if same, 1 if transfer failed, 2 if differs
+ */
+int ch55_compareimage(ch55session *s, const ch55image *img){
+    return lockedwv(s, img, VERIFY_CMD_V2, 1);
+}
+
+/**
+ * @brief ch55_comparepackets - check only given packets of image (stops on first difference)
+ * @param s - session
+ * @param img - image
+ * @param pkts - numbers of packets (address / CH55_PACKETLEN), should be less than amount of packets in image
+ * @param npkts - their amount
+ * @return 0 if same, 1 if transfer failed, 2 if differs
+ */
+int ch55_comparepackets(ch55session *s, const ch55image *img, const size_t *pkts, size_t npkts){
+    if(!img || !pkts) return 1;
+    size_t N = (img->len + WRITEPACKETLEN - 1) / WRITEPACKETLEN;
+    for(size_t i = 0; i < npkts; ++i) if(pkts[i] >= N) return 1;
+    pthread_mutex_lock(&s->mutex);
+    int r = writeverify(s, img, VERIFY_CMD_V2, 1, pkts, npkts);
+    pthread_mutex_unlock(&s->mutex);
+    return r;
+}
+
+int ch55_writeflash(ch55session *s, const char *filename){
+    return filewv(s, filename, WRITE_CMD_V2, 0);
+}
+
+int ch55_verifyflash(ch55session *s, const char *filename){
+    return filewv(s, filename, VERIFY_CMD_V2, 0);
+}
+
+int ch55_compareflash(ch55session *s, const char *filename){
+    return filewv(s, filename, VERIFY_CMD_V2, 1);
+}
+
+/**
+ * @brief datacheck - check if data flash operation possible; session should be locked
+ * @param s - session
+ * @param offset - address in data flash
+ * @param len - length of data
+ * @return 1 if possible
+ */
+static int datacheck(ch55session *s, size_t offset, size_t len){
+    if(!keyok(s)) return 0;
+    if(s->old){
+        WARNX(_("Bootloader V2.30 has no data flash commands"));
+        return 0;
+    }
+    const ch55descr *d = ch55_getdescr(s->chipid);
+    if(!d || offset + len > d->data_size){
+        WARNX(_("Data (%zu bytes at %zu) is out of data flash (%d bytes)"), len, offset, d ? d->data_size : 0);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief ch55_dataerase - erase data flash
+ * @param s - session (after getver)
+ * @return 0 if OK, 1 if transfer failed, 2 if bad status
+ */
+int ch55_dataerase(ch55session *s){
+    int r = 0;
+    pthread_mutex_lock(&s->mutex);
+    if(!datacheck(s, 0, 0)) r = 1;
+    else{
+        const ch55descr *d = ch55_getdescr(s->chipid);
+        // address (4 bytes) and amount of 1k sectors
+        uint8_t cmd[] = {DATA_ERASE_CMD_V2, 5, 0, 0, 0, 0, 0, (d->data_size + 1023) / 1024};
+        if(ERASELEN != usbcmd(s, cmd, sizeof(cmd), ERASELEN)) r = 1;
+        else if(s->buf[4]) r = 2;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return r;
+}
+
+/**
+ * @brief ch55_datawrite - write data flash (pipelined like code flash)
+ * @param s - session (after getver)
+ * @param offset - address in data flash
+ * @param data - data
+ * @param len - its length
+ * @return 0 if OK, 1 if transfer failed, 2 if bad status
+ */
+int ch55_datawrite(ch55session *s, size_t offset, const uint8_t *data, size_t len){
+    int r = 1;
+    pthread_mutex_lock(&s->mutex);
+    if(datacheck(s, offset, len)){
+        size_t N = (len + WRITEPACKETLEN - 1) / WRITEPACKETLEN;
+        uint8_t *frames = MALLOC(uint8_t, N * WRITEVERIFYSZ + 1);
+        for(size_t i = 0; i < N; ++i){
+            size_t a = i * WRITEPACKETLEN, n = len - a;
+            if(n > WRITEPACKETLEN) n = WRITEPACKETLEN;
+            mkframe(s, frames + i * WRITEVERIFYSZ, DATA_WRITE_CMD_V2, offset + a, data + a, n, n);
+        }
+        wvstate st = {.s = s, .pbase = &frames, .end = N, .cmdcode = DATA_WRITE_CMD_V2};
+        r = sendframes(&st, chkpacket, WRITELEN) ? 1 : st.ret;
+        FREE(frames);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return r;
+}
+
+// check answer of data read command and store data
+static int chkread(void *arg, const uint8_t *cmd, const uint8_t *ans, int len){
+    wvstate *st = (wvstate*) arg;
+    size_t addr = cmd[3] | (cmd[4] << 8), n = cmd[7] | (cmd[8] << 8);
+    if(len != (int)(DATAREADHDR + n) || ans[0] != st->cmdcode){
+        WARNX(_("Wrong answer for data at 0x%04zX"), addr);
+        st->fail = 1;
+        return 1;
+    }
+    ++st->acked;
+    if(ans[4]){
+        WARNX(_("Can't read data at 0x%04zX: status 0x%02X"), addr, ans[4]);
+        st->ret = 2;
+        return 1;
+    }
+    memcpy(st->rbuf + addr - st->roff, ans + DATAREADHDR, n);
     return 0;
 }
 
-void restart(){
-    int onum;
-    libusb_bulk_transfer(devh, EPOUT, (unsigned char*)RESET_RUN_CMD_V2, sizeof(RESET_RUN_CMD_V2), &onum, USB_TIMEOUT);
+/**
+ * @brief ch55_dataread - read data flash
+ * @param s - session (after getver)
+ * @param offset - address in data flash
+ * @param data (o) - buffer for data
+ * @param len - amount of bytes to read
+ * @return 0 if OK, 1 if transfer failed, 2 if bad status
+ */
+int ch55_dataread(ch55session *s, size_t offset, uint8_t *data, size_t len){
+    int r = 1;
+    pthread_mutex_lock(&s->mutex);
+    if(datacheck(s, offset, len)){
+        size_t N = (len + WRITEPACKETLEN - 1) / WRITEPACKETLEN;
+        uint8_t *frames = MALLOC(uint8_t, N * WRITEVERIFYSZ + 1);
+        for(size_t i = 0; i < N; ++i){ // address (4 bytes) and length (2 bytes)
+            uint8_t *f = frames + i * WRITEVERIFYSZ;
+            size_t a = offset + i * WRITEPACKETLEN, n = offset + len - a;
+            if(n > WRITEPACKETLEN) n = WRITEPACKETLEN;
+            f[0] = DATA_READ_CMD_V2;
+            f[1] = 6;
+            f[3] = a & 0xff;
+            f[4] = (a >> 8) & 0xff;
+            f[7] = n & 0xff;
+            f[8] = (n >> 8) & 0xff;
+        }
+        wvstate st = {.s = s, .pbase = &frames, .end = N, .cmdcode = DATA_READ_CMD_V2,
+                      .rbuf = data, .roff = offset};
+        r = sendframes(&st, chkread, DATAREADHDR + WRITEPACKETLEN) ? 1 : st.ret;
+        FREE(frames);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return r;
+}
+
+int ch55_endflash(ch55session *s){
+    int r = 0;
+    pthread_mutex_lock(&s->mutex);
+    if(FIXLEN != usbcmd(s, END_FLASH_CMD_V2, sizeof(END_FLASH_CMD_V2), FIXLEN) || s->buf[4]) r = 1;
+    pthread_mutex_unlock(&s->mutex);
+    return r;
 }
 
+/**
+ * @brief ch55_restart - reset MCU and run user code (MCU won't answer)
+ * @return 0 if command sent
+ */
+int ch55_restart(ch55session *s){
+    pthread_mutex_lock(&s->mutex);
+    int r = s->tr->send(s->tr, RESET_RUN_CMD_V2, sizeof(RESET_RUN_CMD_V2));
+    pthread_mutex_unlock(&s->mutex);
+    return r;
+}
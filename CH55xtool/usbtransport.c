@@ -0,0 +1,653 @@
+/*
+ * This file is part of the CH55tool project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <libusb.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+#include "ch55isp.h"
+
+typedef struct{
+    libusb_context *ctx;                // libusb context
+    libusb_device_handle *devh;         // opened device
+    int ownctx;                         // ==1 if context should be closed with transport
+    uint16_t vid, pid;                  // VID:PID of bootloader
+    uint8_t bus;                        // position of device to find it after re-enumeration:
+    uint8_t ports[8];                   //   bus and port numbers
+    int nports;
+    int wrapped;                        // ==1 if device opened by file descriptor (without enumeration)
+    int fd;                             //   its descriptor
+    int ownfd;                          //   ==1 if descriptor should be closed with transport
+} usbpriv;
+
+// directory with USB devices in sysfs
+#define SYSFS_USB       "/sys/bus/usb/devices/"
+
+
+// max time to wait for device after it dropped off, s
+#define REOPEN_TIMEOUT  (5.)
+// interval of device polling, us
+#define REOPEN_POLL     (50000)
+
+/**
+ * @brief ch55_finddevs - find all connected devices with given VID:PID
+ * @param vid, pid - vendor and product ID
+ * @param list (o) - allocated list of devices' positions (free it after use)
+ * @return amount of devices found
+ */
+int ch55_finddevs(uint16_t vid, uint16_t pid, ch55devaddr **list){
+    libusb_context *lctx = NULL;
+    libusb_device **devs;
+    if(!list) return 0;
+    *list = NULL;
+    if(libusb_init(&lctx)){
+        WARNX("libusb_init()");
+        return 0;
+    }
+    ssize_t N = libusb_get_device_list(lctx, &devs);
+    if(N < 0){
+        WARNX("libusb_get_device_list()");
+        libusb_exit(lctx);
+        return 0;
+    }
+    int found = 0;
+    if(N) *list = MALLOC(ch55devaddr, N);
+    for(ssize_t i = 0; i < N; ++i){
+        struct libusb_device_descriptor d;
+        if(libusb_get_device_descriptor(devs[i], &d)) continue;
+        if(d.idVendor != vid || d.idProduct != pid) continue;
+        (*list)[found].bus = libusb_get_bus_number(devs[i]);
+        (*list)[found].addr = libusb_get_device_address(devs[i]);
+        int n = libusb_get_port_numbers(devs[i], (*list)[found].ports, sizeof((*list)[found].ports));
+        (*list)[found].nports = (n > 0) ? n : 0;
+        DBG("Found device %04X:%04X at %d:%d", vid, pid, (*list)[found].bus, (*list)[found].addr);
+        ++found;
+    }
+    libusb_free_device_list(devs, 1);
+    libusb_exit(lctx);
+    if(!found) FREE(*list);
+    return found;
+}
+
+/**
+ * @brief ch55_findalldevs - find all connected bootloaders
+ * @param list (o) - allocated list of devices' positions (free it after use)
+ * @return amount of devices found
+ */
+int ch55_findalldevs(ch55devaddr **list){
+    return ch55_finddevs(CH55VID, CH55PID, list);
+}
+
+/**
+ * @brief ch55_appboot - ask running firmware to restart into bootloader: vendor request CH55_BOOTREQ
+ *        or (if it is stalled) CDC SET_LINE_CODING with CH55_BOOTBAUD baud rate
+ * @param vid, pid - VID:PID of firmware
+ * @param a - its position (bus and address)
+ * @return 0 if request accepted
+ */
+int ch55_appboot(uint16_t vid, uint16_t pid, const ch55devaddr *a){
+    libusb_context *lctx = NULL;
+    libusb_device **devs;
+    libusb_device_handle *h = NULL;
+    int r = LIBUSB_ERROR_NOT_FOUND;
+    if(libusb_init(&lctx)){
+        WARNX("libusb_init()");
+        return 1;
+    }
+    ssize_t N = libusb_get_device_list(lctx, &devs);
+    for(ssize_t i = 0; i < N && !h; ++i){
+        struct libusb_device_descriptor d;
+        if(libusb_get_bus_number(devs[i]) != a->bus || libusb_get_device_address(devs[i]) != a->addr) continue;
+        if(libusb_get_device_descriptor(devs[i], &d) || d.idVendor != vid || d.idProduct != pid) continue;
+        if((r = libusb_open(devs[i], &h))) h = NULL;
+    }
+    if(N >= 0) libusb_free_device_list(devs, 1);
+    if(h){
+        r = libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+                                    CH55_BOOTREQ, CH55_BOOTMAGIC, 0, NULL, 0, USB_TIMEOUT);
+        if(r == LIBUSB_ERROR_PIPE){ // no such request: try CDC (interface 0 is taken from cdc_acm)
+            uint8_t lc[7] = {CH55_BOOTBAUD & 0xff, (CH55_BOOTBAUD >> 8) & 0xff, 0, 0, 0, 0, 8};
+            DBG("Vendor request stalled, try line coding");
+            if(libusb_kernel_driver_active(h, 0) == 1) libusb_detach_kernel_driver(h, 0);
+            r = libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT,
+                                        0x20, 0, 0, lc, sizeof(lc), USB_TIMEOUT);
+        }
+        // device could drop off before status stage
+        if(r == LIBUSB_ERROR_NO_DEVICE || r == LIBUSB_ERROR_IO) r = 0;
+        libusb_close(h);
+    }
+    libusb_exit(lctx);
+    if(r < 0) WARNX("ch55_appboot(): %s", libusb_error_name(r));
+    return r < 0;
+}
+
+// read number from sysfs attribute of device; @return -1 if failed
+static long sysattr(const char *dev, const char *attr, int base){
+    char fname[PATH_MAX], str[32];
+    long val = -1;
+    snprintf(fname, sizeof(fname), SYSFS_USB "%s/%s", dev, attr);
+    FILE *f = fopen(fname, "r");
+    if(!f) return -1;
+    if(fgets(str, sizeof(str), f)) val = strtol(str, NULL, base);
+    fclose(f);
+    return val;
+}
+
+/**
+ * @brief ch55_posdev - find device node of device with given VID:PID at given position using sysfs
+ *        (without enumeration)
+ * @param a (io) - position (bus and ports), its address filled if found
+ * @param vid, pid - vendor and product ID
+ * @param node (o) - name of device node
+ * @param len - length of `node`
+ * @return 0 if found
+ */
+int ch55_posdev(ch55devaddr *a, uint16_t vid, uint16_t pid, char *node, size_t len){
+    if(!a || !a->nports) return 1;
+    char name[32], *p = name, *e = name + sizeof(name);
+    p += snprintf(p, e - p, "%d", a->bus);
+    for(int i = 0; i < a->nports && p < e; ++i)
+        p += snprintf(p, e - p, "%c%d", i ? '.' : '-', a->ports[i]);
+    if(sysattr(name, "idVendor", 16) != vid || sysattr(name, "idProduct", 16) != pid) return 1;
+    long dev = sysattr(name, "devnum", 10);
+    if(sysattr(name, "busnum", 10) != a->bus || dev < 1 || dev > 127) return 1;
+    a->addr = (uint8_t) dev;
+    snprintf(node, len, "/dev/bus/usb/%03d/%03ld", a->bus, dev);
+    DBG("%s -> %s", name, node);
+    return 0;
+}
+
+/**
+ * @brief ch55_posnode - find device node of bootloader at given position using sysfs (without enumeration)
+ * @param a (io) - position (bus and ports), its address filled if found
+ * @param node (o) - name of device node
+ * @param len - length of `node`
+ * @return 0 if found
+ */
+int ch55_posnode(ch55devaddr *a, char *node, size_t len){
+    return ch55_posdev(a, CH55VID, CH55PID, node, len);
+}
+
+// position of device by number of its device node: /sys/dev/char/M:m links to sysfs directory BUS-PORT.PORT
+static int rdevpos(dev_t rdev, ch55devaddr *a){
+    char link[64], path[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/dev/char/%u:%u", major(rdev), minor(rdev));
+    if(!realpath(link, path)) return 1;
+    char *name = strrchr(path, '/'), *eptr;
+    name = name ? name + 1 : path;
+    memset(a, 0, sizeof(ch55devaddr));
+    long val = strtol(name, &eptr, 10);
+    if(eptr == name || *eptr != '-' || val < 1 || val > 255) return 1;
+    a->bus = (uint8_t) val;
+    while(*eptr == '-' || *eptr == '.'){
+        const char *str = eptr + 1;
+        val = strtol(str, &eptr, 10);
+        if(eptr == str || val < 1 || val > 255 || a->nports == sizeof(a->ports)) return 1;
+        a->ports[a->nports++] = (uint8_t) val;
+    }
+    if(*eptr || !a->nports) return 1;
+    val = sysattr(name, "devnum", 10);
+    a->addr = (val > 0) ? (uint8_t) val : 0;
+    return 0;
+}
+
+/**
+ * @brief ch55_nodepos - find position of device by its node (like /dev/bus/usb/001/005)
+ * @param node - device node
+ * @param a (o) - position
+ * @return 0 if found
+ */
+int ch55_nodepos(const char *node, ch55devaddr *a){
+    struct stat st;
+    if(stat(node, &st) || !S_ISCHR(st.st_mode)) return 1;
+    return rdevpos(st.st_rdev, a);
+}
+
+/**
+ * @brief ch55_fdpos - find position of device by its opened node
+ * @param fd - file descriptor
+ * @param a (o) - position
+ * @return 0 if found
+ */
+int ch55_fdpos(int fd, ch55devaddr *a){
+    struct stat st;
+    if(fstat(fd, &st) || !S_ISCHR(st.st_mode)) return 1;
+    return rdevpos(st.st_rdev, a);
+}
+
+// libusb >= 1.0.27 sets "no device discovery" per context; older versions have only process-wide
+// default, which would leave all contexts made later (by library user too) without devices
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x0100010A
+#define USB_NODISCOVERY
+#endif
+
+// init libusb context for wrapped descriptors (without scanning of all devices if libusb allows)
+static int initnodisc(libusb_context **ctx){
+#ifdef USB_NODISCOVERY
+    struct libusb_init_option opt = {.option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY};
+    return libusb_init_context(ctx, &opt, 1);
+#else
+    return libusb_init(ctx);
+#endif
+}
+
+// wrap opened device node and claim interface; @return handle or NULL
+static libusb_device_handle *wrapfd(libusb_context *ctx, int fd){
+    libusb_device_handle *h = NULL;
+    if(libusb_wrap_sys_device(ctx, (intptr_t) fd, &h)) return NULL;
+    if(libusb_claim_interface(h, 0)){
+        libusb_close(h);
+        return NULL;
+    }
+    return h;
+}
+
+// reopen wrapped device: find its new node by position
+static libusb_device_handle *opennode(usbpriv *p){
+    ch55devaddr a = {.bus = p->bus, .nports = (p->nports > 7) ? 7 : p->nports};
+    char node[64];
+    memcpy(a.ports, p->ports, a.nports);
+    if(ch55_posdev(&a, p->vid, p->pid, node, sizeof(node))) return NULL;
+    int fd = open(node, O_RDWR | O_CLOEXEC);
+    if(fd < 0) return NULL;
+    libusb_device_handle *h = wrapfd(p->ctx, fd);
+    if(!h){
+        close(fd);
+        return NULL;
+    }
+    if(p->ownfd) close(p->fd);
+    p->fd = fd;
+    p->ownfd = 1;
+    return h;
+}
+
+/**
+ * @brief opendev - open bootloader at given position
+ * @param ctx - libusb context
+ * @param vid, pid - VID:PID of bootloader
+ * @param a - position (bus with address and/or ports) or NULL for first found device
+ * @return handle or NULL if there's no such device (other device is never opened instead)
+ */
+static libusb_device_handle *opendev(libusb_context *ctx, uint16_t vid, uint16_t pid, const ch55devaddr *a){
+    libusb_device **devs;
+    libusb_device_handle *h = NULL;
+    if(a && !a->addr && !a->nports) a = NULL; // bus alone isn't a position
+    ssize_t N = libusb_get_device_list(ctx, &devs);
+    if(N < 0) return NULL;
+    for(ssize_t i = 0; i < N; ++i){
+        struct libusb_device_descriptor d;
+        if(libusb_get_device_descriptor(devs[i], &d) || d.idVendor != vid || d.idProduct != pid) continue;
+        if(a){
+            uint8_t ports[8];
+            if(libusb_get_bus_number(devs[i]) != a->bus) continue;
+            if(a->addr && libusb_get_device_address(devs[i]) != a->addr) continue;
+            int n = libusb_get_port_numbers(devs[i], ports, sizeof(ports));
+            if(a->nports && (n != a->nports || memcmp(ports, a->ports, n))) continue;
+        }
+        if(libusb_open(devs[i], &h)) h = NULL;
+        break;
+    }
+    libusb_free_device_list(devs, 1);
+    return h;
+}
+
+// read and drop late answers of failed transfers
+static void flushin(usbpriv *p){
+    uint8_t buf[64];
+    int n;
+    for(int i = 0; i < CH55_MAXPIPELINE; ++i)
+        if(libusb_bulk_transfer(p->devh, EPIN, buf, sizeof(buf), &n, 10)) break;
+}
+
+static int usbxfer(ch55transport *t, const uint8_t *out, int olen, uint8_t *in, int ilen){
+    usbpriv *p = (usbpriv*) t->priv;
+    int inum, onum;
+    if(!p->devh) return -1;
+    int oret = libusb_bulk_transfer(p->devh, EPOUT, (unsigned char*)out, olen, &onum, USB_TIMEOUT);
+    int iret = libusb_bulk_transfer(p->devh, EPIN, in, ilen, &inum, USB_TIMEOUT);
+    if(oret || iret || onum != olen){
+        WARNX("libusb_bulk_transfer(): %s", libusb_error_name(oret ? oret : iret));
+        if(!oret) flushin(p);
+        return -1;
+    }
+    return inum;
+}
+
+static int usbsend(ch55transport *t, const uint8_t *out, int olen){
+    usbpriv *p = (usbpriv*) t->priv;
+    int onum;
+    if(!p->devh) return 1;
+    return libusb_bulk_transfer(p->devh, EPOUT, (unsigned char*)out, olen, &onum, USB_TIMEOUT);
+}
+
+// one packet in flight for pipelined write/verify
+typedef struct{
+    struct libusb_transfer *out;    // command
+    struct libusb_transfer *in;     // answer
+    const uint8_t *cmd;
+    uint8_t ans[64];
+    int outdone;                    // ==1 when `out` is finished
+    int indone;                     // ==1 when `in` is finished
+} xferslot;
+
+static void LIBUSB_CALL xfercb(struct libusb_transfer *t){
+    *(int*)t->user_data = 1;
+}
+
+// wait for slot's transfers
+static void waitslot(libusb_context *ctx, xferslot *sl){
+    while(!sl->outdone || !sl->indone){
+        if(libusb_handle_events_completed(ctx, sl->outdone ? &sl->indone : &sl->outdone)) break;
+    }
+}
+
+// pipelined transfers by libusb async API: up to `depth` packets in flight
+static int usbpipeline(ch55transport *t, int depth, int ilen, const ch55pipecb *cb){
+    usbpriv *p = (usbpriv*) t->priv;
+    int ret = 0, eof = 0, stop = 0;
+    if(!p->devh) return -1;
+    if(depth < 2 || ilen > 64) return ch55_pipeline_seq(t, ilen, cb);
+    xferslot *slots = MALLOC(xferslot, depth);
+    for(int i = 0; i < depth; ++i){
+        slots[i].out = libusb_alloc_transfer(0);
+        slots[i].in = libusb_alloc_transfer(0);
+        if(!slots[i].out || !slots[i].in){
+            WARNX("libusb_alloc_transfer()");
+            ret = -1;
+        }
+    }
+    size_t head = 0, tail = 0; // next slot to fill, oldest slot in flight
+    while(!ret && !stop){
+        while(!eof && head - tail < (size_t)depth){ // fill pipeline
+            xferslot *sl = &slots[head % depth];
+            int len;
+            sl->cmd = cb->next(cb->arg, &len);
+            if(!sl->cmd){
+                eof = 1;
+                break;
+            }
+            sl->outdone = sl->indone = 0;
+            libusb_fill_bulk_transfer(sl->out, p->devh, EPOUT, (unsigned char*)sl->cmd, len, xfercb, &sl->outdone, USB_TIMEOUT);
+            libusb_fill_bulk_transfer(sl->in, p->devh, EPIN, sl->ans, ilen, xfercb, &sl->indone, USB_TIMEOUT);
+            if(libusb_submit_transfer(sl->out)){
+                WARNX("libusb_submit_transfer()");
+                ret = -1;
+                break;
+            }
+            ++head;
+            if(libusb_submit_transfer(sl->in)){
+                WARNX("libusb_submit_transfer()");
+                sl->indone = 1;
+                ret = -1;
+                break;
+            }
+        }
+        if(ret || tail == head) break;
+        xferslot *sl = &slots[tail % depth];
+        waitslot(p->ctx, sl);
+        ++tail;
+        if(sl->out->status != LIBUSB_TRANSFER_COMPLETED || sl->out->actual_length != sl->out->length ||
+           sl->in->status != LIBUSB_TRANSFER_COMPLETED){
+            WARNX(_("Transfer of packet 0x%02X%02X failed"), sl->cmd[4], sl->cmd[3]);
+            ret = -1;
+            break;
+        }
+        stop = cb->check(cb->arg, sl->cmd, sl->ans, sl->in->actual_length);
+    }
+    // cancel all that still in flight
+    for(size_t i = tail; i < head; ++i){
+        xferslot *sl = &slots[i % depth];
+        if(!sl->outdone) libusb_cancel_transfer(sl->out);
+        if(!sl->indone) libusb_cancel_transfer(sl->in);
+    }
+    for(size_t i = tail; i < head; ++i) waitslot(p->ctx, &slots[i % depth]);
+    if(ret) flushin(p);
+    for(int i = 0; i < depth; ++i){
+        libusb_free_transfer(slots[i].out);
+        libusb_free_transfer(slots[i].in);
+    }
+    FREE(slots);
+    return ret;
+}
+
+// find and open device at the same position (bus and ports)
+static libusb_device_handle *openpos(usbpriv *p){
+    if(p->wrapped) return opennode(p);
+    libusb_device **devs;
+    libusb_device_handle *h = NULL;
+    ssize_t N = libusb_get_device_list(p->ctx, &devs);
+    if(N < 0) return NULL;
+    for(ssize_t i = 0; i < N; ++i){
+        struct libusb_device_descriptor d;
+        uint8_t ports[8];
+        if(libusb_get_device_descriptor(devs[i], &d)) continue;
+        if(d.idVendor != p->vid || d.idProduct != p->pid) continue;
+        if(libusb_get_bus_number(devs[i]) != p->bus) continue;
+        int n = libusb_get_port_numbers(devs[i], ports, sizeof(ports));
+        if(n != p->nports || memcmp(ports, p->ports, n)) continue;
+        if(libusb_open(devs[i], &h)) h = NULL;
+        break;
+    }
+    libusb_free_device_list(devs, 1);
+    if(h && libusb_claim_interface(h, 0)){
+        libusb_close(h);
+        h = NULL;
+    }
+    return h;
+}
+
+// close device and wait until it appears again at the same position
+static int usbreopen(ch55transport *t){
+    usbpriv *p = (usbpriv*) t->priv;
+    if(p->nports < 1){ // bus alone could give device of other worker
+        WARNX(_("Position of device is unknown, can't reopen it"));
+        return 1;
+    }
+    if(p->devh){
+        libusb_release_interface(p->devh, 0);
+        libusb_close(p->devh);
+        p->devh = NULL;
+    }
+    double t0 = dtime();
+    do{
+        usleep(REOPEN_POLL);
+        p->devh = openpos(p);
+    }while(!p->devh && dtime() - t0 < REOPEN_TIMEOUT);
+    if(!p->devh){
+        WARNX(_("Device at bus %d didn't appear again"), p->bus);
+        return 1;
+    }
+    DBG("Reopened");
+    return 0;
+}
+
+static void usbclose(ch55transport *t){
+    usbpriv *p = (usbpriv*) t->priv;
+    if(p->devh){
+        libusb_release_interface(p->devh, 0);
+        libusb_close(p->devh);
+    }
+    if(p->ownfd) close(p->fd);
+    if(p->ownctx) libusb_exit(p->ctx);
+    FREE(p);
+    FREE(t);
+}
+
+// make transport structure for opened device
+static ch55transport *mktransport(usbpriv *p){
+    if(!p->wrapped && libusb_claim_interface(p->devh, 0)){
+        WARNX("libusb_claim_interface()");
+        libusb_close(p->devh);
+        if(p->ownctx) libusb_exit(p->ctx);
+        FREE(p);
+        return NULL;
+    }
+    libusb_device *dev = p->wrapped ? NULL : libusb_get_device(p->devh);
+    if(dev){
+        p->bus = libusb_get_bus_number(dev);
+        p->nports = libusb_get_port_numbers(dev, p->ports, sizeof(p->ports));
+        if(p->nports < 0) p->nports = 0;
+    }
+    ch55transport *t = MALLOC(ch55transport, 1);
+    t->name = "usb";
+    t->priv = p;
+    t->xfer = usbxfer;
+    t->send = usbsend;
+    t->pipeline = usbpipeline;
+    t->reopen = usbreopen;
+    t->close = usbclose;
+    return t;
+}
+
+/**
+ * @brief ch55_usbtransport_id - open USB device of bootloader with given VID:PID
+ * @param vid, pid - VID:PID of bootloader (e.g. CH55FB_VID, CH55FB_PID of custom one)
+ * @param a - device position or NULL for first found device
+ * @return transport or NULL if failed
+ */
+ch55transport *ch55_usbtransport_id(uint16_t vid, uint16_t pid, const ch55devaddr *a){
+    FNAME();
+    ch55devaddr pos;
+    if(a && a->nports){ // try to open directly
+        char node[64];
+        pos = *a;
+        if(!ch55_posdev(&pos, vid, pid, node, sizeof(node)) && (!a->addr || pos.addr == a->addr)){
+#ifdef USB_NODISCOVERY
+            ch55transport *t = ch55_usbtransport_node(node);
+            if(t){
+                usbpriv *p = (usbpriv*) t->priv;
+                p->vid = vid;
+                p->pid = pid;
+                return t;
+            }
+#else
+            a = &pos; // devices are enumerated anyway: open by bus and address found in sysfs
+#endif
+        }
+    }
+    usbpriv *p = MALLOC(usbpriv, 1);
+    p->vid = vid;
+    p->pid = pid;
+    if(libusb_init(&p->ctx)){
+        WARNX("libusb_init()");
+        FREE(p);
+        return NULL;
+    }
+    p->devh = opendev(p->ctx, vid, pid, a);
+    if(!p->devh){
+        WARNX(_("No devices found"));
+        libusb_exit(p->ctx);
+        FREE(p);
+        return NULL;
+    }
+    p->ownctx = 1;
+    return mktransport(p);
+}
+
+/**
+ * @brief ch55_usbtransport - open bootloader USB device
+ * @param a - device position or NULL for first found device
+ * @return transport or NULL if failed
+ */
+ch55transport *ch55_usbtransport(const ch55devaddr *a){
+    return ch55_usbtransport_id(CH55VID, CH55PID, a);
+}
+
+/**
+ * @brief ch55_usbtransport_dev - open bootloader device using existing libusb context
+ * @param ctx - context (should live longer than transport)
+ * @param dev - device
+ * @return transport or NULL if failed
+ */
+ch55transport *ch55_usbtransport_dev(libusb_context *ctx, libusb_device *dev){
+    FNAME();
+    usbpriv *p = MALLOC(usbpriv, 1);
+    p->vid = CH55VID;
+    p->pid = CH55PID;
+    p->ctx = ctx;
+    if(libusb_open(dev, &p->devh)){
+        WARNX(_("Can't open device %d:%d"), libusb_get_bus_number(dev), libusb_get_device_address(dev));
+        FREE(p);
+        return NULL;
+    }
+    return mktransport(p);
+}
+
+// make transport of opened device node
+static ch55transport *fdtransport(int fd, int ownfd){
+    usbpriv *p = MALLOC(usbpriv, 1);
+    p->vid = CH55VID;
+    p->pid = CH55PID;
+    p->fd = fd;
+    p->ownfd = ownfd;
+    if(initnodisc(&p->ctx)){
+        WARNX("libusb_init()");
+        if(ownfd) close(fd);
+        FREE(p);
+        return NULL;
+    }
+    p->ownctx = 1;
+    p->devh = wrapfd(p->ctx, fd);
+    if(!p->devh){
+        WARNX(_("Can't use descriptor %d as bootloader device"), fd);
+        libusb_exit(p->ctx);
+        if(ownfd) close(fd);
+        FREE(p);
+        return NULL;
+    }
+    p->wrapped = 1;
+    ch55devaddr a;
+    if(!ch55_fdpos(fd, &a)){ // known position allows to reopen device after re-enumeration
+        p->bus = a.bus;
+        p->nports = a.nports;
+        memcpy(p->ports, a.ports, a.nports);
+    }
+    return mktransport(p);
+}
+
+/**
+ * @brief ch55_usbtransport_fd - use bootloader device opened by caller (e.g. passed by udev or another process)
+ * without enumeration of USB devices
+ * @param fd - file descriptor of device node (it isn't closed with transport)
+ * @return transport or NULL if failed
+ */
+ch55transport *ch55_usbtransport_fd(int fd){
+    FNAME();
+    return fdtransport(fd, 0);
+}
+
+/**
+ * @brief ch55_usbtransport_node - open bootloader device by its node without enumeration of USB devices
+ * @param node - device node (like /dev/bus/usb/001/005)
+ * @return transport or NULL if failed
+ */
+ch55transport *ch55_usbtransport_node(const char *node){
+    FNAME();
+    int fd = open(node, O_RDWR | O_CLOEXEC);
+    if(fd < 0){
+        WARN(_("Can't open %s"), node);
+        return NULL;
+    }
+    return fdtransport(fd, 1);
+}
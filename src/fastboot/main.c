@@ -0,0 +1,363 @@
+// Custom USB bootloader linked at FASTBOOT_ADDR (last 2K of flash below write-protected WCH ISP):
+// firmware is streamed by `ch55tool -F` through double-buffered bulk endpoint 2 with one acknowledgement
+// per FASTBOOT_WINDOW packets and checked by CRC computed here instead of second pass.
+// It's entered from application by usbboot.c (built with -DUSBBOOT_FAST) or from empty flash: erased
+// bytes (0x00) are NOPs running up to this address. Works without interrupts: vectors belong to application.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <ch554.h>
+#include <ch554_usb.h>
+#include <debug.h>
+#include <fastboot.h>
+
+#ifndef USB_VID
+#define USB_VID     FASTBOOT_VID
+#endif
+#ifndef USB_PID
+#define USB_PID     FASTBOOT_PID
+#endif
+
+__xdata __at (0x0000) uint8_t Ep0Buffer[DEFAULT_ENDP0_SIZE];
+// endpoint 2: two OUT buffers (selected by DATA0/DATA1 of packet) followed by two IN buffers
+__xdata __at (0x0040) uint8_t Ep2Buffer[4 * MAX_PACKET_SIZE];
+#define UsbSetupBuf ((PXUSB_SETUP_REQ)Ep0Buffer)
+#define Ep2In       (Ep2Buffer + 2 * MAX_PACKET_SIZE)
+
+__code uint8_t DevDesc[] = {
+    0x12, USB_DESCR_TYP_DEVICE, 0x10, 0x01, 0xFF, 0x00, 0x00, DEFAULT_ENDP0_SIZE,
+    USB_VID & 0xFF, USB_VID >> 8, USB_PID & 0xFF, USB_PID >> 8,
+    FASTBOOT_VERSION, 0x00, 0x00, 0x00, 0x00, 0x01
+};
+__code uint8_t CfgDesc[] = {
+    0x09, USB_DESCR_TYP_CONFIG, 0x20, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,     // bus powered, 100mA
+    0x09, USB_DESCR_TYP_INTERF, 0x00, 0x00, 0x02, 0xFF, 0x00, 0x00, 0x00,     // vendor class, 2 endpoints
+    0x07, USB_DESCR_TYP_ENDP, 0x82, 0x02, MAX_PACKET_SIZE, 0x00, 0x00,        // bulk IN
+    0x07, USB_DESCR_TYP_ENDP, 0x02, 0x02, MAX_PACKET_SIZE, 0x00, 0x00         // bulk OUT
+};
+
+static uint8_t SetupReq, UsbConfig;
+static uint16_t SetupLen;
+static __code uint8_t *pDescr;
+
+// OUT packets got but not processed yet: at most one per buffer, endpoint NAKs when both are full
+static uint8_t rxbuf[2], rxlen[2], rxhead, rxcount;
+static __bit txbusy, resetreq;
+// data stream of FB_WRITE
+static uint16_t wraddr, wrleft, wrseq;
+static uint8_t wrpkts, wrstatus;
+
+// next part of descriptor into endpoint 0 buffer; @return its length
+static uint8_t descrpart()
+{
+    uint8_t len = SetupLen >= DEFAULT_ENDP0_SIZE ? DEFAULT_ENDP0_SIZE : SetupLen;
+    memcpy(Ep0Buffer, pDescr, len);
+    SetupLen -= len;
+    pDescr += len;
+    return len;
+}
+
+// endpoint 2 to initial state (DATA0 in both directions), data stream is dropped
+static void ep2reset()
+{
+    UEP2_CTRL = bUEP_AUTO_TOG | UEP_R_RES_ACK | UEP_T_RES_NAK;
+    UEP2_T_LEN = 0;
+    rxhead = 0;
+    rxcount = 0;
+    txbusy = 0;
+    wrleft = 0;
+}
+
+/*******************************************************************************
+* Function Name  : flashwe(on)
+* Description    : Enable or disable writing of code flash
+*******************************************************************************/
+static void flashwe(uint8_t on)
+{
+    SAFE_MOD = 0x55;
+    SAFE_MOD = 0xAA;
+    if(on) GLOBAL_CFG |= bCODE_WE;
+    else GLOBAL_CFG &= ~bCODE_WE;
+    SAFE_MOD = 0x00;
+}
+
+/*******************************************************************************
+* Function Name  : flashword(addr, w)
+* Description    : Write word of code flash if it differs
+* Input          : addr - even address
+*                  w - data
+* Return         : 0 if OK
+*******************************************************************************/
+static uint8_t flashword(uint16_t addr, uint16_t w)
+{
+    if(*(__code uint16_t *)addr == w) return 0;
+    ROM_ADDR = addr;
+    ROM_DATA = w;
+    if(!(ROM_STATUS & bROM_ADDR_OK)) return 1;
+    ROM_CTRL = ROM_CMD_WRITE;
+    return (ROM_STATUS ^ bROM_ADDR_OK) & 0x7F;
+}
+
+/*******************************************************************************
+* Function Name  : crc16(addr, n)
+* Description    : CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF) of code flash
+* Input          : addr - start of region
+*                  n - its length
+*******************************************************************************/
+static uint16_t crc16(uint16_t addr, uint16_t n)
+{
+    __code uint8_t *p = (__code uint8_t *)addr;
+    uint16_t crc = 0xFFFF;
+    uint8_t x;
+    while(n--){
+        x = (crc >> 8) ^ *p++;
+        x ^= x >> 4;
+        crc = (crc << 8) ^ ((uint16_t)x << 12) ^ ((uint16_t)x << 5) ^ x;
+    }
+    return crc;
+}
+
+// send answer prepared in IN buffer
+static void answer(uint8_t len)
+{
+    UEP2_T_LEN = len;
+    UEP2_CTRL = UEP2_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_ACK;
+    txbusy = 1;
+}
+
+// process next packet of data stream
+static void writedata(__xdata uint8_t *buf, uint8_t len, __xdata uint8_t *ans)
+{
+    uint8_t i;
+    if(len > wrleft) len = wrleft;
+    for(i = 0; i + 1 < len; i += 2){
+        if(flashword(wraddr, buf[i] | ((uint16_t)buf[i + 1] << 8))) wrstatus = FB_FLASHERR;
+        wraddr += 2;
+    }
+    wrleft -= len;
+    if(++wrpkts == FASTBOOT_WINDOW || !wrleft){
+        wrpkts = 0;
+        ++wrseq;
+        ans[0] = FB_WRITE | 0x80;
+        ans[1] = wrstatus;
+        ans[2] = wrseq & 0xFF;
+        ans[3] = wrseq >> 8;
+        answer(4);
+    }
+    if(!wrleft) flashwe(0);
+}
+
+/*******************************************************************************
+* Function Name  : process(buf, len)
+* Description    : Process command or data packet got by endpoint 2
+* Input          : buf - packet
+*                  len - its length
+*******************************************************************************/
+static void process(__xdata uint8_t *buf, uint8_t len)
+{
+    __xdata uint8_t *ans = Ep2In + ((UEP2_CTRL & bUEP_T_TOG) ? MAX_PACKET_SIZE : 0);
+    uint16_t addr, n;
+    if(wrleft){
+        writedata(buf, len, ans);
+        return;
+    }
+    memset(ans, 0, FB_ANSLEN);
+    ans[0] = buf[0] | 0x80;
+    addr = buf[1] | ((uint16_t)buf[2] << 8);
+    n = buf[3] | ((uint16_t)buf[4] << 8);
+    if(len != 5) ans[1] = FB_BADCMD;
+    else switch(buf[0]){
+    case FB_HELLO:
+        ans[2] = CHIP_ID;
+        ans[3] = FASTBOOT_VERSION;
+        ans[4] = FASTBOOT_WINDOW;
+        ans[5] = FASTBOOT_ADDR & 0xFF;
+        ans[6] = FASTBOOT_ADDR >> 8;
+        memcpy(&ans[7], (__code uint8_t *)ROM_CHIP_ID_LO, 4);
+        break;
+    case FB_WRITE:
+    case FB_FILL:
+        if((addr & 1) || (n & 1) || addr > FASTBOOT_ADDR || n > FASTBOOT_ADDR - addr){
+            ans[1] = FB_BADADDR;
+            break;
+        }
+        if(!n) break;
+        flashwe(1);
+        if(buf[0] == FB_WRITE){                                                 // data packets follow
+            wraddr = addr;
+            wrleft = n;
+            wrseq = 0;
+            wrpkts = 0;
+            wrstatus = FB_OK;
+            break;
+        }
+        for(; n; n -= 2, addr += 2) if(flashword(addr, 0)){
+            ans[1] = FB_FLASHERR;
+            break;
+        }
+        flashwe(0);
+        break;
+    case FB_CRC:
+        if(addr > ROM_CFG_ADDR || n > ROM_CFG_ADDR - addr){
+            ans[1] = FB_BADADDR;
+            break;
+        }
+        n = crc16(addr, n);
+        ans[2] = n & 0xFF;
+        ans[3] = n >> 8;
+        break;
+    case FB_RESET:
+        resetreq = 1;
+        return;
+    default:
+        ans[1] = FB_BADCMD;
+    }
+    answer(FB_ANSLEN);
+}
+
+static void usbtransfer()
+{
+    uint8_t len, i;
+    switch(USB_INT_ST & (MASK_UIS_TOKEN | MASK_UIS_ENDP)){
+    case UIS_TOKEN_OUT | 2:
+        if(!U_TOG_OK) break;
+        i = (rxhead + rxcount) & 1;
+        rxbuf[i] = (UEP2_CTRL & bUEP_R_TOG) ? 0 : 1;                           // toggle is already switched
+        rxlen[i] = USB_RX_LEN;
+        if(++rxcount == 2) UEP2_CTRL = UEP2_CTRL & ~MASK_UEP_R_RES | UEP_R_RES_NAK;
+        break;
+    case UIS_TOKEN_IN | 2:
+        UEP2_CTRL = UEP2_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_NAK;
+        txbusy = 0;
+        break;
+    case UIS_TOKEN_SETUP | 0:
+        len = 0xFF;                                                            // stall unknown requests
+        if(USB_RX_LEN == sizeof(USB_SETUP_REQ)){
+            SetupLen = ((uint16_t)UsbSetupBuf->wLengthH << 8) | UsbSetupBuf->wLengthL;
+            SetupReq = UsbSetupBuf->bRequest;
+            if((UsbSetupBuf->bRequestType & USB_REQ_TYP_MASK) == USB_REQ_TYP_STANDARD){
+                switch(SetupReq){
+                case USB_GET_DESCRIPTOR:
+                    if(UsbSetupBuf->wValueH == USB_DESCR_TYP_DEVICE){
+                        pDescr = DevDesc;
+                        len = sizeof(DevDesc);
+                    }else if(UsbSetupBuf->wValueH == USB_DESCR_TYP_CONFIG){
+                        pDescr = CfgDesc;
+                        len = sizeof(CfgDesc);
+                    }else break;
+                    if(SetupLen > len) SetupLen = len;
+                    len = descrpart();
+                    break;
+                case USB_SET_ADDRESS:
+                    SetupLen = UsbSetupBuf->wValueL;                           // set after status stage
+                    len = 0;
+                    break;
+                case USB_GET_CONFIGURATION:
+                    Ep0Buffer[0] = UsbConfig;
+                    len = 1;
+                    break;
+                case USB_SET_CONFIGURATION:
+                    UsbConfig = UsbSetupBuf->wValueL;
+                    ep2reset();
+                    len = 0;
+                    break;
+                case USB_CLEAR_FEATURE:                                        // clear halt of endpoint 2 by host
+                    if((UsbSetupBuf->bRequestType & USB_REQ_RECIP_MASK) == USB_REQ_RECIP_ENDP &&
+                       (UsbSetupBuf->wIndexL & 0x7F) == 2) ep2reset();
+                    len = 0;
+                    break;
+                case USB_GET_STATUS:
+                    Ep0Buffer[0] = 0;
+                    Ep0Buffer[1] = 0;
+                    len = 2;
+                    break;
+                }
+            }
+        }
+        if(len == 0xFF){
+            SetupReq = 0xFF;
+            UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_STALL | UEP_T_RES_STALL;
+        }else{
+            UEP0_T_LEN = len;                                                  // data or status stage: DATA1
+            UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_ACK | UEP_T_RES_ACK;
+        }
+        break;
+    case UIS_TOKEN_IN | 0:
+        if(SetupReq == USB_GET_DESCRIPTOR){
+            UEP0_T_LEN = descrpart();
+            UEP0_CTRL ^= bUEP_T_TOG;
+        }else{
+            if(SetupReq == USB_SET_ADDRESS) USB_DEV_AD = USB_DEV_AD & bUDA_GP_BIT | (uint8_t)SetupLen;
+            UEP0_T_LEN = 0;
+            UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+        }
+        break;
+    case UIS_TOKEN_OUT | 0:                                                    // status stage of IN transfer
+        UEP0_T_LEN = 0;
+        UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+        break;
+    }
+    UIF_TRANSFER = 0;
+}
+
+static void USBDeviceInit()
+{
+    USB_CTRL = 0x00;
+    UEP0_DMA = (uint16_t)Ep0Buffer;
+    UEP2_DMA = (uint16_t)Ep2Buffer;
+    UEP2_3_MOD = bUEP2_RX_EN | bUEP2_TX_EN | bUEP2_BUF_MOD;                    // ping-pong buffers in both directions
+    UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+    UEP0_T_LEN = 0;
+    ep2reset();
+    USB_DEV_AD = 0x00;
+    UDEV_CTRL = bUD_PD_DIS;                                                    // full speed, pulldowns off
+    USB_CTRL = bUC_DEV_PU_EN | bUC_INT_BUSY | bUC_DMA_EN;
+    UDEV_CTRL |= bUD_PORT_EN;
+    USB_INT_FG = 0xFF;
+}
+
+// detach from USB and start application from its reset vector
+static void startapp()
+{
+    mDelaymS(5);
+    USB_CTRL = bUC_RESET_SIE | bUC_CLR_ALL;
+    UDEV_CTRL = 0;
+    USB_DEV_AD = 0;
+    USB_INT_FG = 0xFF;
+    UEP2_3_MOD = 0;
+    mDelaymS(50);                                                              // host polls hub port at least each 32ms
+    USB_CTRL = 0;
+    __asm
+        ljmp 0x0000
+    __endasm;
+}
+
+void main()
+{
+    EA = 0;                                                                    // interrupt vectors are application's
+    IE_USB = 0;
+    CfgFsys();
+    mDelaymS(5);                                                               // wait for power supply
+    USBDeviceInit();
+    while(1){
+        if(UIF_TRANSFER) usbtransfer();
+        if(UIF_BUS_RST){
+            UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+            ep2reset();
+            USB_DEV_AD = 0;
+            UsbConfig = 0;
+            UIF_SUSPEND = 0;
+            UIF_TRANSFER = 0;
+            UIF_BUS_RST = 0;
+        }
+        if(UIF_SUSPEND) UIF_SUSPEND = 0;
+        // the other buffer receives next packet while this one is written into flash
+        if(rxcount && !txbusy){
+            process(Ep2Buffer + rxbuf[rxhead] * MAX_PACKET_SIZE, rxlen[rxhead]);
+            rxhead ^= 1;
+            if(rxcount-- == 2) UEP2_CTRL = UEP2_CTRL & ~MASK_UEP_R_RES | UEP_R_RES_ACK;
+        }
+        if(resetreq) startapp();
+    }
+}
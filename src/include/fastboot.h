@@ -0,0 +1,36 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : fastboot.h
+* Version            : V1.0
+* Description        : Protocol of custom USB bootloader (../fastboot), keep in sync with
+*                      CH55xtool/ch55isp.h
+*******************************************************************************/
+
+#ifndef __FASTBOOT_H__
+#define __FASTBOOT_H__
+
+/* start of bootloader: last 2K of flash below WCH ISP (BOOT_ADDR), application should be less */
+#define FASTBOOT_ADDR     0x3000
+#define FASTBOOT_VERSION  1
+
+/* VID:PID of bootloader (pid.codes test PID) */
+#define FASTBOOT_VID      0x1209
+#define FASTBOOT_PID      0x0002
+
+/* packets of data stream between acknowledgements */
+#define FASTBOOT_WINDOW   8
+
+/* commands: single packet [code, addrL, addrH, lenL, lenH], answer [code | 0x80, status, ...] */
+#define FB_HELLO          0x01      /* answer: chip ID, version, window, FASTBOOT_ADDR (2 bytes), unique ID (4 bytes) */
+#define FB_WRITE          0x02      /* `len` (even) bytes of raw data follow, acknowledgement [0x82, status, seqL, seqH]
+                                       after each FASTBOOT_WINDOW packets and after the last one */
+#define FB_FILL           0x03      /* fill region with erased value (only non-empty words are written) */
+#define FB_CRC            0x04      /* answer: CRC-16/CCITT (0x1021, init 0xFFFF) of region, little-endian */
+#define FB_RESET          0x05      /* no answer: detach and start application */
+#define FB_ANSLEN         16
+
+#define FB_OK             0x00
+#define FB_BADCMD         0x01      /* unknown command or wrong length */
+#define FB_BADADDR        0x02      /* region overlaps bootloader */
+#define FB_FLASHERR       0x03      /* flash write failed */
+
+#endif
@@ -0,0 +1,73 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : usbboot.c
+* Version            : V1.0
+* Description        : Entering of ISP bootloader from running firmware on request of host, so device
+*                      could be reflashed without boot pin. Only this file should include bootloader.h.
+*                      With USBBOOT_FAST defined custom bootloader at FASTBOOT_ADDR is entered instead.
+*******************************************************************************/
+
+#include <ch554.h>
+#include <debug.h>
+#include <bootloader.h>
+#include "usbboot.h"
+#ifdef USBBOOT_FAST
+#include <fastboot.h>
+void (* __data fastboot)(void) = FASTBOOT_ADDR;
+#endif
+
+volatile __bit usbboot_pending = 0;
+
+uint8_t usbboot_setup(PXUSB_SETUP_REQ req)
+{
+    if((req->bRequestType & (USB_REQ_TYP_MASK | USB_REQ_RECIP_MASK)) != (USB_REQ_TYP_VENDOR | USB_REQ_RECIP_DEVICE))
+        return 0;
+    if(req->bRequest != USBBOOT_REQ || req->wValueL != (USBBOOT_MAGIC & 0xFF) || req->wValueH != (USBBOOT_MAGIC >> 8))
+        return 0;
+    usbboot_pending = 1;                                                       // status stage should be sent first
+    return 1;
+}
+
+void usbboot_linecoding(const uint8_t __xdata *lc)
+{
+    if(lc[0] == (USBBOOT_BAUD & 0xFF) && lc[1] == ((USBBOOT_BAUD >> 8) & 0xFF) && lc[2] == 0 && lc[3] == 0)
+        usbboot_pending = 1;
+}
+
+void usbboot_poll()
+{
+    if(!usbboot_pending) return;
+    mDelaymS(10);                                                              // let host get status stage
+    usbboot_enter();
+}
+
+void usbboot_enter()
+{
+    EA = 0;                                                                    // bootloader works without interrupts
+    IE = 0;
+    IE_EX = 0;
+    GPIO_IE = 0;
+    // disconnect: pullup off, SIE in reset, so host sees device removal and then enumerates bootloader
+    USB_INT_EN = 0;
+    USB_CTRL = bUC_RESET_SIE | bUC_CLR_ALL;
+    UDEV_CTRL = 0;
+    USB_DEV_AD = 0;
+    USB_INT_FG = 0xFF;
+    // peripherals left running by application
+    TR0 = 0;
+    TR1 = 0;
+    TR2 = 0;
+    SCON = 0;
+    SCON1 = 0;
+    SPI0_CTRL = 0;
+    PWM_CTRL = bPWM_CLR_ALL;
+    ADC_CFG = 0;
+    TKEY_CTRL = 0;
+    mDelaymS(50);                                                              // host polls hub port at least each 32ms
+    USB_CTRL = 0;
+#ifdef USBBOOT_FAST
+    fastboot();
+#else
+    bootloader();
+#endif
+    while(1);
+}
@@ -0,0 +1,46 @@
+#ifndef __USBBOOT_H__
+#define __USBBOOT_H__
+
+#include <stdint.h>
+#include <ch554_usb.h>
+
+/* Vendor request to device (bmRequestType 0x40) restarting firmware into ISP bootloader (ch55tool -A VID:PID) */
+#define USBBOOT_REQ       0xB0
+#define USBBOOT_MAGIC     0x55AA      /* wValue of request */
+/* CDC devices: SET_LINE_CODING with this baud rate does the same (stty -F /dev/ttyACM0 1200) */
+#define USBBOOT_BAUD      1200
+
+extern volatile __bit usbboot_pending;
+
+/*******************************************************************************
+* Function Name  : usbboot_setup(req)
+* Description    : Check SETUP packet of endpoint 0 for bootloader request, call it from USB interrupt
+*                  before processing of request
+* Input          : req - SETUP packet
+* Return         : 1 if it is bootloader request: answer with zero-length status stage
+*                  0 if not
+*******************************************************************************/
+extern uint8_t usbboot_setup(PXUSB_SETUP_REQ req);
+
+/*******************************************************************************
+* Function Name  : usbboot_linecoding(lc)
+* Description    : Check line coding got by CDC SET_LINE_CODING for magic baud rate
+* Input          : lc - 7 bytes of line coding (dwDTERate first)
+*******************************************************************************/
+extern void usbboot_linecoding(const uint8_t __xdata *lc);
+
+/*******************************************************************************
+* Function Name  : usbboot_poll()
+* Description    : Call from main loop: enter bootloader if it was requested
+*******************************************************************************/
+extern void usbboot_poll();
+
+/*******************************************************************************
+* Function Name  : usbboot_enter()
+* Description    : Detach from USB, stop interrupts and peripherals, jump to ISP bootloader (or to custom
+*                  one at FASTBOOT_ADDR if USBBOOT_FAST is defined)
+* Return         : never returns
+*******************************************************************************/
+extern void usbboot_enter();
+
+#endif
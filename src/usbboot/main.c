@@ -0,0 +1,154 @@
+// Minimal vendor-class USB device (endpoint 0 only) which restarts into ISP bootloader on request of
+// ch55tool -A VID:PID; add usbboot_setup() and usbboot_poll() calls to your own USB code the same way
+
+#include <stdint.h>
+#include <string.h>
+
+#include <ch554.h>
+#include <ch554_usb.h>
+#include <debug.h>
+#include <usbboot.h>
+
+#ifndef USB_VID
+#define USB_VID     0x1209
+#endif
+#ifndef USB_PID
+#define USB_PID     0x0001
+#endif
+
+__xdata __at (0x0000) uint8_t Ep0Buffer[DEFAULT_ENDP0_SIZE];
+#define UsbSetupBuf ((PXUSB_SETUP_REQ)Ep0Buffer)
+
+__code uint8_t DevDesc[] = {
+    0x12, USB_DESCR_TYP_DEVICE, 0x10, 0x01, 0xFF, 0x00, 0x00, DEFAULT_ENDP0_SIZE,
+    USB_VID & 0xFF, USB_VID >> 8, USB_PID & 0xFF, USB_PID >> 8,
+    0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+};
+__code uint8_t CfgDesc[] = {
+    0x09, USB_DESCR_TYP_CONFIG, 0x12, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,     // bus powered, 100mA
+    0x09, USB_DESCR_TYP_INTERF, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0x00      // vendor class, no endpoints
+};
+
+static uint8_t SetupReq, UsbConfig;
+static uint16_t SetupLen;
+static __code uint8_t *pDescr;
+
+// next part of descriptor into endpoint 0 buffer; @return its length
+static uint8_t descrpart()
+{
+    uint8_t len = SetupLen >= DEFAULT_ENDP0_SIZE ? DEFAULT_ENDP0_SIZE : SetupLen;
+    memcpy(Ep0Buffer, pDescr, len);
+    SetupLen -= len;
+    pDescr += len;
+    return len;
+}
+
+void DeviceInterrupt(void) __interrupt (INT_NO_USB)
+{
+    uint8_t len;
+    if(UIF_TRANSFER){
+        switch(USB_INT_ST & (MASK_UIS_TOKEN | MASK_UIS_ENDP)){
+        case UIS_TOKEN_SETUP | 0:
+            len = 0xFF;                                                        // stall unknown requests
+            if(USB_RX_LEN == sizeof(USB_SETUP_REQ)){
+                SetupLen = ((uint16_t)UsbSetupBuf->wLengthH << 8) | UsbSetupBuf->wLengthL;
+                SetupReq = UsbSetupBuf->bRequest;
+                if(usbboot_setup(UsbSetupBuf)){
+                    SetupReq = 0;
+                    len = 0;
+                }else if((UsbSetupBuf->bRequestType & USB_REQ_TYP_MASK) == USB_REQ_TYP_STANDARD){
+                    switch(SetupReq){
+                    case USB_GET_DESCRIPTOR:
+                        if(UsbSetupBuf->wValueH == USB_DESCR_TYP_DEVICE){
+                            pDescr = DevDesc;
+                            len = sizeof(DevDesc);
+                        }else if(UsbSetupBuf->wValueH == USB_DESCR_TYP_CONFIG){
+                            pDescr = CfgDesc;
+                            len = sizeof(CfgDesc);
+                        }else break;
+                        if(SetupLen > len) SetupLen = len;
+                        len = descrpart();
+                        break;
+                    case USB_SET_ADDRESS:
+                        SetupLen = UsbSetupBuf->wValueL;                       // set after status stage
+                        len = 0;
+                        break;
+                    case USB_GET_CONFIGURATION:
+                        Ep0Buffer[0] = UsbConfig;
+                        len = 1;
+                        break;
+                    case USB_SET_CONFIGURATION:
+                        UsbConfig = UsbSetupBuf->wValueL;
+                        len = 0;
+                        break;
+                    case USB_GET_STATUS:
+                        Ep0Buffer[0] = 0;
+                        Ep0Buffer[1] = 0;
+                        len = 2;
+                        break;
+                    }
+                }
+            }
+            if(len == 0xFF){
+                SetupReq = 0xFF;
+                UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_STALL | UEP_T_RES_STALL;
+            }else{
+                UEP0_T_LEN = len;                                              // data or status stage: DATA1
+                UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_ACK | UEP_T_RES_ACK;
+            }
+            break;
+        case UIS_TOKEN_IN | 0:
+            if(SetupReq == USB_GET_DESCRIPTOR){
+                UEP0_T_LEN = descrpart();
+                UEP0_CTRL ^= bUEP_T_TOG;
+            }else{
+                if(SetupReq == USB_SET_ADDRESS) USB_DEV_AD = USB_DEV_AD & bUDA_GP_BIT | (uint8_t)SetupLen;
+                UEP0_T_LEN = 0;
+                UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+            }
+            break;
+        case UIS_TOKEN_OUT | 0:                                                // status stage of IN transfer
+            UEP0_T_LEN = 0;
+            UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+            break;
+        }
+        UIF_TRANSFER = 0;
+    }
+    if(UIF_BUS_RST){
+        UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+        USB_DEV_AD = 0;
+        UsbConfig = 0;
+        UIF_SUSPEND = 0;
+        UIF_TRANSFER = 0;
+        UIF_BUS_RST = 0;
+    }
+    if(UIF_SUSPEND) UIF_SUSPEND = 0;
+}
+
+static void USBDeviceInit()
+{
+    IE_USB = 0;
+    USB_CTRL = 0x00;
+    UEP0_DMA = (uint16_t)Ep0Buffer;
+    UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
+    UEP0_T_LEN = 0;
+    USB_DEV_AD = 0x00;
+    UDEV_CTRL = bUD_PD_DIS;                                                    // full speed, pulldowns off
+    USB_CTRL = bUC_DEV_PU_EN | bUC_INT_BUSY | bUC_DMA_EN;
+    UDEV_CTRL |= bUD_PORT_EN;
+    USB_INT_FG = 0xFF;
+    USB_INT_EN = bUIE_SUSPEND | bUIE_TRANSFER | bUIE_BUS_RST;
+    IE_USB = 1;
+}
+
+void main()
+{
+    CfgFsys();
+    mDelaymS(5);                                                               // wait for power supply
+    USBDeviceInit();
+    EA = 1;
+    while(1){
+        usbboot_poll();
+        // application work here
+    }
+}